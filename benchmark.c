@@ -23,6 +23,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <math.h>
 #include "tinyexpr.h"
@@ -45,6 +47,10 @@ void bench(const char *expr, function1 func) {
 
     printf("Expression: %s\n", expr);
 
+    te_expr *n = te_compile(expr, &lk, 1, 0);
+    printf("memory  %lu bytes\n", (unsigned long)te_memory_usage(n));
+    te_free(n);
+
     printf("native ");
     start = clock();
     d = 0;
@@ -66,7 +72,7 @@ void bench(const char *expr, function1 func) {
 
 
     printf("interp ");
-    te_expr *n = te_compile(expr, &lk, 1, 0);
+    n = te_compile(expr, &lk, 1, 0);
     start = clock();
     d = 0;
     for (j = 0; j < loops; ++j)
@@ -88,6 +94,69 @@ void bench(const char *expr, function1 func) {
     printf("%.2f%% longer\n", (((double)eelapsed / nelapsed) - 1.0) * 100.0);
 
 
+
+    printf("reduce ");
+    static double column[loops];
+    for (i = 0; i < loops; ++i)
+        column[i] = i;
+    te_array arr = {&tmp, column};
+    te_reduction r;
+    te_reduce_init(&r, 0, 0, 0, 0);
+    n = te_compile(expr, &lk, 1, 0);
+    start = clock();
+    for (j = 0; j < loops; ++j)
+        te_reduce(n, &arr, 1, loops, &r);
+    const int relapsed = (clock() - start) * 1000 / CLOCKS_PER_SEC;
+    te_free(n);
+
+    printf(" %.5g", r.sum);
+    if (relapsed)
+        printf("\t%5dms\t%5dmfps\n", relapsed, loops * loops / relapsed / 1000);
+    else
+        printf("\tinf\n");
+
+
+    printf("%.2f%% longer\n", (((double)relapsed / nelapsed) - 1.0) * 100.0);
+
+
+    printf("\n");
+}
+
+
+void bench_interp(const char *expr) {
+    const int count = loops * 100;
+    int i;
+    volatile double d = 0;
+    clock_t start;
+
+    printf("Expression: %s\n", expr);
+
+    printf("compile ");
+    start = clock();
+    for (i = 0; i < count; ++i) {
+        te_expr *n = te_compile(expr, 0, 0, 0);
+        d += te_eval(n);
+        te_free(n);
+    }
+    const int celapsed = (clock() - start) * 1000 / CLOCKS_PER_SEC;
+    printf("\t%5dms\n", celapsed);
+
+    printf("interp  ");
+    start = clock();
+    for (i = 0; i < count; ++i) {
+        d += te_interp(expr, 0);
+    }
+    const int ielapsed = (clock() - start) * 1000 / CLOCKS_PER_SEC;
+    printf("\t%5dms\t%.2fx faster\n", ielapsed, ielapsed ? (double)celapsed / ielapsed : 0.0);
+
+    printf("validate");
+    start = clock();
+    for (i = 0; i < count; ++i) {
+        d += te_validate(expr, 0, 0, 0);
+    }
+    const int velapsed = (clock() - start) * 1000 / CLOCKS_PER_SEC;
+    printf("\t%5dms\t%.2fx faster\n", velapsed, velapsed ? (double)celapsed / velapsed : 0.0);
+
     printf("\n");
 }
 
@@ -120,8 +189,220 @@ double al(double a) {
     return (1/(a+1)+2/(a+2)+3/(a+3));
 }
 
+#define samples 1024
+
+static double ca, cb;
+static double as_[samples], bs_[samples];
+
+
+double time_eval(const char *expr, int flags, double alo, double ahi, double blo, double bhi) {
+    /* Returns the nanoseconds one te_eval of expr takes, a and b cycling over their ranges. */
+    const int count = loops * 200;
+    te_variable lk[] = {{"a", &ca}, {"b", &cb}};
+    volatile double d = 0;
+    clock_t start;
+    int i;
+
+    for (i = 0; i < samples; ++i) {
+        as_[i] = alo + (ahi - alo) * ((i * 37) % samples) / samples;
+        bs_[i] = blo + (bhi - blo) * ((i * 91) % samples) / samples;
+    }
+
+    te_expr *n = te_compile_ex(expr, lk, 2, flags, 0);
+    if (!n) {
+        fprintf(stderr, "cannot compile %s\n", expr);
+        exit(1);
+    }
+    start = clock();
+    for (i = 0; i < count; ++i) {
+        ca = as_[i & (samples - 1)];
+        cb = bs_[i & (samples - 1)];
+        d += te_eval(n);
+    }
+    const double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+    te_free(n);
+    (void)d;
+    return elapsed * 1e9 / count;
+}
+
+
+int calibrate(double ghz) {
+    /* Times each operator and builtin through te_eval and prints the cost
+     * table in cycles at ghz, as te_set_cost calls. */
+    typedef struct {
+        const char *name, *expr;
+        int arity;
+        double alo, ahi, blo, bhi;
+    } entry;
+
+    const entry entries[] = {
+        {"+", "a+b", 2, -10, 10, -10, 10}, {"-", "a-b", 2, -10, 10, -10, 10},
+        {"*", "a*b", 2, -10, 10, -10, 10}, {"/", "a/b", 2, -10, 10, 1, 10},
+        {"^", "a^b", 2, 0.1, 10, -3, 3}, {"%", "a%b", 2, 0, 100, 1, 10},
+        {"abs", "abs(a)", 1, -10, 10}, {"acos", "acos(a)", 1, -1, 1},
+        {"asin", "asin(a)", 1, -1, 1}, {"atan", "atan(a)", 1, -10, 10},
+        {"atan2", "atan2(a, b)", 2, -10, 10, -10, 10}, {"ceil", "ceil(a)", 1, -10, 10},
+        {"cos", "cos(a)", 1, -10, 10}, {"cosh", "cosh(a)", 1, -10, 10},
+        {"erf", "erf(a)", 1, -3, 3}, {"erfc", "erfc(a)", 1, -3, 3},
+        {"exp", "exp(a)", 1, -10, 10}, {"fac", "fac(a)", 1, 0, 30},
+        {"floor", "floor(a)", 1, -10, 10}, {"gamma", "gamma(a)", 1, 0.1, 30},
+        {"lgamma", "lgamma(a)", 1, 0.1, 30}, {"ln", "ln(a)", 1, 0.1, 100},
+        {"log10", "log10(a)", 1, 0.1, 100}, {"ncr", "ncr(a, b)", 2, 40, 200, 0, 40},
+        {"normcdf", "normcdf(a)", 1, -3, 3}, {"npr", "npr(a, b)", 2, 40, 200, 0, 40},
+        {"sin", "sin(a)", 1, -10, 10}, {"sinh", "sinh(a)", 1, -10, 10},
+        {"sqrt", "sqrt(a)", 1, 0, 100}, {"tan", "tan(a)", 1, -10, 10},
+        {"tanh", "tanh(a)", 1, -10, 10},
+    };
+
+    /* A lone variable is the cheapest evaluation, including the overhead of
+     * te_eval itself. A negation adds one call node, and a sum one more leaf,
+     * taking + and negation themselves as free. */
+    const double base = time_eval("a", 0, 0, 1, 0, 1);
+    const double call = fmax(time_eval("-a", 0, 0, 1, 0, 1) - base, 0);
+    const double leaf = fmax(time_eval("a+b", 0, 0, 1, 0, 1) - base - call, 0);
+    const double poly = fmax(time_eval("1+a+a^2+a^3+a^4+a^5+a^6+a^7+a^8", TE_OPT_POLY, 0, 1, 0, 1) - base, 0) / 8;
+    int i;
+
+    printf("/* Cost table measured at %.2f GHz. */\n", ghz);
+    printf("te_set_cost(\"variable\", %.1f);\n", leaf * ghz);
+    printf("te_set_cost(\"constant\", %.1f);\n", leaf * ghz);
+    printf("te_set_cost(\"call\", %.1f);\n", call * ghz);
+    printf("te_set_cost(\"poly\", %.1f);\n", poly * ghz);
+    te_set_cost("variable", leaf * ghz);
+    te_set_cost("constant", leaf * ghz);
+    te_set_cost("call", call * ghz);
+    te_set_cost("poly", poly * ghz);
+
+    for (i = 0; i < (int)(sizeof(entries) / sizeof(entries[0])); ++i) {
+        const entry *e = entries + i;
+        const double t = time_eval(e->expr, 0, e->alo, e->ahi, e->blo, e->bhi);
+        const double cycles = fmax(t - base - (e->arity - 1) * leaf - call, 0) * ghz;
+        printf("te_set_cost(\"%s\", %.1f);\n", e->name, cycles);
+        te_set_cost(e->name, cycles);
+    }
+
+    /* Checks the calibrated estimates against a few whole expressions. */
+    const char *checks[] = {"a+5", "sqrt(a^1.5+a^2.5)", "(1/(a+1)+2/(a+2)+3/(a+3))", "atan2(a, b)*exp(-b^2)"};
+    printf("\n");
+    for (i = 0; i < (int)(sizeof(checks) / sizeof(checks[0])); ++i) {
+        te_variable lk[] = {{"a", &ca}, {"b", &cb}};
+        te_expr *n = te_compile(checks[i], lk, 2, 0);
+        printf("/* %-28s estimate %6.1f measured %6.1f cycles */\n", checks[i], te_cost(n), time_eval(checks[i], 0, 0.1, 10, 0.1, 10) * ghz);
+        te_free(n);
+    }
+
+    return 0;
+}
+
+
+static double wall(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+int bulk(int threads) {
+    /* Compiles a large formula set one by one and with te_compile_bulk. */
+    enum {formulas = 200000, variables = 2000};
+    static char names[variables][8];
+    static double values[variables];
+    static te_variable lk[variables];
+    char **texts = malloc(sizeof(char*) * formulas);
+    te_expr **out = malloc(sizeof(te_expr*) * formulas);
+    int i, t;
+
+    for (i = 0; i < variables; ++i) {
+        sprintf(names[i], "v%d", i);
+        lk[i].name = names[i];
+        lk[i].address = values + i;
+    }
+    for (i = 0; i < formulas; ++i) {
+        texts[i] = malloc(128);
+        sprintf(texts[i], "v%d * %d + sqrt(v%d^2 + v%d) - atan2(v%d, %d.5) / (1 + v%d)",
+                i % variables, i, (i * 7) % variables, (i * 13) % variables, (i * 31) % variables, i % 97, (i * 3) % variables);
+    }
+
+    double start = wall();
+    for (i = 0; i < formulas; ++i) out[i] = te_compile(texts[i], lk, variables, 0);
+    const double serial = wall() - start;
+    for (i = 0; i < formulas; ++i) te_free(out[i]);
+    printf("%d formulas, %d variables\n", formulas, variables);
+    printf("te_compile loop          %6.0fms\n", serial * 1e3);
+
+    for (t = 1; t <= threads; t *= 2) {
+        start = wall();
+        const size_t compiled = te_compile_bulk((const char**)texts, formulas, lk, variables, 0, t, out, 0);
+        const double elapsed = wall() - start;
+        for (i = 0; i < formulas; ++i) te_free(out[i]);
+        printf("te_compile_bulk %3d thr  %6.0fms  %4.1fx  (%lu compiled)\n", t, elapsed * 1e3, serial / elapsed, (unsigned long)compiled);
+    }
+
+    for (i = 0; i < formulas; ++i) free(texts[i]);
+    free(texts);
+    free(out);
+    return 0;
+}
+
+
+int bench_bind(void) {
+    /* Compiles one formula against many binding tables, parsing it each time
+     * with te_compile and once with te_template_new. */
+    enum {tables = 10000, variables = 500};
+    static char names[variables][8];
+    static double values[variables];
+    static te_variable lk[variables];
+    const char *text = "v17 * 1.25e-2 + sqrt(v42^2 + v99^2) - v480 / (1 + exp(-v3 * 0.731))"
+                       " + v250 * v251 - v252 / 3.14159 + atan2(v1, v2) + v499 * (2 - v498)";
+    volatile double d = 0;
+    int i;
+
+    for (i = 0; i < variables; ++i) {
+        sprintf(names[i], "v%d", i);
+        lk[i].name = names[i];
+        lk[i].address = values + i;
+    }
+
+    double start = wall();
+    for (i = 0; i < tables; ++i) {
+        te_expr *n = te_compile(text, lk, variables, 0);
+        d += te_eval(n);
+        te_free(n);
+    }
+    const double compiled = wall() - start;
+
+    start = wall();
+    te_template *t = te_template_new(text);
+    for (i = 0; i < tables; ++i) {
+        te_expr *n = te_bind(t, lk, variables, 0, 0);
+        d += te_eval(n);
+        te_free(n);
+    }
+    te_template_free(t);
+    const double bound = wall() - start;
+
+    printf("%d tables of %d variables\n", tables, variables);
+    printf("te_compile   %8.2fus per table\n", compiled * 1e6 / tables);
+    printf("te_bind      %8.2fus per table  %4.1fx\n", bound * 1e6 / tables, compiled / bound);
+    (void)d;
+    return 0;
+}
+
+
 int main(int argc, char *argv[])
 {
+    if (argc > 1 && !strcmp(argv[1], "calibrate")) {
+        return calibrate(argc > 2 ? atof(argv[2]) : 3.0);
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "bind")) {
+        return bench_bind();
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "bulk")) {
+        return bulk(argc > 2 ? atoi(argv[2]) : 8);
+    }
+
 
     bench("a+5", a5);
     bench("5+a+5", a55);
@@ -132,5 +413,9 @@ int main(int argc, char *argv[])
     bench("(a+5)*2", a52);
     bench("(1/(a+1)+2/(a+2)+3/(a+3))", al);
 
+    bench_interp("5+5");
+    bench_interp("sqrt(5^2+7^2+11^2+(8-2)^2)");
+    bench_interp("(1/(3+1)+2/(3+2)+3/(3+3))*atan2(1, 2)");
+
     return 0;
 }
@@ -0,0 +1,154 @@
+/*
+ * TINYEXPR - Tiny recursive descent parser and evaluation engine in C
+ *
+ * Copyright (c) 2015, 2016 Lewis Van Winkle
+ *
+ * http://CodePlea.com
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software
+ * in a product, an acknowledgement in the product documentation would be
+ * appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/* Compares the C++ wrapper in tinyexpr.hpp with the C API it wraps, and
+ * formulas parsed at compile time by tinyexpr_ct.hpp with native code.
+ * Both rows of each pair should take the same time. */
+
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+#include "tinyexpr.hpp"
+#include "tinyexpr_ct.hpp"
+
+
+
+#define loops 10000
+
+
+
+static int elapsed(clock_t start) {
+    return (int)((clock() - start) * 1000 / CLOCKS_PER_SEC);
+}
+
+
+static void report(const char *label, double d, int ms) {
+    printf("%-10s %.5g\t%5dms\n", label, d, ms);
+}
+
+
+void bench(const char *expr) {
+    int i, j;
+    double d;
+    double a, b = 3;
+    clock_t start;
+
+    printf("Expression: %s\n", expr);
+
+    te_variable lk[] = {{"a", &a}, {"b", &b}};
+    te_expr *n = te_compile(expr, lk, 2, 0);
+
+    te::Bindings bindings;
+    bindings.variable("a", a).variable("b", b);
+    te::Expression e(expr, bindings);
+
+    start = clock();
+    d = 0;
+    for (j = 0; j < loops; ++j)
+        for (i = 0; i < loops; ++i) {
+            a = i;
+            d += te_eval(n);
+        }
+    report("c eval", d, elapsed(start));
+
+    start = clock();
+    d = 0;
+    for (j = 0; j < loops; ++j)
+        for (i = 0; i < loops; ++i) {
+            a = i;
+            d += e();
+        }
+    report("c++ eval", d, elapsed(start));
+
+    std::vector<double> column(loops), out(loops);
+    for (i = 0; i < loops; ++i) column[i] = i;
+
+    start = clock();
+    d = 0;
+    for (j = 0; j < loops; ++j) {
+        const te_array arrays[] = {{&a, column.data()}};
+        te_eval_batch(n, arrays, 1, loops, out.data());
+        d += out[j];
+    }
+    report("c batch", d, elapsed(start));
+
+    start = clock();
+    d = 0;
+    for (j = 0; j < loops; ++j) {
+        e.eval(out, column);
+        d += out[j];
+    }
+    report("c++ batch", d, elapsed(start));
+
+    printf("\n");
+    te_free(n);
+}
+
+
+template<te::ct::fixed_string S>
+void bench_static(double (*native)(double)) {
+    int i, j;
+    double d;
+    clock_t start;
+
+    printf("Expression: %s\n", S.data);
+
+    start = clock();
+    d = 0;
+    for (j = 0; j < loops; ++j)
+        for (i = 0; i < loops; ++i)
+            d += native(i);
+    report("native", d, elapsed(start));
+
+    constexpr auto f = te::ct::compile<S, "a">;
+    start = clock();
+    d = 0;
+    for (j = 0; j < loops; ++j)
+        for (i = 0; i < loops; ++i)
+            d += f(i);
+    report("static", d, elapsed(start));
+
+    printf("\n");
+}
+
+
+static double a5(double a) {return a+5;}
+static double as(double a) {return sqrt(pow(a, 1.5) + pow(a, 2.5));}
+static double al(double a) {return (1/(a+1)+2/(a+2)+3/(a+3));}
+
+
+int main(int argc, char *argv[])
+{
+    bench("sqrt(a^1.5+a^2.5)");
+    bench("a*b+5");
+    bench("(a+b)*(a-b)/2");
+    bench("a*a*a - 2*a + 1");
+
+    bench_static<"a+5">(a5);
+    bench_static<"sqrt(a^1.5+a^2.5)">(as);
+    bench_static<"(1/(a+1)+2/(a+2)+3/(a+3))">(al);
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include "tinyexpr.hpp"
+#include <cstdio>
+#include <vector>
+
+
+/* An example of the C++ wrapper: binding struct members and lambdas,
+ * and evaluating a whole column at once. */
+struct Particle {
+    double mass, speed;
+};
+
+
+int main(int argc, char *argv[])
+{
+    Particle p = {2.0, 3.0};
+    const double scale = 0.5;
+
+    te::Bindings b;
+    b.member("m", p, &Particle::mass)
+     .member("v", p, &Particle::speed)
+     .function("half", [](double x) { return x / 2; })
+     .function("scaled", [scale](double x) { return x * scale; });
+
+    const char *expression = "half(m * v^2) + scaled(v)";
+    printf("Evaluating:\n\t%s\n", expression);
+
+    try {
+        te::Expression e(expression, b);
+        printf("Result:\n\t%f\n", e());
+
+        /* Columns bind to the variables in the order they were added. */
+        std::vector<double> mass = {1, 2, 3, 4}, speed = {4, 3, 2, 1}, out(4);
+        e.eval(out, mass, speed);
+        printf("Batch:\n");
+        for (double r : out) printf("\t%f\n", r);
+    } catch (const te::Error &err) {
+        /* Show the user where the error is at. */
+        printf("\t%*s^\nError near here\n", err.position() - 1, "");
+    }
+
+    return 0;
+}
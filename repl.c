@@ -2,6 +2,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #ifdef USE_READLINE
 #include <readline/readline.h>
@@ -62,6 +68,361 @@ static void repl() {
     }
 }
 
+/* Columnar mode: evaluates expressions over whole files of rows. */
+
+#define MAX_COLUMNS 64
+#define MAX_EXPRESSIONS 16
+#define MAX_THREADS 64
+#define CHUNK_ROWS (1 << 18)
+
+typedef struct column {
+    const char *name;
+    const double *values;
+    size_t rows;
+    double slot;
+} column;
+
+typedef struct job {
+    te_expr **exprs;
+    int expr_count;
+    te_array *arrays;
+    int array_count;
+    size_t first, rows;
+    double **out;
+} job;
+
+static column columns[MAX_COLUMNS];
+static int column_count = 0;
+
+
+static const double *map_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return (const double *)"";
+    }
+
+    void *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+    madvise(data, *size, MADV_SEQUENTIAL);
+    return data;
+}
+
+
+static void unmap_file(const void *data, size_t size) {
+    if (size) munmap((void *)data, size);
+}
+
+
+static int add_column(const char *name, const double *values, size_t rows) {
+    if (column_count == MAX_COLUMNS) {
+        fprintf(stderr, "Too many columns\n");
+        return -1;
+    }
+    columns[column_count].name = name;
+    columns[column_count].values = values;
+    columns[column_count].rows = rows;
+    ++column_count;
+    return 0;
+}
+
+
+static int little_endian(void) {
+    const double one = 1;
+    unsigned char bytes[sizeof(double)];
+    memcpy(bytes, &one, sizeof(bytes));
+    return sizeof(double) == 8 && bytes[7] == 0x3f && bytes[6] == 0xf0;
+}
+
+
+static int load_raw(char *arg) {
+    /* name=path, a file of little-endian IEEE 754 doubles. The file is
+     * mapped as is, so this needs a host with the same layout. */
+    char *eq = strchr(arg, '=');
+    size_t size;
+    if (!eq) {
+        fprintf(stderr, "Expected name=file, got %s\n", arg);
+        return -1;
+    }
+    if (!little_endian()) {
+        fprintf(stderr, "%s: raw columns need little-endian IEEE 754 doubles\n", eq + 1);
+        return -1;
+    }
+    *eq = '\0';
+
+    const double *data = map_file(eq + 1, &size);
+    if (!data) return -1;
+    if (size % sizeof(double)) {
+        fprintf(stderr, "%s: size is not a multiple of %d bytes\n", eq + 1, (int)sizeof(double));
+        unmap_file(data, size);
+        return -1;
+    }
+    if (add_column(arg, data, size / sizeof(double)) != 0) {
+        unmap_file(data, size);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int load_csv(const char *path) {
+    /* A header line of column names followed by rows of numbers. */
+    size_t size, rows = 0, cap = 1024;
+    const char *data = (const char *)map_file(path, &size), *p = data, *end;
+    int first = column_count, i, n = 0;
+    double *values[MAX_COLUMNS];
+
+    if (!p) return -1;
+    end = p + size;
+
+    while (p < end && *p != '\n') {
+        const char *start = p;
+        while (p < end && *p != ',' && *p != '\n' && *p != '\r') ++p;
+        char *name = malloc(p - start + 1);
+        if (!name) goto out_of_memory;
+        memcpy(name, start, p - start);
+        name[p - start] = '\0';
+        if (add_column(name, NULL, 0) != 0) {
+            free(name);
+            goto fail;
+        }
+        values[n] = malloc(sizeof(double) * cap);
+        if (!values[n]) goto out_of_memory;
+        ++n;
+        while (p < end && (*p == ',' || *p == '\r')) ++p;
+    }
+
+    while (p < end) {
+        ++p;
+        if (p >= end || *p == '\n' || *p == '\r') continue;
+        if (rows == cap) {
+            cap *= 2;
+            for (i = 0; i < n; ++i) {
+                double *more = realloc(values[i], sizeof(double) * cap);
+                if (!more) goto out_of_memory;
+                values[i] = more;
+            }
+        }
+        for (i = 0; i < n; ++i) {
+            /* The mapping is not NUL-terminated, so strtod gets a copy. */
+            char field[64], *next;
+            const char *start = p;
+            while (p < end && *p != ',' && *p != '\n' && *p != '\r') ++p;
+            if ((size_t)(p - start) >= sizeof(field)) {
+                fprintf(stderr, "%s: field too long on row %lu\n", path, (unsigned long)rows + 1);
+                goto fail;
+            }
+            memcpy(field, start, p - start);
+            field[p - start] = '\0';
+            values[i][rows] = strtod(field, &next);
+            if (next == field || *next) {
+                fprintf(stderr, "%s: bad value on row %lu\n", path, (unsigned long)rows + 1);
+                goto fail;
+            }
+            if (i + 1 < n && (p >= end || *p++ != ',')) {
+                fprintf(stderr, "%s: missing column on row %lu\n", path, (unsigned long)rows + 1);
+                goto fail;
+            }
+        }
+        while (p < end && *p != '\n') ++p;
+        ++rows;
+    }
+
+    for (i = 0; i < n; ++i) {
+        columns[first + i].values = values[i];
+        columns[first + i].rows = rows;
+    }
+    unmap_file(data, size);
+    return 0;
+
+out_of_memory:
+    fprintf(stderr, "%s: out of memory\n", path);
+fail:
+    /* Drops the columns this file added. */
+    for (i = 0; i < n; ++i) free(values[i]);
+    while (column_count > first) free((char *)columns[--column_count].name);
+    unmap_file(data, size);
+    return -1;
+}
+
+
+static void *run_job(void *arg) {
+    job *j = arg;
+    te_array arrays[MAX_COLUMNS];
+    int i;
+
+    for (i = 0; i < j->array_count; ++i) {
+        arrays[i].address = j->arrays[i].address;
+        arrays[i].values = j->arrays[i].values + j->first;
+    }
+    for (i = 0; i < j->expr_count; ++i) {
+        te_eval_batch(j->exprs[i], arrays, j->array_count, j->rows, j->out[i]);
+    }
+    return NULL;
+}
+
+
+static int write_rows(FILE *f, int csv, double **out, int expr_count, size_t rows, double *row_buf) {
+    size_t r;
+    int i;
+
+    if (csv) {
+        for (r = 0; r < rows; ++r) {
+            for (i = 0; i < expr_count; ++i) {
+                fprintf(f, i ? ",%.17g" : "%.17g", out[i][r]);
+            }
+            fputc('\n', f);
+        }
+    } else if (expr_count == 1) {
+        if (fwrite(out[0], sizeof(double), rows, f) != rows) return -1;
+    } else {
+        for (r = 0; r < rows; ++r) {
+            for (i = 0; i < expr_count; ++i) {
+                row_buf[r * expr_count + i] = out[i][r];
+            }
+        }
+        if (fwrite(row_buf, sizeof(double) * expr_count, rows, f) != rows) return -1;
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+
+static int ends_with(const char *s, const char *suffix) {
+    const size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+
+static int columnar(int argc, char **argv) {
+    const char *output = NULL;
+    const char *texts[MAX_EXPRESSIONS];
+    te_expr *exprs[MAX_EXPRESSIONS];
+    te_variable vars[MAX_COLUMNS];
+    te_array arrays[MAX_COLUMNS];
+    int expr_count = 0, threads = 1, i, t;
+    size_t rows = 0, row;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            const char *arg = argv[++i];
+            if (strchr(arg, '=') ? load_raw(argv[i]) : load_csv(arg)) return 1;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads < 1) threads = 1;
+            if (threads > MAX_THREADS) threads = MAX_THREADS;
+        } else if (expr_count < MAX_EXPRESSIONS) {
+            texts[expr_count++] = argv[i];
+        } else {
+            fprintf(stderr, "Too many expressions\n");
+            return 1;
+        }
+    }
+
+    if (column_count == 0 || expr_count == 0) {
+        fprintf(stderr, "Expected at least one column and one expression\n");
+        return 1;
+    }
+
+    rows = columns[0].rows;
+    for (i = 0; i < column_count; ++i) {
+        if (columns[i].rows != rows) {
+            fprintf(stderr, "Column %s has %lu rows, expected %lu\n", columns[i].name,
+                    (unsigned long)columns[i].rows, (unsigned long)rows);
+            return 1;
+        }
+        vars[i].name = columns[i].name;
+        vars[i].address = &columns[i].slot;
+        vars[i].type = TE_VARIABLE;
+        vars[i].context = 0;
+        arrays[i].address = &columns[i].slot;
+        arrays[i].values = columns[i].values;
+    }
+
+    for (i = 0; i < expr_count; ++i) {
+        int err;
+        exprs[i] = te_compile(texts[i], vars, column_count, &err);
+        if (!exprs[i]) {
+            fprintf(stderr, "%s\n%*s^\nError near here\n", texts[i], err - 1, "");
+            return 1;
+        }
+    }
+
+    const int csv = !output || ends_with(output, ".csv");
+    FILE *f = output ? fopen(output, csv ? "w" : "wb") : stdout;
+    if (!f) {
+        perror(output);
+        return 1;
+    }
+
+    double *out[MAX_EXPRESSIONS];
+    double *row_buf = expr_count > 1 && !csv ? malloc(sizeof(double) * CHUNK_ROWS * expr_count) : NULL;
+    for (i = 0; i < expr_count; ++i) out[i] = malloc(sizeof(double) * CHUNK_ROWS);
+
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (row = 0; row < rows; row += CHUNK_ROWS) {
+        const size_t chunk = rows - row < CHUNK_ROWS ? rows - row : CHUNK_ROWS;
+        const size_t per_thread = (chunk + threads - 1) / threads;
+        pthread_t tids[MAX_THREADS];
+        int started[MAX_THREADS];
+        job jobs[MAX_THREADS];
+        double *outs[MAX_THREADS][MAX_EXPRESSIONS];
+
+        for (t = 0; t < threads; ++t) {
+            const size_t first = per_thread * t < chunk ? per_thread * t : chunk;
+            jobs[t].exprs = exprs;
+            jobs[t].expr_count = expr_count;
+            jobs[t].arrays = arrays;
+            jobs[t].array_count = column_count;
+            jobs[t].first = row + first;
+            jobs[t].rows = chunk - first < per_thread ? chunk - first : per_thread;
+            jobs[t].out = outs[t];
+            for (i = 0; i < expr_count; ++i) outs[t][i] = out[i] + first;
+            started[t] = t > 0 && pthread_create(&tids[t], NULL, run_job, &jobs[t]) == 0;
+            if (t > 0 && !started[t]) run_job(&jobs[t]);
+        }
+        run_job(&jobs[0]);
+        for (t = 1; t < threads; ++t) {
+            if (started[t]) pthread_join(tids[t], NULL);
+        }
+
+        if (write_rows(f, csv, out, expr_count, chunk, row_buf) != 0) {
+            perror(output ? output : "stdout");
+            return 1;
+        }
+    }
+
+    if (f != stdout) fclose(f);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    const double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) * 1e-9;
+    const double bytes = (double)rows * (column_count + expr_count) * sizeof(double);
+    fprintf(stderr, "%lu rows in %.3fs: %.3g rows/s, %.3g GB/s\n", (unsigned long)rows, seconds,
+            seconds > 0 ? rows / seconds : 0.0, seconds > 0 ? bytes / seconds * 1e-9 : 0.0);
+
+    for (i = 0; i < expr_count; ++i) {
+        te_free(exprs[i]);
+        free(out[i]);
+    }
+    free(row_buf);
+    return 0;
+}
+
 int main(int argc, char **argv) {
     if (argc == 3 && strcmp(argv[1], "-e") == 0) {
         if (eval(argv[2]) == -1) {
@@ -72,9 +433,13 @@ int main(int argc, char **argv) {
     } else if (argc == 1) {
         repl();
         return 0;
+    } else if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        return columnar(argc, argv);
     } else {
         printf("Usage: %s\n", argv[0]);
         printf("       %s -e <expression>\n", argv[0]);
+        printf("       %s -c <name=file.f64 | file.csv>... [-j threads] [-o output] <expression>...\n", argv[0]);
+        printf("       (.f64 files hold little-endian IEEE 754 doubles)\n");
         return 1;
     }
 }
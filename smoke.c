@@ -196,6 +196,9 @@ void test_syntax() {
         lequal(err, e);
         lok(!n);
 
+        lok(!te_validate(expr, 0, 0, &err));
+        lequal(err, e);
+
         if (err != e) {
             printf("FAILED: %s\n", expr);
         }
@@ -220,6 +223,9 @@ void test_nans() {
         "npr(2, 4)",
         "npr(-2, 4)",
         "npr(2, -4)",
+        "fac(0/0)",
+        "ncr(0/0, 1)",
+        "ncr(5, 0/0)",
     };
 
     int i;
@@ -248,12 +254,13 @@ void test_infs() {
             "log(0)",
             "pow(2,10000000)",
             "fac(300)",
-            "ncr(300,100)",
+            "fac(171)",
             "ncr(300000,100)",
             "ncr(300000,100)*8",
             "npr(3,2)*ncr(300000,100)",
-            "npr(100,90)",
-            "npr(30,25)",
+            "ncr(2000,1000)",
+            "npr(200,180)",
+            "gamma(172)",
     };
 
     int i;
@@ -544,6 +551,35 @@ void test_closure() {
     }
 }
 
+void test_context() {
+
+    double a = 1, b = 100;
+    te_variable lookup[] = {
+        {"c0", clo0, TE_CLOSURE0, 0},
+        {"c1", clo1, TE_CLOSURE1, 0},
+        {"c2", clo2, TE_CLOSURE2, &b},
+    };
+
+    te_expr *n = te_compile("c0 + c1 4", lookup, 3, 0);
+    lok(n);
+    lfequal(te_eval(n), 14);
+    lfequal(te_eval_ctx(n, 0), 14);
+    lfequal(te_eval_ctx(n, &a), 16);
+
+    /* The same expression with a different context per call. */
+    a = 10;
+    lfequal(te_eval_ctx(n, &a), 34);
+    lfequal(te_eval_ctx(n, &b), 214);
+    te_free(n);
+
+    /* A context given when compiling takes precedence. */
+    n = te_compile("c2(c1 1, 2)", lookup, 3, 0);
+    lfequal(te_eval(n), 104);
+    lfequal(te_eval_ctx(n, &a), 114);
+    te_free(n);
+}
+
+
 void test_optimize() {
 
     test_case cases[] = {
@@ -654,6 +690,7 @@ void test_combinatorics() {
             {"fac(3)", 6},
             {"fac(4.8)", 24},
             {"fac(10)", 3628800},
+            {"fac(170.5)", 7.257415615307999e+306},
 
             {"ncr(0,0)", 1},
             {"ncr(10,1)", 10},
@@ -669,6 +706,9 @@ void test_combinatorics() {
             {"npr(10,10)", 3628800},
             {"npr(20,5)", 1860480},
             {"npr(100,4)", 94109400},
+            {"fac(170)/fac(169)", 170},
+            {"ncr(1000000,3)", 166666166667000000.0},
+            {"npr(30,25)/fac(25)", 142506},
     };
 
 
@@ -689,6 +729,1420 @@ void test_combinatorics() {
 }
 
 
+void test_special() {
+    test_case cases[] = {
+            {"gamma(5)", 24},
+            {"gamma(0.5)^2", 3.14159265358979},
+            {"lgamma(10.5)", 13.940625219403763},
+            {"erf(0)", 0},
+            {"erf(0.5)", 0.5204998778130465},
+            {"erfc(0)", 1},
+            {"erf(2) + erfc(2)", 1},
+            {"normcdf(0)", 0.5},
+            {"normcdf(1.96)", 0.9750021048517795},
+            {"normcdf(-1.96) + normcdf(1.96)", 1},
+    };
+
+    int i;
+    for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
+        const char *expr = cases[i].expr;
+        const double answer = cases[i].answer;
+
+        int err;
+        const double ev = te_interp(expr, &err);
+        lok(!err);
+        lfequal(ev, answer);
+    }
+
+    /* Results below 2^53 are exact, larger ones are close. */
+    lok(te_interp("ncr(50,25)", 0) == 126410606437752.0);
+    lok(te_interp("ncr(1000,5)", 0) == 8250291250200.0);
+    lok(te_interp("ncr(276635,3)", 0) == 3528299304355245.0);
+    lok(te_interp("ncr(56,27)", 0) == 7384942649010080.0);
+    lok(te_interp("ncr(57,24)", 0) == 7522327487513475.0);
+    lok(te_interp("fac(22)", 0) == 1124000727777607680000.0);
+    lok(fabs(te_interp("ncr(62,31)", 0) / 465428353255261088.0 - 1) < 1e-14);
+    lok(fabs(te_interp("ncr(300,100)", 0) / 4.1582514632585645e+81 - 1) < 1e-11);
+    lok(fabs(te_interp("ncr(150,75)", 0) / 9.282606973670878e+43 - 1) < 1e-13);
+    lok(fabs(te_interp("ncr(1000,500)", 0) / 2.7028824094543655e+299 - 1) < 1e-11);
+    lok(fabs(te_interp("npr(100,90)", 0) / 2.5718203109552512e+151 - 1) < 1e-13);
+    lok(fabs(te_interp("npr(30,25)", 0) / 2.2104404984349255e+30 - 1) < 1e-13);
+
+    /* Pure builtins fold like the others. */
+    te_expr *n = te_compile("normcdf(0) + gamma(4)", 0, 0, 0);
+    te_expr *one = te_compile("1", 0, 0, 0);
+    lok(te_memory_usage(n) == te_memory_usage(one));
+    lfequal(te_eval(n), 6.5);
+    te_free(n);
+    te_free(one);
+}
+
+
+void test_specialize() {
+
+    double x, a, b;
+    te_variable lookup[] = {{"x", &x}, {"a", &a}, {"b", &b}};
+
+    test_case cases[] = {
+        {"a*x + sqrt(b)", 0},
+        {"x^a / (b - 1)", 0},
+        {"(a+b)*(x-a)", 0},
+        {"pow(a, b)", 0},
+    };
+
+    int i;
+    for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
+        const char *expr = cases[i].expr;
+
+        int err;
+        te_expr *ex = te_compile(expr, lookup, 3, &err);
+        lok(ex);
+
+        a = 3; b = 4;
+        te_expr *sp = te_specialize(ex, lookup + 1, 2);
+        lok(sp);
+
+        for (x = -2; x < 2; x += .5) {
+            a = 3; b = 4;
+            const double expected = te_eval(ex);
+            /* Later changes to a and b must not affect the specialized copy. */
+            a = 7; b = 9;
+            lfequal(te_eval(sp), expected);
+        }
+
+        te_free(sp);
+        te_free(ex);
+    }
+
+    /* Subtrees that only depend on known values are folded. */
+    a = 3; b = 16;
+    te_expr *ex = te_compile("x * (a + sqrt(b))", lookup, 3, 0);
+    te_expr *sp = te_specialize(ex, lookup + 1, 2);
+    lfequal(((te_expr*)sp->parameters[1])->value, 7);
+    te_free(sp);
+
+    x = 2;
+    sp = te_specialize(ex, lookup, 3);
+    lfequal(sp->value, 14);
+    te_free(sp);
+    te_free(ex);
+}
+
+
+void test_fma() {
+
+    double a, b, c;
+    te_variable lookup[] = {{"a", &a}, {"b", &b}, {"c", &c}};
+
+    test_case cases[] = {
+        {"a*b+c", 0},
+        {"c+a*b", 0},
+        {"a*b-c", 0},
+        {"c-a*b", 0},
+        {"(a*b+c)*(a-b*c)", 0},
+        {"a*b+c*a+b", 0},
+        {"sin(a*2+1) - b", 0},
+    };
+
+    int i;
+    for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
+        const char *expr = cases[i].expr;
+
+        te_expr *strict = te_compile(expr, lookup, 3, 0);
+        te_expr *fused = te_compile_ex(expr, lookup, 3, TE_OPT_FMA, 0);
+        lok(fused);
+
+        for (a = -2; a < 2; a += .7) {
+            b = a * 3 + 1;
+            c = a - 5;
+            lfequal(te_eval(fused), te_eval(strict));
+        }
+
+        te_free(strict);
+        te_free(fused);
+    }
+
+    /* Only the fused form keeps the low bits of the product. */
+    a = b = 1 + ldexp(1, -27);
+    c = -(1 + ldexp(1, -26));
+
+    te_expr *strict = te_compile("a*b+c", lookup, 3, 0);
+    te_expr *fused = te_compile_ex("a*b+c", lookup, 3, TE_OPT_FMA, 0);
+    lok(fused->type == (TE_FUNCTION3 | TE_FLAG_PURE));
+    lok(te_eval(strict) == 0);
+    lok(te_eval(fused) == ldexp(1, -54));
+
+    double as[3] = {a, a, 1}, out[3];
+    te_array arrays[] = {{&a, as}};
+    te_eval_batch(fused, arrays, 1, 3, out);
+    lok(out[0] == ldexp(1, -54));
+    lok(out[2] == fma(1, b, c));
+
+    te_free(strict);
+    te_free(fused);
+}
+
+
+void test_poly() {
+
+    double x, y;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}};
+
+    test_case cases[] = {
+        {"1 + 2*x + 3*x^2 - x^3/4", 0},
+        {"x^2", 0},
+        {"x*x*x - 2*x*x + 1", 0},
+        {"-x^2 + (x^3)*5 - (2*x)^2", 0},
+        {"0.5 + x*0.25 + x^2*0.125 + x^3 + x^4 + x^5 + x^6 + x^7 + x^8 + x^9", 0},
+        {"sin(x^2 + x + 1) + y", 0},
+        {"x^2 + y^2", 0},
+        {"x^2.5 + x", 0},
+    };
+
+    int i;
+    for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
+        const char *expr = cases[i].expr;
+
+        te_expr *strict = te_compile(expr, lookup, 2, 0);
+        te_expr *horner = te_compile_ex(expr, lookup, 2, TE_OPT_POLY, 0);
+        lok(horner);
+
+        for (x = -2; x < 2; x += .3) {
+            y = x - 1;
+            const double a = te_eval(strict), b = te_eval(horner);
+            lok(a != a ? b != b : fabs(a - b) <= 1e-12 * (1 + fabs(a)));
+        }
+
+        double xs[5] = {-1, 0, .5, 1.5, 3}, out[5];
+        te_array arrays[] = {{&x, xs}};
+        te_eval_batch(horner, arrays, 1, 5, out);
+        x = xs[3];
+        lfequal(out[3], te_eval(strict));
+
+        te_free(strict);
+        te_free(horner);
+    }
+
+    /* A whole polynomial becomes one node. */
+    te_expr *strict = te_compile("1 + 2*x + 3*x^2 + 4*x^3", lookup, 2, 0);
+    te_expr *horner = te_compile_ex("1 + 2*x + 3*x^2 + 4*x^3", lookup, 2, TE_OPT_POLY, 0);
+    lok(te_memory_usage(horner) < te_memory_usage(strict) / 2);
+
+    x = 2;
+    te_expr *sp = te_specialize(horner, lookup, 1);
+    lfequal(sp->value, 49);
+    te_free(sp);
+    te_free(strict);
+    te_free(horner);
+
+    /* Coefficients known only after specializing need the passes rerun. */
+    strict = te_compile_ex("y*x*x*x + y*x*x + 2*x + y", lookup, 2, TE_OPT_POLY, 0);
+    y = 3;
+    sp = te_specialize(strict, lookup + 1, 1);
+    horner = te_specialize_ex(strict, lookup + 1, 1, TE_OPT_POLY);
+    lok(te_memory_usage(horner) < te_memory_usage(sp) / 2);
+    x = 2;
+    lfequal(te_eval(horner), 3 * 8 + 3 * 4 + 4 + 3);
+    lfequal(te_eval(horner), te_eval(sp));
+    te_free(sp);
+    te_free(strict);
+    te_free(horner);
+}
+
+
+int depth(const te_expr *n) {
+    int i, d = 0;
+    if (n->type < TE_FUNCTION0) return 1;
+    for (i = 0; i < (n->type & 7); ++i) {
+        const int c = depth(n->parameters[i]);
+        if (c > d) d = c;
+    }
+    return d + 1;
+}
+
+void test_reassoc() {
+
+    double x, y, z;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}, {"z", &z}};
+
+    test_case cases[] = {
+        {"x+y+z", 0},
+        {"x-y-z+1-x*y*z+2", 0},
+        {"-x-y-z-1", 0},
+        {"x*y*z*3*x*y", 0},
+        {"x - (y - (z - 1)) + 4", 0},
+        {"sin(x+y+z+1) * (x*2*y*3) / z", 0},
+        {"(x+y)*(y+z)-(z+x)+5*5", 0},
+    };
+
+    int i;
+    for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
+        const char *expr = cases[i].expr;
+
+        te_expr *strict = te_compile(expr, lookup, 3, 0);
+        te_expr *fast = te_compile_ex(expr, lookup, 3, TE_OPT_REASSOC, 0);
+        lok(fast);
+
+        for (x = -2; x < 2; x += .7) {
+            y = x * 3 + 1;
+            z = x - 5;
+            lfequal(te_eval(fast), te_eval(strict));
+        }
+
+        te_free(strict);
+        te_free(fast);
+    }
+
+    /* A long sum is rebalanced to logarithmic depth. */
+    char long_sum[4 * 1000 + 1];
+    for (i = 0; i < 1000; ++i) {
+        sprintf(long_sum + 4 * i, "%cx+1", i % 3 ? '+' : '-');
+    }
+    long_sum[0] = ' ';
+
+    te_expr *strict = te_compile(long_sum, lookup, 3, 0);
+    te_expr *fast = te_compile_ex(long_sum, lookup, 3, TE_OPT_REASSOC, 0);
+    lok(depth(strict) > 1000);
+    lok(depth(fast) < 20);
+    x = 1.5;
+    lfequal(te_eval(fast), te_eval(strict));
+    te_free(strict);
+    te_free(fast);
+
+    /* Constants spread through a chain are folded. */
+    fast = te_compile_ex("1+x+2+y+3", lookup, 3, TE_OPT_REASSOC, 0);
+    strict = te_compile("x+y+6", lookup, 3, 0);
+    lok(te_memory_usage(fast) == te_memory_usage(strict));
+    te_free(strict);
+    te_free(fast);
+}
+
+
+void test_memory() {
+
+    double x;
+    te_variable lookup[] = {{"x", &x}};
+
+    te_expr *leaf = te_compile("x", lookup, 1, 0);
+    te_expr *two = te_compile("x+x", lookup, 1, 0);
+    te_expr *three = te_compile("x+x*x", lookup, 1, 0);
+    te_expr *folded = te_compile("x+(5*2)", lookup, 1, 0);
+
+    const size_t l = te_memory_usage(leaf);
+    const size_t f = te_memory_usage(two) - 2 * l;
+    lok(l > 0);
+    lok(f > l);
+    lok(te_memory_usage(three) == 2 * f + 3 * l);
+    lok(te_memory_usage(folded) == te_memory_usage(two));
+    lok(te_memory_usage(0) == 0);
+
+    te_free(leaf);
+    te_free(two);
+    te_free(three);
+    te_free(folded);
+}
+
+
+void test_dependencies() {
+
+    double x, y, z, c = 1;
+    te_variable lookup[] = {
+        {"x", &x}, {"y", &y}, {"z", &z},
+        {"f", sum1, TE_FUNCTION1},
+        {"p", sum1, TE_FUNCTION1 | TE_FLAG_PURE},
+        {"c", clo1, TE_CLOSURE1, &c},
+        {"d", clo1, TE_CLOSURE1, 0},
+    };
+    int deps[7];
+
+    te_expr *n = te_compile("x + f(2) + c(z)", lookup, 7, 0);
+    lequal(te_dependencies(n, lookup, 7, deps), 4);
+    lequal(deps[0], 0);
+    lequal(deps[1], 2);
+    lequal(deps[2], 3);
+    lequal(deps[3], 5);
+    te_free(n);
+
+    /* Pure calls on constants are folded away, the closure context tells c from d. */
+    n = te_compile("p(2) * y + d(1)", lookup, 7, 0);
+    lequal(te_dependencies(n, lookup, 7, deps), 2);
+    lequal(deps[0], 1);
+    lequal(deps[1], 6);
+    te_free(n);
+
+    /* The variable bound by a polynomial node counts. */
+    n = te_compile_ex("x^2 + 3*x + 1", lookup, 7, TE_OPT_POLY, 0);
+    lequal(te_dependencies(n, lookup, 7, deps), 1);
+    lequal(deps[0], 0);
+
+    /* Specializing a variable removes it. */
+    te_expr *sp = te_specialize(n, lookup, 1);
+    lequal(te_dependencies(sp, lookup, 7, deps), 0);
+    te_free(sp);
+    te_free(n);
+
+    lequal(te_dependencies(0, lookup, 7, deps), 0);
+}
+
+
+void test_state() {
+
+    double x, n = 3;
+    te_variable lookup[] = {{"x", &x}, {"n", &n}};
+
+    te_expr *ema = te_compile("ema(x, 0.5)", lookup, 2, 0);
+    te_expr *lag = te_compile("delay(x, 2)", lookup, 2, 0);
+    lok(ema && lag);
+    te_state *se = te_state_new(ema), *sl = te_state_new(lag);
+    const double xs[] = {1, 2, 3, 4};
+    const double emas[] = {1, 1.5, 2.25, 3.125};
+    int i, j;
+    for (i = 0; i < 4; ++i) {
+        x = xs[i];
+        lfequal(te_eval_state(ema, se), emas[i]);
+        const double d = te_eval_state(lag, sl);
+        if (i < 2) lok(d != d);
+        else lfequal(d, xs[i - 2]);
+    }
+
+    /* A clone carries on from the same point on its own. */
+    te_state *copy = te_state_clone(se);
+    x = 5;
+    lfequal(te_eval_state(ema, se), 4.0625);
+    x = 0;
+    lfequal(te_eval_state(ema, copy), 1.5625);
+    te_state_reset(se);
+    x = 7;
+    lfequal(te_eval_state(ema, se), 7);
+
+    /* Without a state the stateful calls give NaN. */
+    lok(te_eval(ema) != te_eval(ema));
+    te_state_free(copy);
+    te_state_free(se);
+    te_state_free(sl);
+    te_free(ema);
+    te_free(lag);
+
+    /* Rolling windows against sums over the last n values, with a NaN in the stream. */
+    te_expr *rsum = te_compile("rsum(x, n)", lookup, 2, 0);
+    te_expr *rmax = te_compile("rmax(x, 5)", lookup, 2, 0);
+    te_expr *both = te_compile("rmin(x, 4) - rstd(x, 6)", lookup, 2, 0);
+    te_state *ss = te_state_new(rsum), *sm = te_state_new(rmax), *sb = te_state_new(both);
+    n = 100;
+    double stream[300];
+    unsigned int seed = 1;
+    for (i = 0; i < 300; ++i) {
+        seed = seed * 1103515245 + 12345;
+        stream[i] = (seed >> 16) % 1000 / 10.0 - 50;
+    }
+    stream[150] = NAN;
+
+    for (i = 0; i < 300; ++i) {
+        double sum = 0, max = -INFINITY, min = INFINITY, mean = 0, var = 0;
+        x = stream[i];
+        for (j = i < 2 ? 0 : i - 2; j <= i; ++j) sum += stream[j];
+        for (j = i < 4 ? 0 : i - 4; j <= i; ++j) max = stream[j] > max || stream[j] != stream[j] ? stream[j] : max;
+        for (j = i < 3 ? 0 : i - 3; j <= i; ++j) min = stream[j] < min || stream[j] != stream[j] ? stream[j] : min;
+        for (j = i < 5 ? 0 : i - 5; j <= i; ++j) mean += stream[j];
+        mean /= i < 5 ? i + 1 : 6;
+        for (j = i < 5 ? 0 : i - 5; j <= i; ++j) var += (stream[j] - mean) * (stream[j] - mean);
+        const double std = i ? sqrt(var / (i < 5 ? i : 5)) : NAN;
+
+        const double a = te_eval_state(rsum, ss), b = te_eval_state(rmax, sm), c = te_eval_state(both, sb);
+        if (sum != sum) lok(a != a); else lok(fabs(a - sum) < 1e-9);
+        if (max != max) lok(b != b); else lfequal(b, max);
+        if (min - std != min - std) lok(c != c); else lok(fabs(c - (min - std)) < 1e-9);
+    }
+
+    /* Windows are sized from the variables when the state is created. */
+    x = 1;
+    n = 2;
+    te_state *s3 = te_state_new(rsum);
+    for (i = 0; i < 5; ++i) {
+        lfequal(te_eval_state(rsum, s3), i < 2 ? i + 1 : 2);
+        te_eval_state(rsum, ss);
+    }
+    lfequal(te_eval_state(rsum, ss), 3);
+
+    te_state_free(s3);
+    te_state_free(ss);
+    te_state_free(sm);
+    te_state_free(sb);
+    te_free(rsum);
+    te_free(rmax);
+    te_free(both);
+}
+
+
+typedef struct {
+    const char *text;
+    size_t left;
+    int chunk, fail_at;
+} chunks;
+
+
+static size_t read_chunks(void *context, char *buffer, size_t size) {
+    /* Hands out text a few bytes at a time, failing once fail_at are left. */
+    chunks *c = context;
+    size_t n = c->chunk < (int)size ? (size_t)c->chunk : size, i;
+    if (c->fail_at && c->left <= (size_t)c->fail_at) return (size_t)-1;
+    if (n > c->left) n = c->left;
+    for (i = 0; i < n; ++i) buffer[i] = c->text[i];
+    c->text += n;
+    c->left -= n;
+    c->chunk = c->chunk % 7 + 1;
+    return n;
+}
+
+
+static te_expr *compile_chunks(const char *text, size_t len, const te_variable *lookup, int count, size_t *error) {
+    chunks c = {text, len, 1, 0};
+    return te_compile_stream(read_chunks, &c, lookup, count, 0, error);
+}
+
+
+void test_stream() {
+
+    double x = 2, long_name = 3;
+    te_variable lookup[] = {{"x", &x}, {"long_name", &long_name}};
+
+    const char *texts[] = {
+        "1+2*x", "sqrt(x^2 + long_name^2)", "  3.25e2 - x ", "ncr(6, 2)",
+        "1+", "x + y", "(1", "sin x)", "12345678901234567890", ""
+    };
+    int i;
+    for (i = 0; i < (int)(sizeof(texts) / sizeof(texts[0])); ++i) {
+        size_t len = 0, error;
+        int expected;
+        while (texts[i][len]) ++len;
+        te_expr *a = compile_chunks(texts[i], len, lookup, 2, &error);
+        te_expr *b = te_compile(texts[i], lookup, 2, &expected);
+        lequal((int)error, expected);
+        lok(!a == !b);
+        if (a && b) lfequal(te_eval(a), te_eval(b));
+        te_free(a);
+        te_free(b);
+    }
+
+    /* Far larger than the buffer, with an error near the end. */
+    static char big[400000];
+    size_t len = 0, error;
+    for (i = 0; i < 40000; ++i) {
+        len += sprintf(big + len, "%sx*%d", i ? "+" : "", i % 100);
+    }
+    te_expr *n = compile_chunks(big, len, lookup, 2, &error);
+    lequal((int)error, 0);
+    lfequal(te_eval(n), 2 * 400 * 4950);
+    te_free(n);
+    big[len - 3] = '$';
+    lok(!compile_chunks(big, len, lookup, 2, &error));
+    lequal((int)error, (int)len - 2);
+
+    /* Tokens longer than the lookahead, NUL bytes and failed reads. */
+    for (i = 0; i < 2000; ++i) big[i] = 'a';
+    lok(!compile_chunks(big, 2000, lookup, 2, &error));
+    lok(error > 0 && error <= 2000);
+    lok(!compile_chunks("1+2\0+3", 6, lookup, 2, &error));
+    lequal((int)error, 4);
+    chunks failing = {"1+2+3", 5, 1, 2};
+    lok(!te_compile_stream(read_chunks, &failing, 0, 0, 0, &error));
+    lequal((int)error, 3);
+
+    FILE *f = tmpfile();
+    lok(f);
+    if (f) {
+        fputs("x * (long_name\n+ 1)", f);
+        rewind(f);
+        n = te_compile_stream(te_read_file, f, lookup, 2, 0, &error);
+        lequal((int)error, 0);
+        lfequal(te_eval(n), 8);
+        te_free(n);
+        fclose(f);
+    }
+}
+
+
+void test_template() {
+
+    double x, y, extra = 10;
+    te_variable one[] = {{"x", &x}, {"y", &y}};
+    te_variable two[] = {{"y", &x}, {"sin", sum1, TE_FUNCTION1}, {"f", clo2, TE_CLOSURE2, &extra}, {"x", &y}};
+
+    const char *texts[] = {
+        "x + y*2", "sin x^2", "sin(x, y)", "f(x, y) + f x", "pi + e()", "-x^-y",
+        "1.5e3 + 12345678901234567 * x", "(x, y, 3)", "x +", "x + z", "f(x)", "1 $ 2", "", "  "
+    };
+    int i, j, k;
+    for (i = 0; i < (int)(sizeof(texts) / sizeof(texts[0])); ++i) {
+        te_template *t = te_template_new(texts[i]);
+        lok(t);
+        for (j = 0; j < 2; ++j) {
+            const te_variable *vars = j ? two : one;
+            const int count = j ? 4 : 2;
+            int a_error, b_error;
+            te_expr *a = te_bind(t, vars, count, TE_OPT_REASSOC, &a_error);
+            te_expr *b = te_compile_ex(texts[i], vars, count, TE_OPT_REASSOC, &b_error);
+            lequal(a_error, b_error);
+            lok(!a == !b);
+            for (k = 0; a && b && k < 3; ++k) {
+                x = k - 0.5;
+                y = k * 2;
+                const double va = te_eval(a), vb = te_eval(b);
+                if (va != va) lok(vb != vb);
+                else lfequal(va, vb);
+            }
+            te_free(a);
+            te_free(b);
+        }
+        te_template_free(t);
+    }
+
+    /* One template, many bindings. */
+    double values[50];
+    te_template *t = te_template_new("a*b + a^2 - b/2 + c1 + c2 + c3 + c4 + c5 + c6 + c7 + c8 + c9 + c10"
+                                     " + c11 + c12 + c13 + c14 + c15 + c16 + c17");
+    for (i = 0; i < 50; ++i) {
+        double b = i;
+        te_variable vars[] = {{"a", values + i}, {"b", &b}};
+        values[i] = i * 0.5;
+        int error;
+        lok(!te_bind(t, vars, 2, 0, &error));
+        lequal(error, 20);
+    }
+    te_template_free(t);
+    t = te_template_new("a*b + a^2 - b/2");
+    for (i = 0; i < 50; ++i) {
+        double b = i;
+        te_variable vars[] = {{"a", values + i}, {"b", &b}};
+        te_expr *n = te_bind(t, vars, 2, 0, 0);
+        lfequal(te_eval(n), values[i] * i + values[i] * values[i] - i / 2.0);
+        te_free(n);
+    }
+    te_template_free(t);
+
+    /* Many names, each used twice, share one slot each. */
+    static char many[300 * 2 * 6];
+    static double weights[300];
+    static char labels[300][6];
+    te_variable weighted[300];
+    char *at = many;
+    for (i = 0; i < 600; ++i) {
+        at += sprintf(at, i ? "+w%d" : "w%d", i % 300);
+    }
+    for (i = 0; i < 300; ++i) {
+        sprintf(labels[i], "w%d", i);
+        weights[i] = i;
+        weighted[i].name = labels[i];
+        weighted[i].address = weights + i;
+        weighted[i].type = TE_VARIABLE;
+        weighted[i].context = 0;
+    }
+    t = te_template_new(many);
+    te_expr *n = te_bind(t, weighted, 300, 0, 0);
+    lok(n);
+    lfequal(te_eval(n), 2 * 299 * 300 / 2);
+    te_free(n);
+    te_template_free(t);
+    te_template_free(0);
+}
+
+
+void test_bulk() {
+
+    double x = 2, xy = 3, y = 5, shadowed = 7;
+    te_variable lookup[] = {{"xy", &xy}, {"y", &y}, {"x", &x}, {"y", &shadowed}};
+
+    /* Enough formulas for every thread to get several runs. */
+    char text[1000][48];
+    const char *texts[1000];
+    te_expr *out[1000];
+    int errors[1000], i;
+    for (i = 0; i < 1000; ++i) {
+        if (i % 7 == 3) sprintf(text[i], "x + %d * (y", i);
+        else if (i % 11 == 5) sprintf(text[i], "x + z%d", i);
+        else sprintf(text[i], "xy * %d + x^2 + sqrt(y) + sin(%d)", i, i);
+        texts[i] = text[i];
+    }
+
+    int threads;
+    for (threads = 1; threads <= 8; threads *= 2) {
+        size_t compiled = te_compile_bulk(texts, 1000, lookup, 4, TE_OPT_POLY, threads, out, errors);
+        size_t expected = 0;
+        for (i = 0; i < 1000; ++i) {
+            int error;
+            te_expr *n = te_compile_ex(texts[i], lookup, 4, TE_OPT_POLY, &error);
+            lequal(errors[i], error);
+            lok(!out[i] == !n);
+            if (n) {
+                ++expected;
+                lfequal(te_eval(out[i]), te_eval(n));
+            }
+            te_free(n);
+            te_free(out[i]);
+        }
+        lequal((int)compiled, (int)expected);
+    }
+
+    /* A negative thread count means the calling thread only. */
+    static const char *same[20000];
+    static te_expr *many[20000];
+    for (i = 0; i < 20000; ++i) same[i] = "x^2 + 1";
+    lequal((int)te_compile_bulk(same, 20000, lookup, 4, 0, -1, many, 0), 20000);
+    lfequal(te_eval(many[19999]), 5);
+    for (i = 0; i < 20000; ++i) te_free(many[i]);
+
+    /* Without errors, and with nothing to compile. */
+    lequal((int)te_compile_bulk(texts, 1, 0, 0, 0, 4, out, 0), 0);
+    lok(!out[0]);
+    lequal((int)te_compile_bulk(texts, 0, lookup, 4, 0, 4, out, errors), 0);
+}
+
+
+void test_handle() {
+
+    double x = 2;
+    te_variable lookup[] = {{"x", &x}};
+
+    te_handle *h = te_handle_new(te_compile("x+1", lookup, 1, 0));
+    te_reader *r = te_reader_new(h), *other = te_reader_new(h);
+    lok(h && r && other);
+    lfequal(te_read_eval(r), 3);
+
+    /* A tree being read survives a swap until the reader is done. */
+    const te_expr *held = te_read_begin(r);
+    lequal(te_handle_swap(h, te_compile("x*10", lookup, 1, 0)), 1);
+    lfequal(te_read_eval(other), 20);
+    lequal(te_handle_swap(h, te_compile("x*100", lookup, 1, 0)), 2);
+    lequal(te_handle_collect(h), 2);
+    lfequal(te_eval(held), 3);
+    te_read_end(r);
+    lequal(te_handle_collect(h), 0);
+    lfequal(te_read_eval(r), 200);
+
+    /* Idle readers do not hold anything back. */
+    lequal(te_handle_swap(h, 0), 0);
+    lok(te_read_eval(r) != te_read_eval(r));
+
+    /* Records are reused once freed. */
+    te_reader_free(other);
+    lok(te_reader_new(h) == other);
+
+    te_handle_free(h);
+}
+
+
+void test_cost() {
+
+    double a, b;
+    te_variable lookup[] = {{"a", &a}, {"b", &b}, {"f", sum1, TE_FUNCTION1}};
+
+    te_expr *cheap = te_compile("a+5", lookup, 3, 0);
+    te_expr *costly = te_compile("pow(a, b) + atan2(a, b)", lookup, 3, 0);
+    te_expr *folded = te_compile("sin(2)*exp(3)", lookup, 3, 0);
+    lok(te_cost(cheap) > 0);
+    lok(te_cost(costly) > 10 * te_cost(cheap));
+    lfequal(te_cost(folded), te_get_cost("constant"));
+    lfequal(te_cost(0), 0);
+
+    /* a+5 is one call node, its operator and two leaves. */
+    lfequal(te_cost(cheap), te_get_cost("call") + te_get_cost("+") + te_get_cost("variable") + te_get_cost("constant"));
+
+    /* The table can be recalibrated, by operator or by builtin name. */
+    const double old = te_get_cost("+");
+    lok(te_set_cost("+", old + 100));
+    lfequal(te_cost(cheap), te_get_cost("call") + old + 100 + te_get_cost("variable") + te_get_cost("constant"));
+    lok(te_set_cost("+", old));
+    lok(te_get_cost("log") == te_get_cost("ln") || te_get_cost("log") == te_get_cost("log10"));
+    lok(!te_set_cost("nosuch", 1));
+    lok(te_get_cost("nosuch") != te_get_cost("nosuch"));
+
+    /* Bound functions without an entry use the "function" cost. */
+    te_expr *n = te_compile("f(a)", lookup, 3, 0);
+    lfequal(te_cost(n), te_get_cost("call") + te_get_cost("function") + te_get_cost("variable"));
+    te_free(n);
+
+    te_free(cheap);
+    te_free(costly);
+    te_free(folded);
+}
+
+
+static int draws;
+static double draw(void) {
+    ++draws;
+    return 6;
+}
+
+
+void test_approximate() {
+
+    double x, y, xs[1000], out[1000];
+    te_variable lookup[] = {{"x", &x}, {"y", &y}, {"f", sum1, TE_FUNCTION1}, {"r", draw, TE_FUNCTION0}};
+    te_interval domain = {&x, -2, 2};
+    double error, worst = 0;
+    int i;
+
+    te_expr *n = te_compile("exp(-x^2)*sin(3*x)/(1+x^2)", lookup, 3, 0);
+    te_expr *a = te_approximate(n, &domain, 1, 1e-10, &error);
+    lok(a);
+    lok(error > 0 && error <= 1e-10);
+    for (i = 0; i <= 997; ++i) {
+        x = -2 + 4.0 * i / 997;
+        const double d = fabs(te_eval(a) - te_eval(n));
+        if (d > worst) worst = d;
+    }
+    lok(worst <= 2e-10);
+
+    /* Batches give the same results as te_eval. */
+    te_array arrays[] = {{&x, xs}};
+    for (i = 0; i < 1000; ++i) {
+        xs[i] = -2 + i * 0.004;
+    }
+    te_eval_batch(a, arrays, 1, 1000, out);
+    for (i = 0; i < 1000; i += 111) {
+        x = xs[i];
+        lfequal(out[i], te_eval(a));
+    }
+
+    /* Interval bounds cover the series. */
+    double lo, hi;
+    te_interval part = {&x, 0.5, 1};
+    te_eval_interval(a, &part, 1, &lo, &hi);
+    for (i = 0; i <= 50; ++i) {
+        x = 0.5 + i * 0.01;
+        lok(te_eval(a) >= lo && te_eval(a) <= hi);
+    }
+    te_free(a);
+    te_free(n);
+
+    /* Only the subtree in x is replaced, the rest still reads y. */
+    n = te_compile("y * cos(x) + y", lookup, 4, 0);
+    a = te_approximate(n, &domain, 1, 1e-12, &error);
+    lok(error > 0);
+    int deps[3];
+    lequal(te_dependencies(a, lookup, 3, deps), 2);
+    x = 1; y = 3;
+    lok(fabs(te_eval(a) - (3 * cos(1) + 3)) < 1e-11);
+    te_free(a);
+    te_free(n);
+
+    /* Nothing is replaced when no series converges, the subtree is cheap, */
+    /* a function is impure, or there is no domain. */
+    const char *kept[] = {"sqrt(x+2)", "x*x + 1/x", "f(x) * 2", "sin(y)"};
+    for (i = 0; i < 4; ++i) {
+        n = te_compile(kept[i], lookup, 4, 0);
+        a = te_approximate(n, &domain, 1, 1e-12, &error);
+        lfequal(error, 0);
+        lequal((int)te_memory_usage(a), (int)te_memory_usage(n));
+        te_free(a);
+        te_free(n);
+    }
+
+    /* An impure call without arguments is not folded into the series. */
+    n = te_compile("sin(x) + r", lookup, 4, 0);
+    a = te_approximate(n, &domain, 1, 1e-12, &error);
+    draws = 0;
+    x = 1;
+    lok(fabs(te_eval(a) - (sin(1) + 6)) < 1e-11);
+    lequal(draws, 1);
+    te_free(a);
+    te_free(n);
+}
+
+
+void test_table() {
+
+    double x, xs[1000], out[1000];
+    double grid[] = {0, 1, 3, 7}, values[] = {0, 10, 20, 15};
+    double half[] = {0, 0.5, 1, 1.5, 2, 2.5}, line[] = {1, 2, 3, 4, 5, 6};
+    te_table uniform = {0, values, 4, TE_TABLE_LINEAR, 0, 1};
+    te_table uneven = {grid, values, 4, TE_TABLE_LINEAR};
+    te_table cubic = {grid, values, 4, TE_TABLE_CUBIC};
+    te_table steps = {0, line, 6, TE_TABLE_CUBIC, 0, 0.5};
+    te_table stepped = {half, line, 6, TE_TABLE_CUBIC};
+    te_variable lookup[] = {
+        {"x", &x},
+        {"u", &uniform, TE_TABLE}, {"v", &uneven, TE_TABLE}, {"w", &cubic, TE_TABLE},
+        {"s", &steps, TE_TABLE}, {"t", &stepped, TE_TABLE},
+    };
+
+    te_expr *u = te_compile("u(x)", lookup, 6, 0);
+    te_expr *v = te_compile("v(x)", lookup, 6, 0);
+    te_expr *w = te_compile("w(x)", lookup, 6, 0);
+    te_expr *st = te_compile("s(x) - t(x)", lookup, 6, 0);
+    lok(u && v && w && st);
+
+    /* Linear in each cell, flat outside the grid. */
+    x = 1.5; lfequal(te_eval(u), 15);
+    x = 2; lfequal(te_eval(v), 15);
+    x = 5; lfequal(te_eval(v), 17.5);
+    x = -1; lfequal(te_eval(u), 0); lfequal(te_eval(w), 0);
+    x = 9; lfequal(te_eval(u), 15); lfequal(te_eval(w), 15);
+    x = NAN; lok(te_eval(u) != te_eval(u));
+
+    /* Cubic interpolation goes through every grid point and never overshoots. */
+    int i, j;
+    for (i = 0; i < 4; ++i) {
+        x = grid[i];
+        lfequal(te_eval(w), values[i]);
+    }
+    double last = 0;
+    for (i = 0; i <= 300; ++i) {
+        x = i * 0.01;
+        const double y = te_eval(w);
+        lok(y >= last && y <= 20);
+        last = y;
+    }
+    for (i = 0; i < 100; ++i) {
+        x = 3 + i * 0.04;
+        lok(te_eval(w) >= 15 && te_eval(w) <= 20);
+    }
+
+    /* Uniform and explicit grids agree, and linear data stays linear. */
+    for (i = 0; i < 60; ++i) {
+        x = i * 0.05 - 0.2;
+        lfequal(te_eval(st), 0);
+    }
+    x = 1.25;
+    te_expr *n = te_compile("s(x)", lookup, 6, 0);
+    lfequal(te_eval(n), 3.5);
+    te_free(n);
+
+    /* The search finds the right cell on a longer uneven grid. */
+    double gx[97], gy[97];
+    for (i = 0; i < 97; ++i) {
+        gx[i] = i * i * 0.01;
+        gy[i] = i;
+    }
+    te_table big = {gx, gy, 97, TE_TABLE_LINEAR};
+    te_variable biglookup[] = {{"x", &x}, {"g", &big, TE_TABLE}};
+    n = te_compile("g(x)", biglookup, 2, 0);
+    for (i = 0; i < 97 * 97; i += 97) {
+        x = i * 0.01;
+        for (j = 0; j < 96 && gx[j+1] <= x; ++j);
+        lfequal(te_eval(n), j == 96 ? 96 : j + (x - gx[j]) / (gx[j+1] - gx[j]));
+    }
+    te_free(n);
+
+    /* Lookups are pure, so constant arguments are folded. */
+    n = te_compile("v(2) + x", lookup, 6, 0);
+    values[2] = 100;
+    x = 0;
+    lfequal(te_eval(n), 15);
+    lfequal(te_eval(v), 0);
+    te_free(n);
+    values[2] = 20;
+
+    /* Batches match te_eval. */
+    te_array arrays[] = {{&x, xs}};
+    for (i = 0; i < 1000; ++i) {
+        xs[i] = i * 0.009 - 0.5;
+    }
+    te_eval_batch(w, arrays, 1, 1000, out);
+    for (i = 0; i < 1000; i += 7) {
+        x = xs[i];
+        lfequal(out[i], te_eval(w));
+    }
+
+    /* Tables show up as dependencies. */
+    int deps[6];
+    n = te_compile("u(1) + w(x)", lookup, 6, 0);
+    lequal(te_dependencies(n, lookup, 6, deps), 2);
+    lequal(deps[0], 0);
+    lequal(deps[1], 3);
+    te_free(n);
+
+    /* Interval bounds cover the grid values of the cells reached. */
+    double lo, hi;
+    te_interval r = {&x, 0.5, 2};
+    te_eval_interval(v, &r, 1, &lo, &hi);
+    lok(lo <= 5 && lo > -1e-9 && hi >= 20 && hi < 20 + 1e-9);
+    te_eval_interval(w, &r, 1, &lo, &hi);
+    lok(lo <= 0 && hi >= 20 && hi < 20 + 1e-9);
+    r.lo = 4; r.hi = 100;
+    te_eval_interval(w, &r, 1, &lo, &hi);
+    lok(lo <= 15 && lo > 15 - 1e-9 && hi >= 20);
+
+    te_free(u);
+    te_free(v);
+    te_free(w);
+    te_free(st);
+}
+
+
+void test_interval() {
+
+    double x, y;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}};
+
+    typedef struct {
+        const char *expr;
+        double xlo, xhi, ylo, yhi;
+    } box;
+
+    box cases[] = {
+        {"x + y*2 - 1", -3, 2, 0.5, 4},
+        {"x*y / (y + 5)", -2, 3, -1, 2},
+        {"x^2 - x*y", -2, 3, -1, 1},
+        {"x^3 + x^-2", -3, -0.5, 0, 0},
+        {"x^y", 0.5, 3, -2, 2},
+        {"x^y", -2, 2, -1.5, 2.5},
+        {"pow(x, 3) + pow(y, -1)", -2, 1, 0.25, 4},
+        {"sin(x) + cos(y)", -1, 2.5, 2, 7},
+        {"sin(x*y)", 0, 1.5, 0, 1},
+        {"tan(x)", -1.5, 1.5, 0, 0},
+        {"tan(x)", 1, 2, 0, 0},
+        {"atan2(y, x)", 0.5, 2, -3, 3},
+        {"atan2(y, x)", -2, 2, 0.5, 1},
+        {"atan2(y, x)", -2, -1, -1, 1},
+        {"sqrt(x) + log(y) + ln(y) + log10(x)", -1, 4, 0, 3},
+        {"exp(x) - sinh(y) + cosh(x) * tanh(y)", -2, 2, -1, 3},
+        {"acos(x) + asin(y) + atan(x*y)", -2, 0.5, -0.3, 0.9},
+        {"abs(x - y) + floor(x) + ceil(y)", -3.5, 2.2, -1.1, 0.7},
+        {"x % y", -7, 9, 2, 3},
+        {"fac(x) + ncr(x, y) + npr(x, y)", 0, 12, 0, 7},
+        {"gamma(x) + lgamma(y)", 0.2, 5, 0.5, 8},
+        {"erf(x) + erfc(y) + normcdf(x - y)", -3, 3, -2, 2},
+        {"(x, y*2)", -1, 1, 3, 4},
+        {"1 / x", -1, 1, 0, 0},
+    };
+
+    int i, j, k;
+    for (i = 0; i < sizeof(cases) / sizeof(box); ++i) {
+        const box *b = &cases[i];
+        te_interval ranges[] = {{&x, b->xlo, b->xhi}, {&y, b->ylo, b->yhi}};
+        int flags;
+        for (flags = 0; flags < 2; ++flags) {
+            te_expr *n = te_compile_ex(b->expr, lookup, 2, flags ? TE_OPT_FMA | TE_OPT_POLY : 0, 0);
+            lok(n);
+
+            double lo, hi;
+            te_eval_interval(n, ranges, 2, &lo, &hi);
+
+            /* Every number the expression gives inside the box is within bounds. */
+            int outside = 0;
+            for (j = 0; j <= 40; ++j) {
+                for (k = 0; k <= 40; ++k) {
+                    x = b->xlo + (b->xhi - b->xlo) * j / 40;
+                    y = b->ylo + (b->yhi - b->ylo) * k / 40;
+                    const double v = te_eval(n);
+                    if (v == v && !(v >= lo && v <= hi)) ++outside;
+                }
+            }
+            lequal(outside, 0);
+            te_free(n);
+        }
+    }
+
+    /* Bounds are reasonably tight. */
+    double lo, hi;
+    te_interval r[] = {{&x, -2, 3}, {&y, 0, 1}};
+    te_expr *n = te_compile("x^2", lookup, 2, 0);
+    te_eval_interval(n, r, 1, &lo, &hi);
+    lfequal(lo, 0);
+    lfequal(hi, 9);
+    te_free(n);
+
+    n = te_compile("sin(y)", lookup, 2, 0);
+    te_eval_interval(n, r, 2, &lo, &hi);
+    lfequal(lo, 0);
+    lfequal(hi, sin(1));
+    te_free(n);
+
+    /* Unbound variables keep their value. */
+    y = 5;
+    n = te_compile("x + y", lookup, 2, 0);
+    te_eval_interval(n, r, 1, &lo, &hi);
+    lfequal(lo, 3);
+    lfequal(hi, 8);
+    te_free(n);
+
+    /* Poles give infinite bounds, and no numbers at all give NaN. */
+    n = te_compile("1/y", lookup, 2, 0);
+    te_eval_interval(n, r, 2, &lo, &hi);
+    lok(lo == -INFINITY && hi == INFINITY);
+    te_free(n);
+
+    n = te_compile("sqrt(-1 - y)", lookup, 2, 0);
+    te_eval_interval(n, r, 2, &lo, &hi);
+    lok(lo != lo && hi != hi);
+    te_free(n);
+}
+
+
+void test_metrics() {
+
+    double x;
+    te_variable lookup[] = {{"x", &x}};
+    te_metrics before, after;
+
+    if (!te_get_metrics(&before)) {
+        /* Built without TE_METRICS: everything reads as zero. */
+        lok(before.compiles == 0);
+        lok(before.evaluations == 0);
+        return;
+    }
+
+    te_expr *n = te_compile("x*(2+3)", lookup, 1, 0);
+    te_expr *bad = te_compile("x*(2+", lookup, 1, 0);
+    lok(!bad);
+    te_eval(n);
+    te_eval(n);
+
+    double xs[10] = {0}, out[10];
+    te_array arrays[] = {{&x, xs}};
+    te_eval_batch(n, arrays, 1, 10, out);
+
+    te_get_metrics(&after);
+    lok(after.compiles - before.compiles == 2);
+    lok(after.compile_failures - before.compile_failures == 1);
+    lok(after.evaluations - before.evaluations == 12);
+    lok(after.nodes_allocated - before.nodes_allocated == 3);
+    lok(after.bytes_live - before.bytes_live == te_memory_usage(n));
+    lok(after.folds - before.folds == 1);
+    lok(after.fold_attempts - before.fold_attempts == 2);
+
+    unsigned long long latency = 0;
+    int i;
+    for (i = 0; i < TE_METRICS_BUCKETS; ++i) latency += after.compile_latency[i] - before.compile_latency[i];
+    lok(latency == 2);
+
+    te_free(n);
+    te_get_metrics(&after);
+    lok(after.nodes_freed - before.nodes_freed == 3);
+    lok(after.bytes_live == before.bytes_live);
+}
+
+
+void test_batch() {
+
+    double x, y, xs[1000], ys[1000], out[1000];
+    te_variable lookup[] = {{"x", &x}, {"y", &y}, {"c2", clo2, TE_CLOSURE2, 0}};
+    te_array arrays[] = {{&x, xs}, {&y, ys}};
+
+    const char *exprs[] = {
+        "x",
+        "x+y*2",
+        "sqrt(x^2+y^2)",
+        "-x/(y+1)",
+        "(x, y)",
+        "c2(x, y) - pow(x, 1.5)",
+        "atan2(x, 3) + 5",
+    };
+
+    int i, j;
+    for (i = 0; i < 1000; ++i) {
+        xs[i] = i * 0.25;
+        ys[i] = 1000 - i;
+    }
+
+    for (j = 0; j < sizeof(exprs) / sizeof(const char *); ++j) {
+        int err;
+        te_expr *n = te_compile(exprs[j], lookup, 3, &err);
+        lok(n);
+
+        te_eval_batch(n, arrays, 2, 1000, out);
+        for (i = 0; i < 1000; i += 37) {
+            x = xs[i]; y = ys[i];
+            lfequal(out[i], te_eval(n));
+        }
+        x = xs[999]; y = ys[999];
+        lfequal(out[999], te_eval(n));
+
+        te_free(n);
+    }
+
+    /* Variables not listed in the arrays keep their current value. */
+    te_expr *n = te_compile("x*y", lookup, 2, 0);
+    y = 3;
+    te_eval_batch(n, arrays, 1, 1000, out);
+    lfequal(out[10], xs[10] * 3);
+    lfequal(out[999], xs[999] * 3);
+    te_free(n);
+}
+
+
+double counted(void *context, double a) {
+    ++*(int*)context;
+    return a * 2;
+}
+
+void test_hoist() {
+
+    double x, r, t, xs[1000], out[1000];
+    int calls = 0;
+    te_variable lookup[] = {{"x", &x}, {"r", &r}, {"t", &t}, {"twice", counted, TE_CLOSURE1 | TE_FLAG_PURE, &calls}};
+    te_array arrays[] = {{&x, xs}};
+
+    int i;
+    for (i = 0; i < 1000; ++i) {
+        xs[i] = i;
+    }
+
+    te_expr *n = te_compile("x * exp(-r*t) + twice(sqrt(r))", lookup, 4, 0);
+    lok(n);
+
+    r = 0.05; t = 2;
+    te_eval_batch(n, arrays, 1, 1000, out);
+    lequal(calls, 1);
+    for (i = 0; i < 1000; i += 99) {
+        lfequal(out[i], xs[i] * exp(-r*t) + 2*sqrt(r));
+    }
+
+    /* Uniform values are read again on every call. */
+    r = 1;
+    te_eval_batch(n, arrays, 1, 1000, out);
+    lequal(calls, 2);
+    lfequal(out[10], 10 * exp(-2) + 2);
+    te_free(n);
+
+    /* Branches that depend on the rows are not hoisted. */
+    n = te_compile("twice(x + r)", lookup, 4, 0);
+    calls = 0;
+    te_eval_batch(n, arrays, 1, 1000, out);
+    lequal(calls, 1000);
+    lfequal(out[999], 2000);
+    te_free(n);
+}
+
+
+void test_validate() {
+
+    double x, y;
+    int calls = 0;
+    te_variable lookup[] = {{"x", &x}, {"y", &y}, {"twice", counted, TE_CLOSURE1, &calls}};
+
+    const char *valid[] = {
+        "x+y",
+        "twice(x) * sin y",
+        "atan2(x, twice 3), y",
+        "-x^-y",
+    };
+
+    const char *invalid[] = {
+        "x+z",
+        "twice()",
+        "atan2(x)",
+        "x+(y",
+    };
+
+    int i, err;
+    for (i = 0; i < sizeof(valid) / sizeof(const char *); ++i) {
+        lok(te_validate(valid[i], lookup, 3, &err));
+        lequal(err, 0);
+    }
+
+    for (i = 0; i < sizeof(invalid) / sizeof(const char *); ++i) {
+        int compile_err;
+        te_expr *n = te_compile(invalid[i], lookup, 3, &compile_err);
+        lok(!n);
+        lok(!te_validate(invalid[i], lookup, 3, &err));
+        lequal(err, compile_err);
+    }
+
+    /* Validation never calls into bound functions. */
+    lequal(calls, 0);
+}
+
+
+double greater(double a, double b) {
+    return a > b;
+}
+
+void test_select() {
+
+    double x, y, xs[1000], ys[1000], out[1000], dense[1000];
+    size_t sel[1000], passed[1000];
+    unsigned char mask[125];
+    te_variable lookup[] = {{"x", &x}, {"y", &y}, {"gt", greater, TE_FUNCTION2 | TE_FLAG_PURE}};
+    te_array arrays[] = {{&x, xs}, {&y, ys}};
+
+    int i;
+    size_t count = 0, k;
+    for (i = 0; i < 1000; ++i) {
+        xs[i] = i * 0.25;
+        ys[i] = 1000 - i;
+        if (i % 7 == 3) sel[count++] = i;
+    }
+
+    /* Selected rows match the same rows of a dense batch, including through Horner. */
+    const int flags[] = {TE_OPT_STRICT, TE_OPT_POLY};
+    for (i = 0; i < 2; ++i) {
+        te_expr *n = te_compile_ex("x^3 - 2*x + sqrt(y)", lookup, 3, flags[i], 0);
+        lok(n);
+        te_eval_batch(n, arrays, 2, 1000, dense);
+        te_eval_select(n, arrays, 2, sel, count, out);
+        for (k = 0; k < count; ++k) {
+            lfequal(out[k], dense[sel[k]]);
+        }
+        te_free(n);
+    }
+
+    /* Any order works, and a NULL selection means every row. */
+    te_expr *n = te_compile("x*y", lookup, 2, 0);
+    size_t backwards[] = {999, 0, 500, 500};
+    te_eval_select(n, arrays, 2, backwards, 4, out);
+    lfequal(out[0], xs[999] * ys[999]);
+    lfequal(out[1], 0);
+    lfequal(out[3], xs[500] * ys[500]);
+    te_eval_select(n, arrays, 2, 0, 1000, out);
+    lfequal(out[777], xs[777] * ys[777]);
+    te_free(n);
+
+    /* Filtering every row. */
+    n = te_compile("gt(x, y)", lookup, 3, 0);
+    count = te_filter(n, arrays, 2, 0, 1000, passed);
+    lequal((int)count, 199);
+    lequal((int)passed[0], 801);
+    lequal((int)passed[198], 999);
+
+    /* Filtering a selection in place. */
+    count = 0;
+    for (i = 0; i < 1000; ++i) {
+        if (i % 2) sel[count++] = i;
+    }
+    count = te_filter(n, arrays, 2, sel, count, sel);
+    lequal((int)count, 100);
+    lequal((int)sel[0], 801);
+    lequal((int)sel[99], 999);
+    te_free(n);
+
+    /* NaN does not pass. */
+    n = te_compile("sqrt(x - 200)", lookup, 2, 0);
+    count = te_filter(n, arrays, 1, 0, 1000, passed);
+    lequal((int)count, 199);
+    lequal((int)passed[0], 801);
+    te_free(n);
+
+    /* Bitmasks. */
+    for (i = 0; i < 125; ++i) mask[i] = 0;
+    mask[0] = 0x81;
+    mask[124] = 0x80;
+    count = te_mask_selection(mask, 1000, sel);
+    lequal((int)count, 3);
+    lequal((int)sel[0], 0);
+    lequal((int)sel[1], 7);
+    lequal((int)sel[2], 999);
+}
+
+
+void test_reduce() {
+
+    double x, xs[1001];
+    te_variable lookup[] = {{"x", &x}};
+    te_array arrays[] = {{&x, xs}};
+
+    int i;
+    for (i = 0; i < 1001; ++i) {
+        xs[i] = i;
+    }
+
+    te_expr *n = te_compile("x*2", lookup, 1, 0);
+    size_t hist[4];
+    te_reduction r;
+    te_reduce_init(&r, 0, 2000, 4, hist);
+    te_reduce(n, arrays, 1, 1001, &r);
+
+    lequal((int)r.rows, 1001);
+    lequal((int)r.count, 1001);
+    lfequal(r.sum, 1001000);
+    lfequal(r.min, 0);
+    lfequal(r.max, 2000);
+    lequal((int)hist[0], 250);
+    lequal((int)hist[3], 251);
+
+    /* Reductions of disjoint rows combine to the whole. */
+    te_reduction a, b;
+    te_reduce_init(&a, 0, 0, 0, 0);
+    te_reduce_init(&b, 0, 0, 0, 0);
+    te_reduce(n, arrays, 1, 500, &a);
+    arrays[0].values = xs + 500;
+    te_reduce(n, arrays, 1, 501, &b);
+    te_reduce_merge(&a, &b);
+    lequal((int)a.count, 1001);
+    lfequal(a.sum, r.sum);
+    lfequal(a.min, r.min);
+    lfequal(a.max, r.max);
+
+    /* Values out of range land in the edge bins. */
+    arrays[0].values = xs;
+    te_reduce_init(&r, 500, 1500, 4, hist);
+    te_reduce(n, arrays, 1, 1001, &r);
+    lequal((int)hist[0], 375);
+    lequal((int)hist[3], 376);
+
+    /* An empty range keeps no histogram. */
+    te_reduce_init(&r, 1, 1, 4, hist);
+    te_reduce(n, arrays, 1, 1001, &r);
+    lequal(r.bins, 0);
+    lequal((int)(hist[0] + hist[1] + hist[2] + hist[3]), 0);
+    lequal((int)r.count, 1001);
+    te_free(n);
+
+    /* NaN rows are counted but not accumulated. */
+    n = te_compile("sqrt(x-500)", lookup, 1, 0);
+    arrays[0].values = xs;
+    te_reduce_init(&r, 0, 0, 0, 0);
+    te_reduce(n, arrays, 1, 1001, &r);
+    lequal((int)r.rows, 1001);
+    lequal((int)r.count, 501);
+    lfequal(r.min, 0);
+
+    /* A prepared batch gives the same results chunk by chunk. */
+    te_batch *batch = te_batch_new(n, arrays, 1);
+    te_reduction whole, chunked;
+    double out[7], direct[7];
+    size_t rows[7];
+    lok(batch);
+    te_reduce_init(&whole, 0, 40, 4, hist);
+    te_reduce(n, arrays, 1, 1001, &whole);
+    size_t parts[4];
+    te_reduce_init(&chunked, 0, 40, 4, parts);
+    for (i = 0; i < 1001; i += 7) {
+        arrays[0].values = xs + i;
+        te_batch_reduce(batch, arrays, i + 7 <= 1001 ? 7 : 1001 - i, &chunked);
+    }
+    lequal((int)chunked.rows, 1001);
+    lequal((int)chunked.count, (int)whole.count);
+    lfequal(chunked.sum, whole.sum);
+    lfequal(chunked.max, whole.max);
+    for (i = 0; i < 4; ++i) lequal((int)parts[i], (int)hist[i]);
+
+    arrays[0].values = xs + 495;
+    te_batch_eval(batch, arrays, 0, 7, out);
+    te_eval_batch(n, arrays, 1, 7, direct);
+    for (i = 0; i < 7; ++i) lok(out[i] == direct[i] || (out[i] != out[i] && direct[i] != direct[i]));
+    lequal((int)te_batch_filter(batch, arrays, 0, 7, rows), 1);
+    lequal((int)rows[0], 6);
+    te_batch_free(batch);
+    te_batch_free(0);
+    lok(!te_batch_new(0, arrays, 1));
+    te_free(n);
+
+    /* Threads split the rows and merge to the same totals. */
+    static double big[100000];
+    for (i = 0; i < 100000; ++i) big[i] = i % 1000;
+    arrays[0].values = big;
+    n = te_compile("x*2", lookup, 1, 0);
+    int threads[] = {-1, 1, 3, 8, 1000};
+    for (i = 0; i < 5; ++i) {
+        size_t bins[4];
+        int k;
+        te_reduce_init(&r, 0, 2000, 4, hist);
+        te_reduce(n, arrays, 1, 100000, &r);
+        te_reduce_init(&a, 0, 2000, 4, bins);
+        te_reduce_parallel(n, arrays, 1, 100000, &a, threads[i]);
+        lequal((int)a.rows, 100000);
+        lequal((int)a.count, 100000);
+        lfequal(a.sum, r.sum);
+        lfequal(a.min, 0);
+        lfequal(a.max, 1998);
+        for (k = 0; k < 4; ++k) lequal((int)bins[k], (int)hist[k]);
+    }
+    te_free(n);
+}
+
+
 int main(int argc, char *argv[])
 {
     lrun("Results", test_results);
@@ -699,9 +2153,32 @@ int main(int argc, char *argv[])
     lrun("Functions", test_functions);
     lrun("Dynamic", test_dynamic);
     lrun("Closure", test_closure);
+    lrun("Context", test_context);
     lrun("Optimize", test_optimize);
     lrun("Pow", test_pow);
     lrun("Combinatorics", test_combinatorics);
+    lrun("Special", test_special);
+    lrun("Specialize", test_specialize);
+    lrun("FMA", test_fma);
+    lrun("Poly", test_poly);
+    lrun("Reassoc", test_reassoc);
+    lrun("Memory", test_memory);
+    lrun("Dependencies", test_dependencies);
+    lrun("State", test_state);
+    lrun("Stream", test_stream);
+    lrun("Template", test_template);
+    lrun("Bulk", test_bulk);
+    lrun("Handle", test_handle);
+    lrun("Cost", test_cost);
+    lrun("Approximate", test_approximate);
+    lrun("Table", test_table);
+    lrun("Interval", test_interval);
+    lrun("Metrics", test_metrics);
+    lrun("Batch", test_batch);
+    lrun("Hoist", test_hoist);
+    lrun("Select", test_select);
+    lrun("Reduce", test_reduce);
+    lrun("Validate", test_validate);
     lresults();
 
     return lfails != 0;
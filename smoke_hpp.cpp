@@ -0,0 +1,349 @@
+/* Also built as C++17 by the smoke_hpp17 target, which leaves out the
+ * parts that need C++20. */
+#include "tinyexpr.hpp"
+#if __cplusplus >= 202002L
+#include "tinyexpr_ct.hpp"
+#endif
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include "minctest.h"
+
+
+struct point {
+    double x, y;
+};
+
+static double twice(double a) { return a * 2; }
+
+#if __cplusplus >= 202002L
+template<class V>
+concept binds_variable = requires (te::Bindings b, V &&v) { b.variable("v", static_cast<V&&>(v)); };
+
+template<class O>
+concept binds_member = requires (te::Bindings b, O &&o) { b.member("m", static_cast<O&&>(o), &point::x); };
+#endif
+
+
+void test_compile() {
+    te::Bindings b;
+    double x = 3;
+    b.variable("x", x);
+
+    te::Expression e("x*x + 1", b);
+    lok(e);
+    lfequal(e(), 10);
+    x = 4;
+    lfequal(e(), 17);
+
+    try {
+        te::Expression bad("x*(x+", b);
+        lok(0);
+    } catch (const te::Error &err) {
+        lequal(err.position(), 5);
+    }
+
+    lfequal(te::interp("2^10"), 1024);
+}
+
+
+void test_move() {
+    te::Expression a("1+2");
+    te::Expression b(std::move(a));
+    lok(!a);
+    lfequal(b(), 3);
+
+    te::Expression c;
+    c = std::move(b);
+    lok(!b);
+    lfequal(c(), 3);
+
+    std::vector<te::Expression> v;
+    v.emplace_back("4");
+    v.emplace_back("5");
+    lfequal(v[0]() + v[1](), 9);
+}
+
+
+void test_bind() {
+    point p = {2, 5};
+    int calls = 0;
+    auto counted = [&calls](double a, double b) { ++calls; return a - b; };
+
+    te::Bindings b;
+    b.member("px", p, &point::x)
+     .member("py", p, &point::y)
+     .function("twice", twice)
+     .function("sq", [](double a) { return a * a; })
+     .function("diff", counted)
+     .function("off", [k = 10.0](double a) { return a + k; })
+     .pure_function("cube", [](double a) { return a * a * a; });
+
+    lequal(b.data()[2].type, TE_FUNCTION1);
+    lequal(b.data()[3].type, TE_FUNCTION1);
+    lequal(b.data()[4].type, TE_CLOSURE2);
+    lequal(b.data()[5].type, TE_CLOSURE1);
+
+    te::Expression e("twice(px) + sq(py) + diff(py, px) + off(0)", b);
+    lfequal(e(), 4 + 25 + 3 + 10);
+    lequal(calls, 1);
+    p.x = 1;
+    lfequal(e(), 2 + 25 + 4 + 10);
+
+    /* Pure calls on constants fold, leaving only the variable. */
+    te::Expression f("cube(2) * px", b);
+    const std::vector<int> deps = f.dependencies(b);
+    lequal((int)deps.size(), 1);
+    lequal(deps[0], 0);
+    lfequal(f(), 8);
+
+    const double ys[] = {0, 4, 16};
+    const te_table squares = {nullptr, ys, 3, TE_TABLE_LINEAR, 0, 2};
+    b.table("sqt", squares);
+    te::Expression g("sqt(px + 2)", b);
+    lfequal(g(), 10);
+
+#if __cplusplus >= 202002L
+    /* Temporaries cannot be bound by address. */
+    static_assert(binds_variable<double&> && !binds_variable<double>);
+    static_assert(binds_member<point&> && !binds_member<point>);
+#endif
+}
+
+
+void test_batch() {
+    double x = 0, y = 0, z = 7;
+    te::Bindings b;
+    b.variable("x", x).variable("y", y).variable("z", z);
+    te::Expression e("x*y + z", b, TE_OPT_FMA);
+
+    std::vector<double> xs = {1, 2, 3}, ys = {4, 5, 6}, out(3);
+    e.eval(out.data(), out.size(), {xs.data(), ys.data()});
+    lfequal(out[0], 11);
+    lfequal(out[1], 17);
+    lfequal(out[2], 25);
+
+#ifdef TE_HAVE_SPAN
+    std::fill(out.begin(), out.end(), 0);
+    e.eval(out, xs, ys);
+    lfequal(out[2], 25);
+
+    /* A column shorter than the output is rejected. */
+    std::vector<double> shorter(2);
+    try {
+        e.eval(out, xs, shorter);
+        lok(0);
+    } catch (const std::invalid_argument&) {
+    }
+#endif
+
+    te::Bindings known;
+    known.variable("z", z);
+    te::Expression s = e.specialize(known);
+    z = 0;
+    lfequal(s(), 7);
+
+    double error;
+    te::Expression c = te::Expression("exp(x) * z", b).approximate({{&x, 0, 1}}, 1e-12, &error);
+    lok(error > 0 && error <= 1e-12);
+    x = 0.5;
+    z = 2;
+    lok(std::fabs(c() - 2 * std::exp(0.5)) < 1e-11);
+
+    te::Expression avg("ema(x, 0.5)", b);
+    te::State s1(avg);
+    x = 2;
+    lfequal(avg(s1), 2);
+    te::State s2 = s1;
+    x = 4;
+    lfequal(avg(s1), 3);
+    x = 0;
+    lfequal(avg(s2), 1);
+
+    te::Handle h(te::Expression("x + 1", b));
+    te::Reader r(h);
+    x = 1;
+    lfequal(r(), 2);
+    const te_expr *held = te_read_begin(r.get());
+    lequal(h.replace(te::Expression("x * 10", b)), 1);
+    lfequal(te_eval(held), 2);
+    te_read_end(r.get());
+    lequal(h.collect(), 0);
+    lfequal(r(), 10);
+
+    te::Template t("x * 2 + y");
+    lfequal(t.bind(b)(), 2 * x + y);
+    double w = 5;
+    te::Bindings other;
+    other.variable("x", w).variable("y", w);
+    lfequal(t.bind(other)(), 15);
+    te::Bindings missing;
+    try {
+        t.bind(missing);
+        lok(0);
+    } catch (const te::Error &failure) {
+        lequal(failure.position(), 1);
+    }
+}
+
+
+#if __cplusplus >= 202002L
+/* Compares builtin B of tinyexpr_ct.hpp with the one of the same name in
+ * tinyexpr.c, so the two copies cannot drift apart unnoticed. */
+template<int B>
+void check_builtin() {
+    static const double points[] = {
+        -3.5, -1, -0.5, 0, 0.2, 0.5, 1, 2.5, 4.8, 10, 27, 56, 57, 170.5, 171, 276635, 1e300,
+        NAN, INFINITY, -INFINITY
+    };
+    const te::ct::builtin_info &info = te::ct::builtins[B];
+    double x, y;
+    te_variable vars[] = {{"x", &x}, {"y", &y}};
+    char text[32];
+    std::snprintf(text, sizeof(text), info.arity == 0 ? "%.*s" : info.arity == 1 ? "%.*s(x)" : "%.*s(x, y)",
+            (int)info.name.size(), info.name.data());
+    te_expr *n = te_compile(text, vars, 2, 0);
+    lok(n);
+    if (!n) return;
+    for (const double a : points) for (const double b : points) {
+        x = a;
+        y = b;
+        const double expected = te_eval(n), got = te::ct::detail::call<B>(a, b);
+        if (std::isnan(expected)) lok(std::isnan(got));
+        else lequal(std::memcmp(&expected, &got, sizeof(double)), 0);
+    }
+    te_free(n);
+}
+
+template<int... B>
+void check_builtins(std::integer_sequence<int, B...>) {
+    (check_builtin<B>(), ...);
+}
+
+
+/* Compares a compile-time formula with te_compile over a grid of x and y. */
+#define STATIC_CHECK(E) do { \
+    constexpr auto f = te::ct::compile<E, "x", "y">; \
+    double x, y; \
+    te_variable vars[] = {{"x", &x}, {"y", &y}}; \
+    te_expr *n = te_compile(E, vars, 2, 0); \
+    lok(n); \
+    for (x = -3; x < 3; x += .75) for (y = -2; y < 4; y += 1.25) { \
+        const double a = f(x, y), b = te_eval(n); \
+        if (std::isnan(b)) lok(std::isnan(a)); \
+        else if (std::isinf(b)) lok(a == b); \
+        else lfequal(a, b); \
+    } \
+    te_free(n); \
+} while (0)
+
+/* The value of a formula that is a single literal. */
+template<te::ct::fixed_string S>
+constexpr double literal() {
+    constexpr auto t = te::ct::parse<S>();
+    static_assert(t.error == 0 && t.nodes[t.root].kind == te::ct::K_NUMBER);
+    return t.nodes[t.root].value;
+}
+
+/* Compares the compile-time error position with te_compile. */
+#define STATIC_ERROR(E) do { \
+    double x, y; \
+    te_variable vars[] = {{"x", &x}, {"y", &y}}; \
+    int err; \
+    te_free(te_compile(E, vars, 2, &err)); \
+    const int ct_err = te::ct::parse<E, "x", "y">().error; \
+    lequal(ct_err, err); \
+} while (0)
+
+
+void test_static() {
+    check_builtins(std::make_integer_sequence<int, te::ct::B_COUNT>());
+
+    STATIC_CHECK("1+2*3");
+    STATIC_CHECK("x*y + 5");
+    STATIC_CHECK("-x^2");
+    STATIC_CHECK("--x - -y");
+    STATIC_CHECK("2^3^2");
+    STATIC_CHECK("x^y^0.5");
+    STATIC_CHECK("sqrt(x^2+y^2)");
+    STATIC_CHECK("sin x + cos -y");
+    STATIC_CHECK("atan2(y, x) * pi");
+    STATIC_CHECK("e() + pi");
+    STATIC_CHECK("pow(abs(x), y) % 3");
+    STATIC_CHECK("(x, y, x+y)");
+    STATIC_CHECK("log x + ln y + log10(x)");
+    STATIC_CHECK("ncr(6, 2) + npr(5, 3) + fac 5");
+    STATIC_CHECK("ncr(x+40, 20) + npr(200, y+3) + fac(x*30)");
+    STATIC_CHECK("gamma x + lgamma y + erf x * erfc y + normcdf(x-y)");
+    STATIC_CHECK("floor(x/2) + ceil(y/3)");
+    STATIC_CHECK("0.1 + .5e1 + 1e-3 + 0x1F + 1E+2");
+    STATIC_CHECK("123456789012345678901234 * 1e-20");
+    STATIC_CHECK("0.30000000000000004441 + 0x1.8p1");
+    STATIC_CHECK("1e23*x + 0.1e-30*y + 2.2250738585072011e-308");
+    STATIC_CHECK("  x\t*\ny  ");
+
+    STATIC_ERROR("1+");
+    STATIC_ERROR("(1+2");
+    STATIC_ERROR("1)");
+    STATIC_ERROR("x*z");
+    STATIC_ERROR("sin(");
+    STATIC_ERROR("atan2(1)");
+    STATIC_ERROR("atan2(1,2,3)");
+    STATIC_ERROR("pi(1)");
+    STATIC_ERROR("1 $ 2");
+    STATIC_ERROR(".");
+    STATIC_ERROR("");
+    STATIC_ERROR("0x");
+
+    /* The parse happens at compile time. */
+    static_assert(te::ct::parse<"x+y", "x", "y">().error == 0);
+    static_assert(te::ct::parse<"x+", "x">().error == 2);
+
+    /* Stateful builtins are refused rather than reported as unknown names. */
+    static_assert(te::ct::parse<"x + ema(x, 0.5)", "x">().stateful == 7);
+    static_assert(te::ct::parse<"x + ema(x, 0.5)", "x">().error == 7);
+    static_assert(te::ct::parse<"ema", "ema">().stateful == 0);
+
+    /* Inexact literals are rounded at compile time, as the compiler does. */
+    static_assert(literal<"0.1">() == 0.1);
+    static_assert(literal<"1e23">() == 1e23);
+    static_assert(literal<"123456789012345678901234">() == 123456789012345678901234.);
+    static_assert(literal<"9007199254740993">() == 9007199254740992.);
+    static_assert(literal<"9007199254740993.000000000000000000001">() == 9007199254740994.);
+    static_assert(literal<"2.2250738585072011e-308">() == 2.2250738585072011e-308);
+    static_assert(literal<"4.9e-324">() == 4.9e-324);
+    static_assert(literal<"2.4703282292062327e-324">() == 0);
+    static_assert(literal<"2.4703282292062328e-324">() == 4.9e-324);
+    static_assert(literal<"1.7976931348623158e308">() == 1.7976931348623157e308);
+    static_assert(literal<"1e400">() == INFINITY);
+    static_assert(literal<"1e-400">() == 0);
+    static_assert(literal<"3.9050448304680248225760902948829314382993e+204">()
+        == 3.9050448304680248225760902948829314382993e+204);
+    static_assert(literal<"0x1.8p3">() == 12);
+    static_assert(literal<"0x123456789abcdef123p-2">() == 0x123456789abcdef123p-2);
+    static_assert(literal<"0x1.0000000000001p-1075">() == 0x1p-1074);
+
+    constexpr auto f = te::ct::compile<"a*b + 1", "a", "b">;
+    std::vector<double> a = {1, 2, 3}, b = {4, 5, 6}, out(3);
+    f.eval(out, a, b);
+    lfequal(out[0], 5);
+    lfequal(out[2], 19);
+}
+#endif
+
+
+int main(int argc, char *argv[])
+{
+    lrun("Compile", test_compile);
+    lrun("Move", test_move);
+    lrun("Bind", test_bind);
+    lrun("Batch", test_batch);
+#if __cplusplus >= 202002L
+    lrun("Static", test_static);
+#endif
+    lresults();
+
+    return lfails != 0;
+}
@@ -0,0 +1,64 @@
+#!/bin/sh
+# Runs repl's columnar mode over small CSV and raw files.
+# Usage: smoke_repl.sh path/to/repl
+
+repl=${1:-./repl}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+fails=0
+tests=0
+
+# Checks that the output of the command matches the expected text.
+expect() {
+    want=$1
+    shift
+    tests=$((tests + 1))
+    got=$("$@" 2>/dev/null)
+    if [ $? -ne 0 ] || [ "$got" != "$want" ]; then
+        printf 'FAILED: %s\n  want: %s\n  got:  %s\n' "$*" "$want" "$got"
+        fails=$((fails + 1))
+    fi
+}
+
+# Checks that the command fails with the given message.
+expect_error() {
+    want=$1
+    shift
+    tests=$((tests + 1))
+    if "$@" >/dev/null 2>"$dir/err"; then
+        printf 'FAILED: %s succeeded\n' "$*"
+        fails=$((fails + 1))
+    elif ! grep -q "$want" "$dir/err"; then
+        printf 'FAILED: %s\n  want: %s\n  got:  %s\n' "$*" "$want" "$(cat "$dir/err")"
+        fails=$((fails + 1))
+    fi
+}
+
+printf 'a,b\n1,4\n2,5\r\n3,6\n' > "$dir/t.csv"
+printf 'a,b\n' > "$dir/header.csv"
+printf 'a,b\n1,4\n2\n' > "$dir/missing.csv"
+printf 'a\n1%0100d\n' 0 > "$dir/long.csv"
+
+expect "$(printf '5,4\n7,10\n9,18')" "$repl" -c "$dir/t.csv" "a+b" "a*b"
+expect "$(printf '5\n7\n9')" "$repl" -c "$dir/t.csv" -j 2 "a+b"
+
+# Raw files written by -o read back as the same column.
+"$repl" -c "$dir/t.csv" -o "$dir/a.f64" "a*10" 2>/dev/null
+expect "$(printf '9\n18\n27')" "$repl" -c "x=$dir/a.f64" -c "$dir/t.csv" "x - a"
+expect 24 sh -c 'wc -c < "$1" | tr -d " "' sh "$dir/a.f64"
+
+expect "" "$repl" -c "$dir/header.csv" "a+b"
+expect_error "missing column on row 2" "$repl" -c "$dir/missing.csv" "a+b"
+expect_error "field too long on row 1" "$repl" -c "$dir/long.csv" "a"
+
+head -c 16 "$dir/a.f64" > "$dir/short.f64"
+expect_error "Column x has 2 rows, expected 3" "$repl" -c "$dir/t.csv" -c "x=$dir/short.f64" "a+x"
+head -c 7 "$dir/a.f64" > "$dir/odd.f64"
+expect_error "size is not a multiple of 8 bytes" "$repl" -c "x=$dir/odd.f64" "x"
+expect_error "Error near here" "$repl" -c "$dir/t.csv" "a+c"
+
+if [ $fails -ne 0 ]; then
+    printf 'SOME TESTS FAILED (%d/%d)\n' $((tests - fails)) $tests
+    exit 1
+fi
+printf 'ALL TESTS PASSED (%d/%d)\n' $tests $tests
@@ -0,0 +1,165 @@
+/*
+ * TINYEXPR - Tiny recursive descent parser and evaluation engine in C
+ *
+ * Copyright (c) 2015-2020 Lewis Van Winkle
+ *
+ * http://CodePlea.com
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software
+ * in a product, an acknowledgement in the product documentation would be
+ * appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+/* Swaps the expression of a te_handle as fast as it can compile new ones
+ * while reader threads evaluate it nonstop. Usage: stress [seconds] [readers]
+ * Expression v evaluates to v, so each reader checks that it only ever sees
+ * published versions, in order, and that a tree held across many evaluations
+ * keeps its value. Build with -fsanitize=address or thread to catch trees
+ * freed too early. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include "tinyexpr.h"
+
+#define MAX_READERS 64
+
+
+static te_handle *handle;
+static atomic_llong published;
+static atomic_int stop;
+static double x = 0.5;
+
+
+typedef struct {
+    unsigned long long evaluations, long_reads, failures;
+} tally;
+
+
+static void *reader(void *arg) {
+    tally *t = arg;
+    te_reader *r = te_reader_new(handle);
+    double last = 0;
+    unsigned long long i;
+
+    if (!r) {
+        ++t->failures;
+        return 0;
+    }
+
+    for (i = 0; !atomic_load_explicit(&stop, memory_order_relaxed); ++i) {
+        double v;
+        if (i % 64 == 0) {
+            /* Hold one tree while the writer keeps swapping. */
+            const te_expr *n = te_read_begin(r);
+            int k;
+            v = te_eval(n);
+            for (k = 0; k < 256; ++k) {
+                if (te_eval(n) != v) ++t->failures;
+            }
+            te_read_end(r);
+            t->evaluations += 257;
+            ++t->long_reads;
+        } else {
+            v = te_read_eval(r);
+            ++t->evaluations;
+        }
+        if (v != (double)(long long)v || v < last || v > (double)atomic_load(&published)) {
+            if (t->failures++ < 10) fprintf(stderr, "read %g after %g\n", v, last);
+        }
+        last = v;
+    }
+
+    te_reader_free(r);
+    return 0;
+}
+
+
+static double seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+int main(int argc, char *argv[]) {
+    const double duration = argc > 1 ? atof(argv[1]) : 1;
+    int readers = argc > 2 ? atoi(argv[2]) : 4;
+    te_variable vars[] = {{"x", &x}};
+    pthread_t tids[MAX_READERS];
+    tally tallies[MAX_READERS] = {{0}};
+    unsigned long long swaps = 0, evaluations = 0, long_reads = 0, failures = 0;
+    int pending, most = 0, i;
+    double start, elapsed = 0;
+
+    if (readers < 1) readers = 1;
+    if (readers > MAX_READERS) readers = MAX_READERS;
+
+    handle = te_handle_new(te_compile("0", vars, 1, 0));
+    if (!handle) return 1;
+
+    for (i = 0; i < readers; ++i) {
+        if (pthread_create(&tids[i], NULL, reader, &tallies[i]) != 0) {
+            fprintf(stderr, "Could not start reader %d\n", i);
+            return 1;
+        }
+    }
+
+    start = seconds();
+    do {
+        char text[64];
+        int error;
+        te_expr *n;
+        ++swaps;
+        snprintf(text, sizeof(text), "%llu + sin(x)*0 + (x - x)", swaps);
+        n = te_compile(text, vars, 1, &error);
+        if (!n) {
+            fprintf(stderr, "Could not compile %s\n", text);
+            ++failures;
+            break;
+        }
+        atomic_store(&published, (long long)swaps);
+        pending = te_handle_swap(handle, n);
+        if (pending > most) most = pending;
+        elapsed = seconds() - start;
+    } while (elapsed < duration);
+
+    atomic_store(&stop, 1);
+    for (i = 0; i < readers; ++i) {
+        pthread_join(tids[i], NULL);
+        evaluations += tallies[i].evaluations;
+        long_reads += tallies[i].long_reads;
+        failures += tallies[i].failures;
+    }
+
+    pending = te_handle_collect(handle);
+    if (pending != 0) {
+        fprintf(stderr, "%d expressions left unfreed\n", pending);
+        ++failures;
+    }
+    te_handle_free(handle);
+
+    printf("%d readers, %.2fs: %.0f swaps/s, %.0f evaluations/s, %llu long reads, at most %d pending\n",
+            readers, elapsed, swaps / elapsed, evaluations / elapsed, long_reads, most);
+
+    if (failures) {
+        printf("FAILED (%llu)\n", failures);
+        return 1;
+    }
+    printf("ALL READS CONSISTENT\n");
+    return 0;
+}
@@ -34,12 +34,17 @@ For log = base 10 log do nothing
 For log = natural log uncomment the next line. */
 /* #define TE_NAT_LOG */
 
+/* Runtime metrics
+To leave te_get_metrics() empty do nothing.
+To count compiles, allocations and evaluations uncomment the next line.
+This needs a C11 compiler (atomics and thread-local storage). */
+/* #define TE_METRICS */
+
 #include "tinyexpr.h"
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
-#include <limits.h>
 
 #ifndef NAN
 #define NAN (0.0/0.0)
@@ -50,15 +55,104 @@ For log = natural log uncomment the next line. */
 #endif
 
 
+/* Handles (te_handle_new and friends) need C11 atomics. */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#define TE_HANDLES
+#include <stdatomic.h>
+#endif
+
+/* te_compile_bulk compiles on the calling thread alone without C11 threads. */
+#if defined(TE_HANDLES) && !defined(__STDC_NO_THREADS__) && defined(__has_include)
+#if __has_include(<threads.h>)
+#define TE_THREADS
+#include <threads.h>
+#endif
+#endif
+
+
+#ifdef TE_METRICS
+#include <stdatomic.h>
+#include <time.h>
+
+enum {
+    M_COMPILES, M_FAILURES, M_NODES_ALLOCATED, M_NODES_FREED,
+    M_BYTES_ALLOCATED, M_BYTES_FREED, M_EVALUATIONS, M_FOLD_ATTEMPTS, M_FOLDS,
+    M_LATENCY, M_COUNT = M_LATENCY + TE_METRICS_BUCKETS
+};
+
+/* Each thread only ever writes its own counters, so updates are plain
+ * relaxed stores. Readers sum the counters of every thread seen so far.
+ * The block of an exited thread is kept so its counts are not lost. */
+typedef struct counters {
+    atomic_ullong value[M_COUNT];
+    struct counters *next;
+} counters;
+
+static _Atomic(counters*) all_counters;
+static _Thread_local counters *thread_counters;
+
+static counters *get_counters(void) {
+    counters *c = thread_counters;
+    if (!c) {
+        c = calloc(1, sizeof(counters));
+        if (!c) return 0;
+        c->next = atomic_load(&all_counters);
+        while (!atomic_compare_exchange_weak(&all_counters, &c->next, c));
+        thread_counters = c;
+    }
+    return c;
+}
+
+static void bump(int which, unsigned long long n) {
+    counters *c = get_counters();
+    if (c) atomic_store_explicit(&c->value[which], atomic_load_explicit(&c->value[which], memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static double now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define COUNT(WHICH, N) bump((WHICH), (N))
+#else
+#define COUNT(WHICH, N) ((void)0)
+#endif
+
+
 typedef double (*te_fun2)(double, double);
 
 enum {
     TOK_NULL = TE_CLOSURE7+1, TOK_ERROR, TOK_END, TOK_SEP,
-    TOK_OPEN, TOK_CLOSE, TOK_NUMBER, TOK_VARIABLE, TOK_INFIX
+    TOK_OPEN, TOK_CLOSE, TOK_NUMBER, TOK_VARIABLE, TOK_INFIX, TOK_NAME
 };
 
 
-enum {TE_CONSTANT = 1};
+enum {TE_CONSTANT = 1, TE_POLY, TE_CHEB};
+
+
+/* A polynomial in one variable, sum of coefficients[k] * bound^k. */
+typedef struct te_poly {
+    int type;
+    union {double value; const double *bound; const void *function;};
+    int degree;
+    double coefficients[1];
+} te_poly;
+
+#define POLY_SIZE(DEGREE) (offsetof(te_poly, coefficients) + sizeof(double) * ((DEGREE) + 1))
+
+
+/* A Chebyshev series in one variable, sum of coefficients[k] * T_k(t) with
+ * t = (bound - center) * scale. */
+typedef struct te_cheb {
+    int type;
+    union {double value; const double *bound; const void *function;};
+    int degree;
+    double center, scale;
+    double coefficients[1];
+} te_cheb;
+
+#define CHEB_SIZE(DEGREE) (offsetof(te_cheb, coefficients) + sizeof(double) * ((DEGREE) + 1))
 
 
 typedef struct state {
@@ -70,22 +164,118 @@ typedef struct state {
 
     const te_variable *lookup;
     int lookup_len;
+    const te_variable *const *index; /* lookup sorted by name, or NULL. */
+
+    /* Streaming input: start is a window of buffer ending at end, offset */
+    /* bytes into the expression. source is NULL once it has run dry. */
+    te_source source;
+    void *source_context;
+    char *buffer;
+    const char *end;
+    size_t offset;
+    int failed;
+
+    /* Templates: names are interned into building while lexing one, and */
+    /* tokens are replayed from a template, with names resolved, to bind it. */
+    struct te_template *building;
+    const struct token *tokens;
+    const te_variable *const *resolved;
+    int name;
+
+    int evaluate;
+    int negated;
 } state;
 
 
+/* A token of a template. Names are indices into its names, and end is the */
+/* position te_compile reports for an error at the token. */
+typedef struct token {
+    int type;
+    int name;
+    union {double value; const void *function;};
+    size_t end;
+} token;
+
+struct te_template {
+    token *tokens;
+    int token_count;
+    char **names;
+    int name_count;
+    int *slots; /* Hash table of names, -1 where empty, filled by intern. */
+    int slot_mask;
+};
+
+
 #define TYPE_MASK(TYPE) ((TYPE)&0x0000001F)
 
 #define IS_PURE(TYPE) (((TYPE) & TE_FLAG_PURE) != 0)
+/* Marks a call to a stateful builtin, whose context slot holds its index in a te_state. */
+#define TE_FLAG_STATE 64
 #define IS_FUNCTION(TYPE) (((TYPE) & TE_FUNCTION0) != 0)
 #define IS_CLOSURE(TYPE) (((TYPE) & TE_CLOSURE0) != 0)
 #define ARITY(TYPE) ( ((TYPE) & (TE_FUNCTION0 | TE_CLOSURE0)) ? ((TYPE) & 0x00000007) : 0 )
 #define NEW_EXPR(type, ...) new_expr((type), (const te_expr*[]){__VA_ARGS__})
 
+static int expr_size(const int type) {
+    return (sizeof(te_expr) - sizeof(void*)) + sizeof(void*) * ARITY(type) + (IS_CLOSURE(type) ? sizeof(void*) : 0);
+}
+
+static int node_size(const te_expr *n) {
+    if (TYPE_MASK(n->type) == TE_POLY) return POLY_SIZE(((const te_poly*)n)->degree);
+    if (TYPE_MASK(n->type) == TE_CHEB) return CHEB_SIZE(((const te_cheb*)n)->degree);
+    return expr_size(n->type);
+}
+
+#ifdef TE_THREADS
+/* While te_compile_bulk compiles on a thread, the nodes of trees being built
+ * come from that thread's arena. Freeing them does nothing, and the arena is
+ * rewound once the tree has been packed, so threads do not contend on malloc. */
+#define TE_ARENA_CHUNK 65536
+
+typedef struct chunk {
+    struct chunk *next;
+    size_t size, used;
+    double data[1];
+} chunk;
+
+static _Thread_local chunk *arena;
+#endif
+
+static void *alloc_node(size_t size) {
+#ifdef TE_THREADS
+    chunk *c = arena;
+    void *ret;
+    if (c) {
+        size = (size + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+        if (c->used + size > c->size) {
+            const size_t capacity = size > TE_ARENA_CHUNK ? size : TE_ARENA_CHUNK;
+            c = malloc(offsetof(chunk, data) + capacity);
+            if (!c) return 0;
+            c->next = arena;
+            c->size = capacity;
+            c->used = 0;
+            arena = c;
+        }
+        ret = (char*)c->data + c->used;
+        c->used += size;
+        return ret;
+    }
+#endif
+    return malloc(size);
+}
+
+static void free_node(void *n) {
+#ifdef TE_THREADS
+    if (arena) return;
+#endif
+    free(n);
+}
+
 static te_expr *new_expr(const int type, const te_expr *parameters[]) {
     const int arity = ARITY(type);
     const int psize = sizeof(void*) * arity;
-    const int size = (sizeof(te_expr) - sizeof(void*)) + psize + (IS_CLOSURE(type) ? sizeof(void*) : 0);
-    te_expr *ret = malloc(size);
+    const int size = expr_size(type);
+    te_expr *ret = alloc_node(size);
     memset(ret, 0, size);
     if (arity && parameters) {
         memcpy(ret->parameters, parameters, psize);
@@ -96,58 +286,352 @@ static te_expr *new_expr(const int type, const te_expr *parameters[]) {
 }
 
 
+static void free_tree(te_expr *n);
+
 void te_free_parameters(te_expr *n) {
     if (!n) return;
     switch (TYPE_MASK(n->type)) {
-        case TE_FUNCTION7: case TE_CLOSURE7: te_free(n->parameters[6]);     /* Falls through. */
-        case TE_FUNCTION6: case TE_CLOSURE6: te_free(n->parameters[5]);     /* Falls through. */
-        case TE_FUNCTION5: case TE_CLOSURE5: te_free(n->parameters[4]);     /* Falls through. */
-        case TE_FUNCTION4: case TE_CLOSURE4: te_free(n->parameters[3]);     /* Falls through. */
-        case TE_FUNCTION3: case TE_CLOSURE3: te_free(n->parameters[2]);     /* Falls through. */
-        case TE_FUNCTION2: case TE_CLOSURE2: te_free(n->parameters[1]);     /* Falls through. */
-        case TE_FUNCTION1: case TE_CLOSURE1: te_free(n->parameters[0]);
+        case TE_FUNCTION7: case TE_CLOSURE7: free_tree(n->parameters[6]);     /* Falls through. */
+        case TE_FUNCTION6: case TE_CLOSURE6: free_tree(n->parameters[5]);     /* Falls through. */
+        case TE_FUNCTION5: case TE_CLOSURE5: free_tree(n->parameters[4]);     /* Falls through. */
+        case TE_FUNCTION4: case TE_CLOSURE4: free_tree(n->parameters[3]);     /* Falls through. */
+        case TE_FUNCTION3: case TE_CLOSURE3: free_tree(n->parameters[2]);     /* Falls through. */
+        case TE_FUNCTION2: case TE_CLOSURE2: free_tree(n->parameters[1]);     /* Falls through. */
+        case TE_FUNCTION1: case TE_CLOSURE1: free_tree(n->parameters[0]);
     }
 }
 
 
-void te_free(te_expr *n) {
+static void free_tree(te_expr *n) {
+    /* Frees a tree still being built, which has one allocation per node. */
     if (!n) return;
     te_free_parameters(n);
+    free_node(n);
+}
+
+
+/* Finished trees are packed into a single allocation in pre-order, so a
+ * compiled expression costs one malloc and no per-node allocator overhead. */
+
+#define PACKED_SIZE(N) ((node_size(N) + sizeof(double) - 1) / sizeof(double) * sizeof(double))
+
+static size_t packed_size(const te_expr *n) {
+    size_t size = PACKED_SIZE(n);
+    int i;
+    for (i = 0; i < ARITY(n->type); ++i) {
+        size += packed_size(n->parameters[i]);
+    }
+    return size;
+}
+
+
+static int count_nodes(const te_expr *n) {
+    int i, count = 1;
+    for (i = 0; i < ARITY(n->type); ++i) {
+        count += count_nodes(n->parameters[i]);
+    }
+    return count;
+}
+
+
+static te_expr *pack_node(const te_expr *n, char **cursor) {
+    te_expr *ret = (te_expr*)*cursor;
+    int i;
+    memcpy(ret, n, node_size(n));
+    *cursor += PACKED_SIZE(n);
+    for (i = 0; i < ARITY(n->type); ++i) {
+        ret->parameters[i] = pack_node(n->parameters[i], cursor);
+    }
+    return ret;
+}
+
+
+static te_expr *pack(te_expr *n) {
+    const size_t size = packed_size(n);
+    char *cursor = malloc(size);
+    te_expr *ret = 0;
+    if (cursor) {
+        ret = pack_node(n, &cursor);
+        COUNT(M_NODES_ALLOCATED, count_nodes(ret));
+        COUNT(M_BYTES_ALLOCATED, size);
+    }
+    free_tree(n);
+    return ret;
+}
+
+
+void te_free(te_expr *n) {
+#ifdef TE_METRICS
+    if (n) {
+        COUNT(M_NODES_FREED, count_nodes(n));
+        COUNT(M_BYTES_FREED, packed_size(n));
+    }
+#endif
     free(n);
 }
 
 
+size_t te_memory_usage(const te_expr *n) {
+    return n ? packed_size(n) : 0;
+}
+
+
 static double pi(void) {return 3.14159265358979323846;}
 static double e(void) {return 2.71828182845904523536;}
-static double fac(double a) {/* simplest version of fac */
-    if (a < 0.0)
+#define TE_MAX_FACTORIAL 170
+
+/* n! for every n whose factorial is finite in a double, correctly rounded. */
+static const double factorials[TE_MAX_FACTORIAL + 1] = {
+    1, 1, 2, 6, 24,
+    120, 720, 5040, 40320, 362880,
+    3628800, 39916800, 479001600, 6227020800, 87178291200,
+    1307674368000, 20922789888000, 355687428096000, 6402373705728000, 1.21645100408832e+17,
+    2.43290200817664e+18, 5.109094217170944e+19, 1.1240007277776077e+21, 2.585201673888498e+22, 6.204484017332394e+23,
+    1.5511210043330986e+25, 4.0329146112660565e+26, 1.0888869450418352e+28, 3.0488834461171387e+29, 8.841761993739702e+30,
+    2.6525285981219107e+32, 8.222838654177922e+33, 2.631308369336935e+35, 8.683317618811886e+36, 2.9523279903960416e+38,
+    1.0333147966386145e+40, 3.7199332678990125e+41, 1.3763753091226346e+43, 5.230226174666011e+44, 2.0397882081197444e+46,
+    8.159152832478977e+47, 3.345252661316381e+49, 1.40500611775288e+51, 6.041526306337383e+52, 2.658271574788449e+54,
+    1.1962222086548019e+56, 5.502622159812089e+57, 2.5862324151116818e+59, 1.2413915592536073e+61, 6.082818640342675e+62,
+    3.0414093201713376e+64, 1.5511187532873822e+66, 8.065817517094388e+67, 4.2748832840600255e+69, 2.308436973392414e+71,
+    1.2696403353658276e+73, 7.109985878048635e+74, 4.0526919504877214e+76, 2.3505613312828785e+78, 1.3868311854568984e+80,
+    8.32098711274139e+81, 5.075802138772248e+83, 3.146997326038794e+85, 1.98260831540444e+87, 1.2688693218588417e+89,
+    8.247650592082472e+90, 5.443449390774431e+92, 3.647111091818868e+94, 2.4800355424368305e+96, 1.711224524281413e+98,
+    1.1978571669969892e+100, 8.504785885678623e+101, 6.1234458376886085e+103, 4.4701154615126844e+105, 3.307885441519386e+107,
+    2.48091408113954e+109, 1.8854947016660504e+111, 1.4518309202828587e+113, 1.1324281178206297e+115, 8.946182130782976e+116,
+    7.156945704626381e+118, 5.797126020747368e+120, 4.753643337012842e+122, 3.945523969720659e+124, 3.314240134565353e+126,
+    2.81710411438055e+128, 2.4227095383672734e+130, 2.107757298379528e+132, 1.8548264225739844e+134, 1.650795516090846e+136,
+    1.4857159644817615e+138, 1.352001527678403e+140, 1.2438414054641308e+142, 1.1567725070816416e+144, 1.087366156656743e+146,
+    1.032997848823906e+148, 9.916779348709496e+149, 9.619275968248212e+151, 9.426890448883248e+153, 9.332621544394415e+155,
+    9.332621544394415e+157, 9.42594775983836e+159, 9.614466715035127e+161, 9.90290071648618e+163, 1.0299016745145628e+166,
+    1.081396758240291e+168, 1.1462805637347084e+170, 1.226520203196138e+172, 1.324641819451829e+174, 1.4438595832024937e+176,
+    1.588245541522743e+178, 1.7629525510902446e+180, 1.974506857221074e+182, 2.2311927486598138e+184, 2.5435597334721877e+186,
+    2.925093693493016e+188, 3.393108684451898e+190, 3.969937160808721e+192, 4.684525849754291e+194, 5.574585761207606e+196,
+    6.689502913449127e+198, 8.094298525273444e+200, 9.875044200833601e+202, 1.214630436702533e+205, 1.506141741511141e+207,
+    1.882677176888926e+209, 2.372173242880047e+211, 3.0126600184576594e+213, 3.856204823625804e+215, 4.974504222477287e+217,
+    6.466855489220474e+219, 8.47158069087882e+221, 1.1182486511960043e+224, 1.4872707060906857e+226, 1.9929427461615188e+228,
+    2.6904727073180504e+230, 3.659042881952549e+232, 5.012888748274992e+234, 6.917786472619489e+236, 9.615723196941089e+238,
+    1.3462012475717526e+241, 1.898143759076171e+243, 2.695364137888163e+245, 3.854370717180073e+247, 5.5502938327393044e+249,
+    8.047926057471992e+251, 1.1749972043909107e+254, 1.727245890454639e+256, 2.5563239178728654e+258, 3.80892263763057e+260,
+    5.713383956445855e+262, 8.62720977423324e+264, 1.3113358856834524e+267, 2.0063439050956823e+269, 3.0897696138473508e+271,
+    4.789142901463394e+273, 7.471062926282894e+275, 1.1729568794264145e+278, 1.853271869493735e+280, 2.9467022724950384e+282,
+    4.7147236359920616e+284, 7.590705053947219e+286, 1.2296942187394494e+289, 2.0044015765453026e+291, 3.287218585534296e+293,
+    5.423910666131589e+295, 9.003691705778438e+297, 1.503616514864999e+300, 2.5260757449731984e+302, 4.269068009004705e+304,
+    7.257415615307999e+306,
+};
+
+static double fac(double a) {
+    if (!(a >= 0.0))
         return NAN;
-    if (a > UINT_MAX)
+    /* Fractions are truncated, so fac(170.5) is still 170!. */
+    if (a >= TE_MAX_FACTORIAL + 1)
         return INFINITY;
-    unsigned int ua = (unsigned int)(a);
-    unsigned long int result = 1, i;
-    for (i = 1; i <= ua; i++) {
-        if (i > ULONG_MAX / result)
-            return INFINITY;
-        result *= i;
-    }
-    return (double)result;
+    return factorials[(int)a];
 }
+
+/* Up to this many factors, ncr multiplies them out. Integer steps are exact
+ * while each product fits in 64 bits. Once one does not, the result is at
+ * least 2^64/64 and the rest is done in doubles, so results below 2^53 are
+ * exact. Beyond 64 factors the result is too large to be exact anyway. */
+#define TE_NCR_PRODUCT 64
+
 static double ncr(double n, double r) {
-    if (n < 0.0 || r < 0.0 || n < r) return NAN;
-    if (n > UINT_MAX || r > UINT_MAX) return INFINITY;
-    unsigned long int un = (unsigned int)(n), ur = (unsigned int)(r), i;
-    unsigned long int result = 1;
-    if (ur > un / 2) ur = un - ur;
-    for (i = 1; i <= ur; i++) {
-        if (result > ULONG_MAX / (un - ur + i))
-            return INFINITY;
-        result *= un - ur + i;
-        result /= i;
-    }
-    return result;
+    if (!(r >= 0.0 && n >= r)) return NAN;
+    if (isinf(n)) return INFINITY;
+    n = floor(n);
+    r = floor(r);
+    if (r > n / 2) r = n - r;
+
+    if (r <= TE_NCR_PRODUCT) {
+        unsigned long long exact = 1;
+        double result;
+        int i = 1;
+        if (n < 9e18) {
+            const unsigned long long un = (unsigned long long)n, ur = (unsigned long long)r;
+            for (; i <= r && exact <= (unsigned long long)-1 / (un - ur + i); i++) {
+                exact = exact * (un - ur + i) / i;
+            }
+        }
+        result = (double)exact;
+        for (; i <= r; i++) {
+            result = result * (n - r + i) / i;
+        }
+        return result;
+    }
+    if (n <= TE_MAX_FACTORIAL) {
+        return factorials[(int)n] / factorials[(int)r] / factorials[(int)(n - r)];
+    }
+    /* Past this, more than 64 factors always overflow, and the lgamma
+     * differences below would cancel to nothing. */
+    if (n > 1e7) return INFINITY;
+    return exp(lgamma(n + 1) - lgamma(r + 1) - lgamma(n - r + 1));
 }
 static double npr(double n, double r) {return ncr(n, r) * fac(r);}
+static double normcdf(double x) {return 0.5 * erfc(-x * 0.70710678118654752440);}
+
+
+/* Stateful builtins. Each call node keeps a window in a te_state, so one
+ * compiled expression can follow any number of streams. The window sizes
+ * are taken when the state is created. Without a state they return NaN. */
+
+#define TE_MAX_WINDOW (1 << 24)
+
+typedef struct window {
+    long long seen, last_bad;
+    int size, head, count, bad, good, front;
+    double sum, comp, mean, m2;
+    double values[1];
+} window;
+
+struct te_state {
+    int count;
+    size_t size;
+    size_t offsets[1];
+};
+
+static void add_sum(window *w, double x) {
+    /* Neumaier's compensated sum, so long streams do not drift. */
+    const double t = w->sum + x;
+    if (fabs(w->sum) >= fabs(x)) w->comp += (w->sum - t) + x;
+    else w->comp += (x - t) + w->sum;
+    w->sum = t;
+}
+
+static void add_moment(window *w, double x, int sign) {
+    /* Adds or removes x in the running mean and sum of squared deviations. */
+    const double d = x - w->mean;
+    w->good += sign;
+    if (w->good == 0) {
+        w->mean = w->m2 = 0;
+        return;
+    }
+    w->mean += sign * d / w->good;
+    w->m2 += sign * d * (x - w->mean);
+}
+
+static void resync(window *w, int moments) {
+    /* Recomputes the running values from the window, once per lap. */
+    int i, good = 0;
+    w->sum = w->comp = w->mean = w->m2 = 0;
+    for (i = 0; i < w->count; ++i) {
+        if (isfinite(w->values[i])) {
+            add_sum(w, w->values[i]);
+            ++good;
+        }
+    }
+    w->good = good;
+    if (moments && good) {
+        w->mean = (w->sum + w->comp) / good;
+        for (i = 0; i < w->count; ++i) {
+            if (isfinite(w->values[i])) w->m2 += (w->values[i] - w->mean) * (w->values[i] - w->mean);
+        }
+    }
+}
+
+static int push(window *w, double x, double *old) {
+    /* Stores x in the ring, returning 1 with *old set if it replaced a value. */
+    const int full = w->count == w->size;
+    *old = w->values[w->head];
+    w->values[w->head] = x;
+    if (++w->head == w->size) w->head = 0;
+    if (!full) ++w->count;
+    return full;
+}
+
+static double ema_step(void *slot, double x, double alpha) {
+    window *w = slot;
+    if (!w || x != x) return NAN;
+    if (w->seen++) w->mean += alpha * (x - w->mean);
+    else w->mean = x;
+    return w->mean;
+}
+
+static double delay_step(void *slot, double x, double k) {
+    window *w = slot;
+    double old;
+    (void)k;
+    if (!w) return NAN;
+    if (w->size == 0) return x;
+    return push(w, x, &old) ? old : NAN;
+}
+
+static double rsum_step(void *slot, double x, double n) {
+    window *w = slot;
+    double old, r;
+    int i;
+    (void)n;
+    if (!w) return NAN;
+
+    if (isfinite(x)) add_sum(w, x);
+    else ++w->bad;
+    if (push(w, x, &old)) {
+        if (isfinite(old)) add_sum(w, -old);
+        else --w->bad;
+    }
+    if (w->head == 0) resync(w, 0);
+
+    if (!w->bad) return w->sum + w->comp;
+    for (r = 0, i = 0; i < w->count; ++i) r += w->values[i];
+    return r;
+}
+
+static double rstd_step(void *slot, double x, double n) {
+    window *w = slot;
+    double old;
+    (void)n;
+    if (!w) return NAN;
+
+    if (push(w, x, &old)) {
+        if (isfinite(old)) add_moment(w, old, -1);
+        else --w->bad;
+    }
+    if (isfinite(x)) add_moment(w, x, 1);
+    else ++w->bad;
+    if (w->head == 0) resync(w, 1);
+
+    if (w->bad || w->good < 2) return NAN;
+    return sqrt(fmax(w->m2, 0) / (w->good - 1));
+}
+
+static double rmax_step(void *slot, double x, double n) {
+    /* A deque of the values that can still become the maximum, decreasing
+     * from the front, with the event each arrived at in values[size + i]. */
+    window *w = slot;
+    const long long now = w ? w->seen++ : 0;
+    double *at;
+    (void)n;
+    if (!w) return NAN;
+
+    at = w->values + w->size;
+    if (w->count && at[w->front] <= now - w->size) {
+        if (++w->front == w->size) w->front = 0;
+        --w->count;
+    }
+    if (x != x) {
+        w->last_bad = now + 1;
+    } else {
+        int back = (w->front + w->count) % w->size;
+        while (w->count) {
+            const int last = back ? back - 1 : w->size - 1;
+            if (w->values[last] > x) break;
+            back = last;
+            --w->count;
+        }
+        w->values[back] = x;
+        at[back] = (double)now;
+        ++w->count;
+    }
+
+    if (w->last_bad && now - w->last_bad + 1 < w->size) return NAN;
+    return w->count ? w->values[w->front] : NAN;
+}
+
+static double rmin_step(void *slot, double x, double n) {
+    return -rmax_step(slot, -x, n);
+}
+
+static int stateful(const void *f) {
+    return f == ema_step || f == delay_step || f == rsum_step || f == rstd_step || f == rmax_step || f == rmin_step;
+}
 
 static const te_variable functions[] = {
     /* must be in alphabetical order */
@@ -159,10 +643,16 @@ static const te_variable functions[] = {
     {"ceil", ceil,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"cos", cos,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"cosh", cosh,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"delay", delay_step, TE_CLOSURE2, 0},
     {"e", e,          TE_FUNCTION0 | TE_FLAG_PURE, 0},
+    {"ema", ema_step, TE_CLOSURE2, 0},
+    {"erf", erf,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"erfc", erfc,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"exp", exp,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"fac", fac,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"floor", floor,  TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"gamma", tgamma, TE_FUNCTION1 | TE_FLAG_PURE, 0},
+    {"lgamma", lgamma, TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"ln", log,       TE_FUNCTION1 | TE_FLAG_PURE, 0},
 #ifdef TE_NAT_LOG
     {"log", log,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
@@ -171,9 +661,14 @@ static const te_variable functions[] = {
 #endif
     {"log10", log10,  TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"ncr", ncr,      TE_FUNCTION2 | TE_FLAG_PURE, 0},
+    {"normcdf", normcdf, TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"npr", npr,      TE_FUNCTION2 | TE_FLAG_PURE, 0},
     {"pi", pi,        TE_FUNCTION0 | TE_FLAG_PURE, 0},
     {"pow", pow,      TE_FUNCTION2 | TE_FLAG_PURE, 0},
+    {"rmax", rmax_step, TE_CLOSURE2, 0},
+    {"rmin", rmin_step, TE_CLOSURE2, 0},
+    {"rstd", rstd_step, TE_CLOSURE2, 0},
+    {"rsum", rsum_step, TE_CLOSURE2, 0},
     {"sin", sin,      TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"sinh", sinh,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"sqrt", sqrt,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
@@ -203,11 +698,28 @@ static const te_variable *find_builtin(const char *name, int len) {
     return 0;
 }
 
+static int compare_name(const char *name, int len, const te_variable *var) {
+    const int c = strncmp(name, var->name, len);
+    return c ? c : '\0' - var->name[len];
+}
+
 static const te_variable *find_lookup(const state *s, const char *name, int len) {
     int iters;
     const te_variable *var;
     if (!s->lookup) return 0;
 
+    if (s->index) {
+        /* Leftmost match, which is the first one in lookup. */
+        int imin = 0, imax = s->lookup_len;
+        while (imin < imax) {
+            const int i = imin + (imax - imin) / 2;
+            if (compare_name(name, len, s->index[i]) > 0) imin = i + 1;
+            else imax = i;
+        }
+        if (imin < s->lookup_len && compare_name(name, len, s->index[imin]) == 0) return s->index[imin];
+        return 0;
+    }
+
     for (var = s->lookup, iters = s->lookup_len; iters; ++var, --iters) {
         if (strncmp(name, var->name, len) == 0 && var->name[len] == '\0') {
             return var;
@@ -224,22 +736,260 @@ static double mul(double a, double b) {return a * b;}
 static double divide(double a, double b) {return a / b;}
 static double negate(double a) {return -a;}
 static double comma(double a, double b) {(void)a; return b;}
+static double fms(double a, double b, double c) {return fma(a, b, -c);}
+static double fnma(double a, double b, double c) {return fma(-a, b, c);}
+
+
+/* Tabulated functions. A TE_TABLE binding compiles to a pure one-argument
+ * closure around table_lookup whose context is the te_table, so folding,
+ * hoisting and batching treat it like any other pure function. */
+
+static double table_x(const te_table *t, int i) {
+    return t->x ? t->x[i] : t->start + i * t->step;
+}
+
+static int table_cell(const te_table *t, double v) {
+    /* Returns i with x[i] <= v < x[i+1], for x[0] < v < x[count-1]. */
+    if (!t->x) {
+        const int i = (int)((v - t->start) / t->step);
+        return i > t->count - 2 ? t->count - 2 : i;
+    } else {
+        /* Binary search whose only branch is the loop, the comparison
+         * compiles to a conditional move. */
+        const double *base = t->x;
+        int n = t->count - 1;
+        while (n > 1) {
+            const int half = n / 2;
+            base = base[half] <= v ? base + half : base;
+            n -= half;
+        }
+        return (int)(base - t->x);
+    }
+}
+
+static double table_slope(const te_table *t, int i) {
+    /* Derivative at grid point i as in PCHIP: the weighted harmonic mean of
+     * the neighbouring secants, or zero where they change sign. This keeps
+     * every cell between the values at its ends. */
+    const int last = t->count - 1;
+    double h0, h1, d0, d1;
+    if (i == 0 || i == last) {
+        /* The end points take the slope of their cell. */
+        const int k = i ? last - 1 : 0;
+        return (t->y[k+1] - t->y[k]) / (table_x(t, k+1) - table_x(t, k));
+    }
+    h0 = table_x(t, i) - table_x(t, i-1);
+    h1 = table_x(t, i+1) - table_x(t, i);
+    d0 = (t->y[i] - t->y[i-1]) / h0;
+    d1 = (t->y[i+1] - t->y[i]) / h1;
+    if (d0 * d1 <= 0) return 0;
+    return 3 * (h0 + h1) / ((2*h1 + h0) / d0 + (h1 + 2*h0) / d1);
+}
+
+static double table_lookup(void *context, double v) {
+    const te_table *t = context;
+    const int last = t->count - 1;
+    int i;
+    double x0, h, s, y0, y1;
+
+    if (last < 1) return last == 0 ? t->y[0] : NAN;
+    if (v != v) return NAN;
+    if (v <= table_x(t, 0)) return t->y[0];
+    if (v >= table_x(t, last)) return t->y[last];
+
+    i = table_cell(t, v);
+    x0 = table_x(t, i);
+    h = table_x(t, i+1) - x0;
+    s = fmin(fmax((v - x0) / h, 0), 1);
+    y0 = t->y[i];
+    y1 = t->y[i+1];
+
+    if (t->interpolation != TE_TABLE_CUBIC) return y0 + s * (y1 - y0);
+
+    /* Cubic Hermite on the cell. */
+    {
+        const double m0 = table_slope(t, i) * h, m1 = table_slope(t, i+1) * h;
+        const double r = 1 - s;
+        return r*r*((1 + 2*s)*y0 + s*m0) + s*s*((3 - 2*s)*y1 - r*m1);
+    }
+}
+
+
+static void init_state(state *s, const char *expression, const te_variable *variables, int var_count) {
+    s->start = s->next = expression;
+    s->lookup = variables;
+    s->lookup_len = var_count;
+    s->index = 0;
+    s->source = 0;
+    s->source_context = 0;
+    s->buffer = 0;
+    s->end = 0;
+    s->offset = 0;
+    s->failed = 0;
+    s->building = 0;
+    s->tokens = 0;
+    s->resolved = 0;
+    s->name = 0;
+    s->evaluate = 0;
+}
+
+
+/* A streaming parse keeps at least TE_STREAM_TOKEN bytes ahead of the next
+ * token in a buffer of TE_STREAM_BUFFER, so no token may be longer. Refills
+ * only move what is left of the previous window, keeping parsing linear. */
+#define TE_STREAM_TOKEN 1024
+#define TE_STREAM_BUFFER 65536
+
+static void refill(state *s) {
+    size_t kept = s->end - s->next;
+    if (kept >= TE_STREAM_TOKEN) return;
+    memmove(s->buffer, s->next, kept);
+    s->offset += s->next - s->start;
+    while (s->source && kept < TE_STREAM_BUFFER) {
+        const size_t n = s->source(s->source_context, s->buffer + kept, TE_STREAM_BUFFER - kept);
+        if (n == 0 || n > TE_STREAM_BUFFER - kept) {
+            s->failed = n != 0;
+            s->source = 0;
+        } else {
+            kept += n;
+        }
+    }
+    s->buffer[kept] = '\0';
+    s->start = s->next = s->buffer;
+    s->end = s->buffer + kept;
+}
+
+
+static void take(state *s, const te_variable *var) {
+    /* Makes the current token the variable or function var, if any. */
+    if (!var) {
+        s->type = TOK_ERROR;
+        return;
+    }
+    switch(TYPE_MASK(var->type))
+    {
+        case TE_VARIABLE:
+            s->type = TOK_VARIABLE;
+            s->bound = var->address;
+            break;
+
+        case TE_TABLE:
+            s->type = TE_CLOSURE1 | TE_FLAG_PURE;
+            s->function = table_lookup;
+            s->context = (void*)var->address;
+            break;
+
+        case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:         /* Falls through. */
+        case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:         /* Falls through. */
+            s->context = var->context;                                                  /* Falls through. */
+
+        case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:     /* Falls through. */
+        case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:     /* Falls through. */
+            s->type = var->type;
+            s->function = var->address;
+            break;
+    }
+}
+
+
+static unsigned hash_name(const char *name, int len) {
+    unsigned h = 2166136261u;
+    while (len-- > 0) h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
+
+
+static int grow_slots(te_template *t) {
+    /* Doubles the hash table of names, keeping it at most half full. */
+    const int mask = t->slots ? 2 * t->slot_mask + 1 : 15;
+    int *slots = malloc(sizeof(int) * (mask + 1));
+    int i;
+    if (!slots) return 0;
+    for (i = 0; i <= mask; ++i) slots[i] = -1;
+    for (i = 0; i < t->name_count; ++i) {
+        unsigned slot = hash_name(t->names[i], (int)strlen(t->names[i])) & mask;
+        while (slots[slot] >= 0) slot = (slot + 1) & mask;
+        slots[slot] = i;
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->slot_mask = mask;
+    return 1;
+}
+
+
+static int intern(te_template *t, const char *name, int len) {
+    /* Returns the index of name in t->names, adding it if new, or -1 if out of memory. */
+    unsigned slot;
+    char *copy;
+    if (2 * (t->name_count + 1) > t->slot_mask + 1 && !grow_slots(t)) return -1;
+    slot = hash_name(name, len) & t->slot_mask;
+    while (t->slots[slot] >= 0) {
+        const int k = t->slots[slot];
+        if (strncmp(t->names[k], name, len) == 0 && t->names[k][len] == '\0') return k;
+        slot = (slot + 1) & t->slot_mask;
+    }
+    if ((t->name_count & (t->name_count - 1)) == 0) {
+        char **names = realloc(t->names, sizeof(char*) * (t->name_count ? 2 * t->name_count : 1));
+        if (!names) return -1;
+        t->names = names;
+    }
+    copy = malloc(len + 1);
+    if (!copy) return -1;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    t->names[t->name_count] = copy;
+    t->slots[slot] = t->name_count;
+    return t->name_count++;
+}
 
 
 void next_token(state *s) {
     s->type = TOK_NULL;
 
+    if (s->tokens) {
+        /* Replays a template, staying on its last token. */
+        const token *t = s->tokens;
+        s->offset = t->end;
+        if (t->type != TOK_END && t->type != TOK_ERROR) ++s->tokens;
+        if (t->type == TOK_NAME) {
+            take(s, s->resolved[t->name]);
+        } else {
+            s->type = t->type;
+            if (t->type == TOK_NUMBER) s->value = t->value;
+            else s->function = t->function;
+        }
+        return;
+    }
+
     do {
 
+        if (s->source) refill(s);
+
         if (!*s->next){
-            s->type = TOK_END;
+            /* A NUL inside a stream, or a failed read, is an error. */
+            if (s->end && s->next != s->end) {
+                s->type = TOK_ERROR;
+                s->next++;
+            } else {
+                s->type = s->failed ? TOK_ERROR : TOK_END;
+            }
             return;
         }
 
         /* Try reading a number. */
         if ((s->next[0] >= '0' && s->next[0] <= '9') || s->next[0] == '.') {
-            s->value = strtod(s->next, (char**)&s->next);
-            s->type = TOK_NUMBER;
+            /* Short integers are exact in a double, so they skip strtod. */
+            const char *end = s->next;
+            double value = 0;
+            while (*end >= '0' && *end <= '9' && end - s->next < 15) value = value * 10 + (*end++ - '0');
+            if (end > s->next && (!*end || !strchr(".eExX0123456789", *end))) {
+                s->value = value;
+                s->next = end;
+            } else {
+                s->value = strtod(s->next, (char**)&s->next);
+            }
+            s->type = s->source && s->next == s->end ? TOK_ERROR : TOK_NUMBER;
         } else {
             /* Look for a variable or builtin function call. */
             if (s->next[0] >= 'a' && s->next[0] <= 'z') {
@@ -247,29 +997,16 @@ void next_token(state *s) {
                 start = s->next;
                 while ((s->next[0] >= 'a' && s->next[0] <= 'z') || (s->next[0] >= '0' && s->next[0] <= '9') || (s->next[0] == '_')) s->next++;
 
-                const te_variable *var = find_lookup(s, start, s->next - start);
-                if (!var) var = find_builtin(start, s->next - start);
-
-                if (!var) {
+                if (s->source && s->next == s->end) {
                     s->type = TOK_ERROR;
+                } else if (s->building) {
+                    s->name = intern(s->building, start, s->next - start);
+                    s->type = TOK_NAME;
+                    if (s->name < 0) s->failed = 1;
                 } else {
-                    switch(TYPE_MASK(var->type))
-                    {
-                        case TE_VARIABLE:
-                            s->type = TOK_VARIABLE;
-                            s->bound = var->address;
-                            break;
-
-                        case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:         /* Falls through. */
-                        case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:         /* Falls through. */
-                            s->context = var->context;                                                  /* Falls through. */
-
-                        case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:     /* Falls through. */
-                        case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:     /* Falls through. */
-                            s->type = var->type;
-                            s->function = var->address;
-                            break;
-                    }
+                    const te_variable *var = find_lookup(s, start, s->next - start);
+                    if (!var) var = find_builtin(start, s->next - start);
+                    take(s, var);
                 }
 
             } else {
@@ -421,7 +1158,7 @@ static te_expr *factor(state *s) {
 
     if (ret->type == (TE_FUNCTION1 | TE_FLAG_PURE) && ret->function == negate) {
         te_expr *se = ret->parameters[0];
-        free(ret);
+        free_node(ret);
         ret = se;
         neg = 1;
     }
@@ -514,72 +1251,671 @@ static te_expr *list(state *s) {
 }
 
 
-#define TE_FUN(...) ((double(*)(__VA_ARGS__))n->function)
-#define M(e) te_eval(n->parameters[e])
-
-
-double te_eval(const te_expr *n) {
-    if (!n) return NAN;
+static double horner(const te_poly *p, double x) {
+    double r = p->coefficients[p->degree];
+    int k;
+    for (k = p->degree - 1; k >= 0; --k) {
+        r = r * x + p->coefficients[k];
+    }
+    return r;
+}
 
-    switch(TYPE_MASK(n->type)) {
-        case TE_CONSTANT: return n->value;
-        case TE_VARIABLE: return *n->bound;
 
-        case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:
-        case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
-            switch(ARITY(n->type)) {
-                case 0: return TE_FUN(void)();
-                case 1: return TE_FUN(double)(M(0));
-                case 2: return TE_FUN(double, double)(M(0), M(1));
-                case 3: return TE_FUN(double, double, double)(M(0), M(1), M(2));
-                case 4: return TE_FUN(double, double, double, double)(M(0), M(1), M(2), M(3));
-                case 5: return TE_FUN(double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4));
-                case 6: return TE_FUN(double, double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4), M(5));
-                case 7: return TE_FUN(double, double, double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4), M(5), M(6));
-                default: return NAN;
-            }
+static double clenshaw(const te_cheb *p, double x) {
+    const double t = (x - p->center) * p->scale;
+    double b1 = 0, b2 = 0;
+    int k;
+    for (k = p->degree; k >= 1; --k) {
+        const double b0 = 2 * t * b1 - b2 + p->coefficients[k];
+        b2 = b1;
+        b1 = b0;
+    }
+    return t * b1 - b2 + p->coefficients[0];
+}
 
-        case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:
-        case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
-            switch(ARITY(n->type)) {
-                case 0: return TE_FUN(void*)(n->parameters[0]);
-                case 1: return TE_FUN(void*, double)(n->parameters[1], M(0));
-                case 2: return TE_FUN(void*, double, double)(n->parameters[2], M(0), M(1));
-                case 3: return TE_FUN(void*, double, double, double)(n->parameters[3], M(0), M(1), M(2));
-                case 4: return TE_FUN(void*, double, double, double, double)(n->parameters[4], M(0), M(1), M(2), M(3));
-                case 5: return TE_FUN(void*, double, double, double, double, double)(n->parameters[5], M(0), M(1), M(2), M(3), M(4));
-                case 6: return TE_FUN(void*, double, double, double, double, double, double)(n->parameters[6], M(0), M(1), M(2), M(3), M(4), M(5));
-                case 7: return TE_FUN(void*, double, double, double, double, double, double, double)(n->parameters[7], M(0), M(1), M(2), M(3), M(4), M(5), M(6));
-                default: return NAN;
-            }
 
-        default: return NAN;
+/* The same grammar again, computing values directly instead of building a
+ * tree. te_interp() and te_validate() use it so they never allocate.
+ * s->negated tracks whether the tree parser would have returned a negation
+ * node, which factor() looks at when TE_POW_FROM_RIGHT is defined. */
+
+#define TE_FUN(...) ((double(*)(__VA_ARGS__))function)
+
+static double call(int type, const void *function, void *context, const double *a) {
+    if (IS_CLOSURE(type)) {
+        switch (ARITY(type)) {
+            case 0: return TE_FUN(void*)(context);
+            case 1: return TE_FUN(void*, double)(context, a[0]);
+            case 2: return TE_FUN(void*, double, double)(context, a[0], a[1]);
+            case 3: return TE_FUN(void*, double, double, double)(context, a[0], a[1], a[2]);
+            case 4: return TE_FUN(void*, double, double, double, double)(context, a[0], a[1], a[2], a[3]);
+            case 5: return TE_FUN(void*, double, double, double, double, double)(context, a[0], a[1], a[2], a[3], a[4]);
+            case 6: return TE_FUN(void*, double, double, double, double, double, double)(context, a[0], a[1], a[2], a[3], a[4], a[5]);
+            case 7: return TE_FUN(void*, double, double, double, double, double, double, double)(context, a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+        }
+    } else {
+        switch (ARITY(type)) {
+            case 0: return TE_FUN(void)();
+            case 1: return TE_FUN(double)(a[0]);
+            case 2: return TE_FUN(double, double)(a[0], a[1]);
+            case 3: return TE_FUN(double, double, double)(a[0], a[1], a[2]);
+            case 4: return TE_FUN(double, double, double, double)(a[0], a[1], a[2], a[3]);
+            case 5: return TE_FUN(double, double, double, double, double)(a[0], a[1], a[2], a[3], a[4]);
+            case 6: return TE_FUN(double, double, double, double, double, double)(a[0], a[1], a[2], a[3], a[4], a[5]);
+            case 7: return TE_FUN(double, double, double, double, double, double, double)(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+        }
     }
-
+    return NAN;
 }
 
 #undef TE_FUN
-#undef M
 
-static void optimize(te_expr *n) {
-    /* Evaluates as much as possible. */
-    if (n->type == TE_CONSTANT) return;
-    if (n->type == TE_VARIABLE) return;
 
-    /* Only optimize out functions flagged as pure. */
-    if (IS_PURE(n->type)) {
-        const int arity = ARITY(n->type);
-        int known = 1;
-        int i;
-        for (i = 0; i < arity; ++i) {
-            optimize(n->parameters[i]);
-            if (((te_expr*)(n->parameters[i]))->type != TE_CONSTANT) {
-                known = 0;
-            }
-        }
-        if (known) {
-            const double value = te_eval(n);
-            te_free_parameters(n);
+static double vlist(state *s);
+static double vexpr(state *s);
+static double vpower(state *s);
+
+static double vbase(state *s) {
+    const int type = s->type;
+    const void *function = s->function;
+    void *context = s->context;
+    double ret = 0, a[7];
+    int arity, i;
+
+    s->negated = 0;
+
+    switch (TYPE_MASK(s->type)) {
+        case TOK_NUMBER:
+            ret = s->value;
+            next_token(s);
+            break;
+
+        case TOK_VARIABLE:
+            if (s->evaluate) ret = *s->bound;
+            next_token(s);
+            break;
+
+        case TE_FUNCTION0:
+        case TE_CLOSURE0:
+            next_token(s);
+            if (s->type == TOK_OPEN) {
+                next_token(s);
+                if (s->type != TOK_CLOSE) {
+                    s->type = TOK_ERROR;
+                } else {
+                    next_token(s);
+                }
+            }
+            if (s->evaluate && s->type != TOK_ERROR) ret = call(type, function, context, 0);
+            break;
+
+        case TE_FUNCTION1:
+        case TE_CLOSURE1:
+            next_token(s);
+            a[0] = vpower(s);
+            s->negated = 0;
+            if (s->evaluate && s->type != TOK_ERROR) ret = call(type, function, context, a);
+            break;
+
+        case TE_FUNCTION2: case TE_FUNCTION3: case TE_FUNCTION4:
+        case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
+        case TE_CLOSURE2: case TE_CLOSURE3: case TE_CLOSURE4:
+        case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
+            arity = ARITY(s->type);
+            next_token(s);
+
+            if (s->type != TOK_OPEN) {
+                s->type = TOK_ERROR;
+            } else {
+                for(i = 0; i < arity; i++) {
+                    next_token(s);
+                    a[i] = vexpr(s);
+                    if(s->type != TOK_SEP) {
+                        break;
+                    }
+                }
+                if(s->type != TOK_CLOSE || i != arity - 1) {
+                    s->type = TOK_ERROR;
+                } else {
+                    next_token(s);
+                }
+            }
+            s->negated = 0;
+            if (s->evaluate && s->type != TOK_ERROR) ret = call(type, function, context, a);
+            break;
+
+        case TOK_OPEN:
+            next_token(s);
+            ret = vlist(s);
+            if (s->type != TOK_CLOSE) {
+                s->type = TOK_ERROR;
+            } else {
+                next_token(s);
+            }
+            break;
+
+        default:
+            s->type = TOK_ERROR;
+            ret = NAN;
+            break;
+    }
+
+    return ret;
+}
+
+
+static double vpower(state *s) {
+    /* <power>     =    {("-" | "+")} <base> */
+    int sign = 1;
+    while (s->type == TOK_INFIX && (s->function == add || s->function == sub)) {
+        if (s->function == sub) sign = -sign;
+        next_token(s);
+    }
+
+    double ret = vbase(s);
+
+    if (sign == -1) {
+        ret = -ret;
+        s->negated = 1;
+    }
+
+    return ret;
+}
+
+#ifdef TE_POW_FROM_RIGHT
+static double vexponent(state *s) {
+    /* The operands after the first "^", grouped from the right. */
+    const double ret = vpower(s);
+    if (s->type == TOK_INFIX && s->function == pow) {
+        next_token(s);
+        return pow(ret, vexponent(s));
+    }
+    return ret;
+}
+
+static double vfactor(state *s) {
+    /* <factor>    =    <power> {"^" <power>} */
+    double ret = vpower(s);
+    const int neg = s->negated;
+
+    if (neg) ret = -ret;
+
+    if (s->type == TOK_INFIX && s->function == pow) {
+        next_token(s);
+        ret = pow(ret, vexponent(s));
+    }
+
+    if (neg) ret = -ret;
+    s->negated = neg;
+
+    return ret;
+}
+#else
+static double vfactor(state *s) {
+    /* <factor>    =    <power> {"^" <power>} */
+    double ret = vpower(s);
+
+    while (s->type == TOK_INFIX && (s->function == pow)) {
+        next_token(s);
+        ret = pow(ret, vpower(s));
+        s->negated = 0;
+    }
+
+    return ret;
+}
+#endif
+
+
+static double vterm(state *s) {
+    /* <term>      =    <factor> {("*" | "/" | "%") <factor>} */
+    double ret = vfactor(s);
+
+    while (s->type == TOK_INFIX && (s->function == mul || s->function == divide || s->function == fmod)) {
+        te_fun2 t = s->function;
+        next_token(s);
+        ret = t(ret, vfactor(s));
+        s->negated = 0;
+    }
+
+    return ret;
+}
+
+
+static double vexpr(state *s) {
+    /* <expr>      =    <term> {("+" | "-") <term>} */
+    double ret = vterm(s);
+
+    while (s->type == TOK_INFIX && (s->function == add || s->function == sub)) {
+        te_fun2 t = s->function;
+        next_token(s);
+        ret = t(ret, vterm(s));
+        s->negated = 0;
+    }
+
+    return ret;
+}
+
+
+static double vlist(state *s) {
+    /* <list>      =    <expr> {"," <expr>} */
+    double ret = vexpr(s);
+
+    while (s->type == TOK_SEP) {
+        next_token(s);
+        ret = vexpr(s);
+        s->negated = 0;
+    }
+
+    return ret;
+}
+
+
+#define TE_FUN(...) ((double(*)(__VA_ARGS__))n->function)
+#define M(e) eval(n->parameters[e], context, stream)
+#define C(e) (n->parameters[e] ? n->parameters[e] : context)
+
+
+static void *slot(te_state *stream, const te_expr *n) {
+    const size_t i = (size_t)n->parameters[2];
+    return stream && i < (size_t)stream->count ? (char*)stream + stream->offsets[i] : 0;
+}
+
+
+static double eval(const te_expr *n, void *context, te_state *stream) {
+    switch(TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return n->value;
+        case TE_VARIABLE: return *n->bound;
+        case TE_POLY: return horner((const te_poly*)n, *n->bound);
+        case TE_CHEB: return clenshaw((const te_cheb*)n, *n->bound);
+
+        case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:
+        case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
+            switch(ARITY(n->type)) {
+                case 0: return TE_FUN(void)();
+                case 1: return TE_FUN(double)(M(0));
+                case 2: return TE_FUN(double, double)(M(0), M(1));
+                case 3: return TE_FUN(double, double, double)(M(0), M(1), M(2));
+                case 4: return TE_FUN(double, double, double, double)(M(0), M(1), M(2), M(3));
+                case 5: return TE_FUN(double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4));
+                case 6: return TE_FUN(double, double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4), M(5));
+                case 7: return TE_FUN(double, double, double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4), M(5), M(6));
+                default: return NAN;
+            }
+
+        case TE_CLOSURE0: case TE_CLOSURE1: case TE_CLOSURE2: case TE_CLOSURE3:
+        case TE_CLOSURE4: case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
+            if (n->type & TE_FLAG_STATE) return TE_FUN(void*, double, double)(slot(stream, n), M(0), M(1));
+            switch(ARITY(n->type)) {
+                case 0: return TE_FUN(void*)(C(0));
+                case 1: return TE_FUN(void*, double)(C(1), M(0));
+                case 2: return TE_FUN(void*, double, double)(C(2), M(0), M(1));
+                case 3: return TE_FUN(void*, double, double, double)(C(3), M(0), M(1), M(2));
+                case 4: return TE_FUN(void*, double, double, double, double)(C(4), M(0), M(1), M(2), M(3));
+                case 5: return TE_FUN(void*, double, double, double, double, double)(C(5), M(0), M(1), M(2), M(3), M(4));
+                case 6: return TE_FUN(void*, double, double, double, double, double, double)(C(6), M(0), M(1), M(2), M(3), M(4), M(5));
+                case 7: return TE_FUN(void*, double, double, double, double, double, double, double)(C(7), M(0), M(1), M(2), M(3), M(4), M(5), M(6));
+                default: return NAN;
+            }
+
+        default: return NAN;
+    }
+
+}
+
+
+double te_eval(const te_expr *n) {
+    if (!n) return NAN;
+    COUNT(M_EVALUATIONS, 1);
+    return eval(n, 0, 0);
+}
+
+
+double te_eval_ctx(const te_expr *n, void *context) {
+    if (!n) return NAN;
+    COUNT(M_EVALUATIONS, 1);
+    return eval(n, context, 0);
+}
+
+
+static int count_state(const te_expr *n, const te_expr **calls) {
+    /* Returns one more than the highest state index in n, filling calls. */
+    int i, count = 0;
+    if (n->type & TE_FLAG_STATE) {
+        const int index = (int)(size_t)n->parameters[2];
+        if (calls) calls[index] = n;
+        count = index + 1;
+    }
+    for (i = 0; i < ARITY(n->type); ++i) {
+        const int c = count_state(n->parameters[i], calls);
+        if (c > count) count = c;
+    }
+    return count;
+}
+
+
+static size_t window_bytes(const te_expr *n, int *size) {
+    /* Sizes the window of a stateful call from its second argument. */
+    const double k = eval(n->parameters[1], 0, 0);
+    const int lowest = n->function == delay_step ? 0 : 1;
+    int doubles;
+    *size = !(k >= lowest) ? lowest : k > TE_MAX_WINDOW ? TE_MAX_WINDOW : (int)k;
+    if (n->function == ema_step) *size = 0;
+    doubles = n->function == rmax_step || n->function == rmin_step ? 2 * *size : *size;
+    return (offsetof(window, values) + sizeof(double) * (doubles ? doubles : 1) + 7) / 8 * 8;
+}
+
+
+te_state *te_state_new(const te_expr *n) {
+    const int count = n ? count_state(n, 0) : 0;
+    const te_expr **calls = malloc(sizeof(te_expr*) * (count ? count : 1));
+    size_t size = (offsetof(te_state, offsets) + sizeof(size_t) * (count ? count : 1) + 7) / 8 * 8;
+    te_state *stream;
+    int i, k;
+
+    if (!calls) return 0;
+    if (count) count_state(n, calls);
+    for (i = 0; i < count; ++i) size += window_bytes(calls[i], &k);
+
+    stream = calloc(1, size);
+    if (stream) {
+        stream->count = count;
+        stream->size = size;
+        size = (offsetof(te_state, offsets) + sizeof(size_t) * (count ? count : 1) + 7) / 8 * 8;
+        for (i = 0; i < count; ++i) {
+            stream->offsets[i] = size;
+            size += window_bytes(calls[i], &k);
+            ((window*)((char*)stream + stream->offsets[i]))->size = k;
+        }
+    }
+    free(calls);
+    return stream;
+}
+
+
+te_state *te_state_clone(const te_state *stream) {
+    te_state *copy;
+    if (!stream) return 0;
+    copy = malloc(stream->size);
+    if (copy) memcpy(copy, stream, stream->size);
+    return copy;
+}
+
+
+void te_state_reset(te_state *stream) {
+    int i;
+    if (!stream) return;
+    for (i = 0; i < stream->count; ++i) {
+        window *w = (window*)((char*)stream + stream->offsets[i]);
+        const size_t end = i + 1 < stream->count ? stream->offsets[i + 1] : stream->size;
+        const int size = w->size;
+        memset(w, 0, end - stream->offsets[i]);
+        w->size = size;
+    }
+}
+
+
+void te_state_free(te_state *stream) {
+    free(stream);
+}
+
+
+double te_eval_state(const te_expr *n, te_state *stream) {
+    if (!n) return NAN;
+    COUNT(M_EVALUATIONS, 1);
+    return eval(n, 0, stream);
+}
+
+
+#ifdef TE_HANDLES
+/* Epoch-based reclamation. A reader announces the global epoch before it
+ * loads the current tree and withdraws once done, a store each, so reads
+ * never wait. The epoch only moves on once every active reader has announced
+ * it, hence no reader can still hold a tree retired in epoch e once the epoch
+ * reaches e + 2. Writers serialize on a spin lock. */
+struct te_reader {
+    atomic_ullong announced; /* 2*epoch+1 while reading, 0 otherwise. */
+    atomic_int used;
+    te_handle *handle;
+    struct te_reader *next;
+};
+
+typedef struct retired {
+    te_expr *tree;
+    unsigned long long epoch;
+    struct retired *next;
+} retired;
+
+struct te_handle {
+    _Atomic(te_expr*) current;
+    atomic_ullong epoch;
+    _Atomic(te_reader*) readers;
+    atomic_flag writing;
+    retired *limbo;
+    int pending;
+};
+
+
+te_handle *te_handle_new(te_expr *n) {
+    te_handle *h = malloc(sizeof(te_handle));
+    if (!h) return 0;
+    atomic_init(&h->current, n);
+    atomic_init(&h->epoch, 1);
+    atomic_init(&h->readers, 0);
+    atomic_flag_clear(&h->writing);
+    h->limbo = 0;
+    h->pending = 0;
+    return h;
+}
+
+
+static int advance(te_handle *h) {
+    /* Moves to the next epoch unless a reader is still in an earlier one. */
+    const unsigned long long e = atomic_load(&h->epoch);
+    const te_reader *r;
+    for (r = atomic_load(&h->readers); r; r = r->next) {
+        const unsigned long long a = atomic_load(&r->announced);
+        if (a && a != 2 * e + 1) return 0;
+    }
+    atomic_store(&h->epoch, e + 1);
+    return 1;
+}
+
+
+static int collect(te_handle *h) {
+    retired **p = &h->limbo;
+    unsigned long long e;
+    if (advance(h)) advance(h);
+    e = atomic_load(&h->epoch);
+    while (*p) {
+        retired *old = *p;
+        if (old->epoch + 2 <= e) {
+            *p = old->next;
+            te_free(old->tree);
+            free(old);
+            --h->pending;
+        } else {
+            p = &old->next;
+        }
+    }
+    return h->pending;
+}
+
+
+static void lock(te_handle *h) {
+    while (atomic_flag_test_and_set_explicit(&h->writing, memory_order_acquire));
+}
+
+
+static void unlock(te_handle *h) {
+    atomic_flag_clear_explicit(&h->writing, memory_order_release);
+}
+
+
+int te_handle_swap(te_handle *h, te_expr *replacement) {
+    retired *old = malloc(sizeof(retired));
+    te_expr *tree;
+    int pending;
+    lock(h);
+    tree = atomic_exchange(&h->current, replacement);
+    if (tree && old) {
+        old->tree = tree;
+        old->epoch = atomic_load(&h->epoch);
+        old->next = h->limbo;
+        h->limbo = old;
+        ++h->pending;
+    } else if (tree) {
+        /* Out of memory: wait for the readers instead. */
+        const unsigned long long e = atomic_load(&h->epoch);
+        while (atomic_load(&h->epoch) < e + 2) advance(h);
+        te_free(tree);
+    } else {
+        free(old);
+    }
+    pending = collect(h);
+    unlock(h);
+    return pending;
+}
+
+
+int te_handle_collect(te_handle *h) {
+    int pending;
+    lock(h);
+    pending = collect(h);
+    unlock(h);
+    return pending;
+}
+
+
+void te_handle_free(te_handle *h) {
+    te_reader *r, *next;
+    if (!h) return;
+    while (h->limbo) {
+        retired *old = h->limbo;
+        h->limbo = old->next;
+        te_free(old->tree);
+        free(old);
+    }
+    for (r = atomic_load(&h->readers); r; r = next) {
+        next = r->next;
+        free(r);
+    }
+    te_free(atomic_load(&h->current));
+    free(h);
+}
+
+
+te_reader *te_reader_new(te_handle *h) {
+    te_reader *r;
+    for (r = atomic_load(&h->readers); r; r = r->next) {
+        int unused = 0;
+        if (atomic_compare_exchange_strong(&r->used, &unused, 1)) return r;
+    }
+    r = malloc(sizeof(te_reader));
+    if (!r) return 0;
+    atomic_init(&r->announced, 0);
+    atomic_init(&r->used, 1);
+    r->handle = h;
+    r->next = atomic_load(&h->readers);
+    while (!atomic_compare_exchange_weak(&h->readers, &r->next, r));
+    return r;
+}
+
+
+void te_reader_free(te_reader *r) {
+    if (!r) return;
+    atomic_store(&r->announced, 0);
+    atomic_store(&r->used, 0);
+}
+
+
+const te_expr *te_read_begin(te_reader *r) {
+    atomic_store(&r->announced, 2 * atomic_load(&r->handle->epoch) + 1);
+    return atomic_load(&r->handle->current);
+}
+
+
+void te_read_end(te_reader *r) {
+    atomic_store_explicit(&r->announced, 0, memory_order_release);
+}
+
+
+double te_read_eval(te_reader *r) {
+    const double v = te_eval(te_read_begin(r));
+    te_read_end(r);
+    return v;
+}
+#else
+/* Without atomics no handle can be made, but callers still link. */
+te_handle *te_handle_new(te_expr *n) {
+    (void)n;
+    return 0;
+}
+
+int te_handle_swap(te_handle *h, te_expr *replacement) {
+    (void)h;
+    te_free(replacement);
+    return -1;
+}
+
+int te_handle_collect(te_handle *h) {
+    (void)h;
+    return -1;
+}
+
+void te_handle_free(te_handle *h) {
+    (void)h;
+}
+
+te_reader *te_reader_new(te_handle *h) {
+    (void)h;
+    return 0;
+}
+
+void te_reader_free(te_reader *r) {
+    (void)r;
+}
+
+const te_expr *te_read_begin(te_reader *r) {
+    (void)r;
+    return 0;
+}
+
+void te_read_end(te_reader *r) {
+    (void)r;
+}
+
+double te_read_eval(te_reader *r) {
+    (void)r;
+    return NAN;
+}
+#endif
+
+
+#undef TE_FUN
+#undef M
+#undef C
+
+static void optimize(te_expr *n) {
+    /* Evaluates as much as possible. */
+    if (n->type == TE_CONSTANT) return;
+    if (n->type == TE_VARIABLE) return;
+
+    /* Only optimize out functions flagged as pure. */
+    if (IS_PURE(n->type)) {
+        const int arity = ARITY(n->type);
+        int known = 1;
+        int i;
+        for (i = 0; i < arity; ++i) {
+            optimize(n->parameters[i]);
+            if (((te_expr*)(n->parameters[i]))->type != TE_CONSTANT) {
+                known = 0;
+            }
+        }
+        COUNT(M_FOLD_ATTEMPTS, 1);
+        if (known) {
+            const double value = eval(n, 0, 0);
+            COUNT(M_FOLDS, 1);
+            te_free_parameters(n);
             n->type = TE_CONSTANT;
             n->value = value;
         }
@@ -587,49 +1923,1935 @@ static void optimize(te_expr *n) {
 }
 
 
-te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error) {
-    state s;
-    s.start = s.next = expression;
-    s.lookup = variables;
-    s.lookup_len = var_count;
+static size_t position(const state *s) {
+    const size_t at = s->offset + (s->next - s->start);
+    return at ? at : 1;
+}
+
+
+static void set_error(const state *s, int *error) {
+    if (error) *error = (int)position(s);
+}
+
+
+#define TE_MAX_DEGREE 32
+
+static int monomial(const te_expr *n, const double **var, double *c, int *k) {
+    /* Matches n against c * var^k with constant c and k. */
+    double c2;
+    int k2, i;
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT:
+            *c = n->value;
+            *k = 0;
+            return 1;
+
+        case TE_VARIABLE:
+            if (*var && *var != n->bound) return 0;
+            *var = n->bound;
+            *c = 1;
+            *k = 1;
+            return 1;
+    }
+
+    if (n->type == (TE_FUNCTION1 | TE_FLAG_PURE) && n->function == negate) {
+        if (!monomial(n->parameters[0], var, c, k)) return 0;
+        *c = -*c;
+        return 1;
+    }
+
+    if (n->type != (TE_FUNCTION2 | TE_FLAG_PURE)) return 0;
+    if (!monomial(n->parameters[0], var, c, k)) return 0;
+
+    if (n->function == mul) {
+        if (!monomial(n->parameters[1], var, &c2, &k2)) return 0;
+        *c *= c2;
+        *k += k2;
+    } else if (n->function == divide) {
+        const te_expr *d = n->parameters[1];
+        if (d->type != TE_CONSTANT) return 0;
+        *c /= d->value;
+    } else if (n->function == pow) {
+        const te_expr *e = n->parameters[1];
+        if (e->type != TE_CONSTANT || e->value != floor(e->value) || e->value < 0) return 0;
+        if (e->value * *k > TE_MAX_DEGREE) return 0;
+        k2 = (int)e->value;
+        c2 = 1;
+        for (i = 0; i < k2; ++i) c2 *= *c;
+        *c = c2;
+        *k *= k2;
+    } else {
+        return 0;
+    }
+
+    return *k <= TE_MAX_DEGREE;
+}
+
+
+static int terms(const te_expr *n, double sign, const double **var, double *coefficients, int *degree) {
+    /* Collects a sum of monomials into coefficients. */
+    double c;
+    int k;
+
+    if (n->type == (TE_FUNCTION2 | TE_FLAG_PURE) && (n->function == add || n->function == sub)) {
+        return terms(n->parameters[0], sign, var, coefficients, degree)
+            && terms(n->parameters[1], n->function == add ? sign : -sign, var, coefficients, degree);
+    }
+
+    if (!monomial(n, var, &c, &k)) return 0;
+    coefficients[k] += sign * c;
+    if (k > *degree) *degree = k;
+    return 1;
+}
+
+
+static te_expr *polynomials(te_expr *n) {
+    /* Replaces sums of powers of one variable by a single Horner node. */
+    double coefficients[TE_MAX_DEGREE + 1] = {0};
+    const double *var = 0;
+    int degree = 0, i;
+
+    if (terms(n, 1, &var, coefficients, &degree) && var && degree >= 2) {
+        te_poly *p = alloc_node(POLY_SIZE(degree));
+        p->type = TE_POLY;
+        p->bound = var;
+        p->degree = degree;
+        memcpy(p->coefficients, coefficients, sizeof(double) * (degree + 1));
+        free_tree(n);
+        return (te_expr*)p;
+    }
+
+    for (i = 0; i < ARITY(n->type); ++i) {
+        n->parameters[i] = polynomials(n->parameters[i]);
+    }
+    return n;
+}
+
+
+#define IS_CALL(N, FUN) ((N)->type == (TE_FUNCTION2 | TE_FLAG_PURE) && (N)->function == (FUN))
+
+typedef struct operand {
+    te_expr *n;
+    int sign;
+} operand;
+
+typedef struct chain {
+    operand *operands;
+    int count;
+    double constant;
+} chain;
+
+static te_expr *reassociate(te_expr *n);
+
+
+static int chain_length(const te_expr *n, int sum) {
+    /* Counts the operands gather will find, so the chain is sized up front. */
+    if (sum ? (IS_CALL(n, add) || IS_CALL(n, sub)) : IS_CALL(n, mul)) {
+        return chain_length(n->parameters[0], sum) + chain_length(n->parameters[1], sum);
+    }
+    return 1;
+}
+
+
+static void append(chain *c, te_expr *n, int sign) {
+    c->operands[c->count].n = n;
+    c->operands[c->count].sign = sign;
+    ++c->count;
+}
+
+
+static void gather(chain *c, te_expr *n, int sign, int sum) {
+    /* Flattens a chain of + and - (or of *) into its operands. */
+    if (sum ? (IS_CALL(n, add) || IS_CALL(n, sub)) : IS_CALL(n, mul)) {
+        gather(c, n->parameters[0], sign, sum);
+        gather(c, n->parameters[1], IS_CALL(n, sub) ? -sign : sign, sum);
+        free_node(n);
+        return;
+    }
+
+    if (n->type == TE_CONSTANT) {
+        /* Constants anywhere in the chain are folded together. */
+        if (sum) c->constant += sign * n->value;
+        else c->constant *= n->value;
+        free_node(n);
+        return;
+    }
+
+    append(c, reassociate(n), sign);
+}
+
+
+static te_expr *balance(const operand *operands, int count, int *sign, te_fun2 op) {
+    /* Builds a tree of height log2(count); the result is *sign times the sum/product. */
+    if (count == 1) {
+        *sign = operands[0].sign;
+        return operands[0].n;
+    }
+
+    int left_sign, right_sign;
+    te_expr *left = balance(operands, count / 2, &left_sign, op);
+    te_expr *right = balance(operands + count / 2, count - count / 2, &right_sign, op);
+    te_expr *ret;
+
+    if (op == mul || left_sign == right_sign) {
+        ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, left, right);
+        ret->function = op;
+        *sign = left_sign;
+    } else {
+        ret = left_sign > 0 ? NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, left, right) : NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, right, left);
+        ret->function = sub;
+        *sign = 1;
+    }
+    return ret;
+}
+
+
+static te_expr *reassociate(te_expr *n) {
+    /* Rebalances long chains of + and - or of * into balanced trees. */
+    const int sum = IS_CALL(n, add) || IS_CALL(n, sub);
+    chain c = {0, 0, sum ? 0.0 : 1.0};
+    int i, sign;
+
+    if (!sum && !IS_CALL(n, mul)) {
+        for (i = 0; i < ARITY(n->type); ++i) {
+            n->parameters[i] = reassociate(n->parameters[i]);
+        }
+        return n;
+    }
+
+    /* One more slot for the folded constant. Nothing has been taken apart
+     * yet, so if this fails the chain is left as it was. */
+    c.operands = malloc(sizeof(operand) * (chain_length(n, sum) + 1));
+    if (!c.operands) return n;
+
+    gather(&c, n, 1, sum);
+
+    if (c.constant != (sum ? 0.0 : 1.0) || c.count == 0) {
+        te_expr *k = new_expr(TE_CONSTANT, 0);
+        k->value = c.constant;
+        append(&c, k, 1);
+    }
+
+    n = balance(c.operands, c.count, &sign, sum ? add : mul);
+    free(c.operands);
+
+    if (sign < 0) {
+        n = NEW_EXPR(TE_FUNCTION1 | TE_FLAG_PURE, n);
+        n->function = negate;
+    }
+    return n;
+}
+
+static te_expr *contract(te_expr *n) {
+    /* Fuses a*b+c, c+a*b, a*b-c and c-a*b into a single fma node. */
+    te_expr *product, *other, *ret;
+    const void *fused;
+    int i;
+
+    for (i = 0; i < ARITY(n->type); ++i) {
+        n->parameters[i] = contract(n->parameters[i]);
+    }
+
+    if (!IS_CALL(n, add) && !IS_CALL(n, sub)) return n;
+
+    if (IS_CALL((te_expr*)n->parameters[0], mul)) {
+        product = n->parameters[0];
+        other = n->parameters[1];
+        fused = n->function == add ? (const void*)fma : (const void*)fms;
+    } else if (IS_CALL((te_expr*)n->parameters[1], mul)) {
+        product = n->parameters[1];
+        other = n->parameters[0];
+        fused = n->function == add ? (const void*)fma : (const void*)fnma;
+    } else {
+        return n;
+    }
+
+    ret = NEW_EXPR(TE_FUNCTION3 | TE_FLAG_PURE, product->parameters[0], product->parameters[1], other);
+    ret->function = fused;
+    free_node(product);
+    free_node(n);
+    return ret;
+}
+
+
+static void number_state(te_expr *n, int *count) {
+    /* Gives each call to a stateful builtin its own index into a te_state. */
+    int i;
+    if (IS_CLOSURE(n->type) && stateful(n->function)) {
+        n->type |= TE_FLAG_STATE;
+        n->parameters[2] = (void*)(size_t)(*count)++;
+    }
+    for (i = 0; i < ARITY(n->type); ++i) {
+        number_state(n->parameters[i], count);
+    }
+}
+
+
+te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error) {
+    return te_compile_ex(expression, variables, var_count, TE_OPT_STRICT, error);
+}
+
+
+static te_expr *rewrite(te_expr *root, int flags) {
+    /* Applies the optional passes selected by flags (TE_OPT_*). */
+    if (flags & TE_OPT_POLY) root = polynomials(root);
+    if (flags & TE_OPT_REASSOC) root = reassociate(root);
+    if (flags & TE_OPT_FMA) root = contract(root);
+    return root;
+}
+
+
+static te_expr *compile(state *s, int flags, size_t *error) {
+#ifdef TE_METRICS
+    const double start = now();
+#endif
+    te_expr *ret;
+    int calls = 0;
+
+    next_token(s);
+    te_expr *root = list(s);
+
+    if (s->type != TOK_END) {
+        free_tree(root);
+        if (error) *error = position(s);
+        ret = 0;
+        COUNT(M_FAILURES, 1);
+    } else {
+        optimize(root);
+        number_state(root, &calls);
+        root = rewrite(root, flags);
+        if (error) *error = 0;
+        ret = pack(root);
+    }
+
+#ifdef TE_METRICS
+    {
+        /* Bucket i counts compiles that took less than 2^(i+1) ns. */
+        const double elapsed = now() - start;
+        int bucket = 0;
+        while (bucket < TE_METRICS_BUCKETS - 1 && elapsed >= (double)(2ull << bucket)) ++bucket;
+        COUNT(M_COMPILES, 1);
+        COUNT(M_LATENCY + bucket, 1);
+    }
+#endif
+
+    return ret;
+}
+
+
+te_expr *te_compile_ex(const char *expression, const te_variable *variables, int var_count, int flags, int *error) {
+    state s;
+    size_t at;
+    te_expr *ret;
+    init_state(&s, expression, variables, var_count);
+    ret = compile(&s, flags, &at);
+    if (error) *error = (int)at;
+    return ret;
+}
+
+
+te_expr *te_compile_stream(te_source source, void *context, const te_variable *variables, int var_count, int flags, size_t *error) {
+    state s;
+    te_expr *ret;
+    char *buffer = malloc(TE_STREAM_BUFFER + 1);
+    if (!buffer) {
+        if (error) *error = 0;
+        return 0;
+    }
+    buffer[0] = '\0';
+    init_state(&s, buffer, variables, var_count);
+    s.source = source;
+    s.source_context = context;
+    s.buffer = buffer;
+    s.end = buffer;
+    ret = compile(&s, flags, error);
+    free(buffer);
+    return ret;
+}
+
+
+te_template *te_template_new(const char *expression) {
+    te_template *t = calloc(1, sizeof(te_template));
+    state s;
+    int capacity = 0;
+    if (!t) return 0;
+
+    init_state(&s, expression, 0, 0);
+    s.building = t;
+    do {
+        token *k;
+        next_token(&s);
+        if (t->token_count == capacity) {
+            token *tokens = realloc(t->tokens, sizeof(token) * (capacity ? 2 * capacity : 16));
+            if (!tokens) s.failed = 1;
+            else t->tokens = tokens;
+            capacity = capacity ? 2 * capacity : 16;
+        }
+        if (s.failed) {
+            te_template_free(t);
+            return 0;
+        }
+        k = t->tokens + t->token_count++;
+        k->type = s.type;
+        k->name = s.name;
+        k->value = 0;
+        if (s.type == TOK_NUMBER) k->value = s.value;
+        else if (s.type == TOK_INFIX) k->function = s.function;
+        k->end = s.offset + (s.next - s.start);
+    } while (s.type != TOK_END && s.type != TOK_ERROR);
+
+    return t;
+}
+
+
+te_expr *te_bind(const te_template *t, const te_variable *variables, int var_count, int flags, int *error) {
+    const te_variable *few[16];
+    const te_variable **resolved = few;
+    state s;
+    size_t at;
+    te_expr *ret;
+    int i, left;
+
+    if (t->name_count > 16) {
+        resolved = malloc(sizeof(te_variable*) * t->name_count);
+        if (!resolved) {
+            if (error) *error = 0;
+            return 0;
+        }
+    }
+
+    /* One pass over the variables, the first one of each name winning, */
+    /* then builtins for the names left. */
+    for (i = 0; i < t->name_count; ++i) resolved[i] = 0;
+    for (i = 0, left = t->name_count; i < var_count && left; ++i) {
+        unsigned slot = hash_name(variables[i].name, (int)strlen(variables[i].name)) & t->slot_mask;
+        while (t->slots[slot] >= 0) {
+            const int k = t->slots[slot];
+            if (strcmp(t->names[k], variables[i].name) == 0) {
+                if (!resolved[k]) {
+                    resolved[k] = variables + i;
+                    --left;
+                }
+                break;
+            }
+            slot = (slot + 1) & t->slot_mask;
+        }
+    }
+    for (i = 0; i < t->name_count; ++i) {
+        if (!resolved[i]) resolved[i] = find_builtin(t->names[i], (int)strlen(t->names[i]));
+    }
+
+    init_state(&s, "", variables, var_count);
+
+    s.tokens = t->tokens;
+    s.resolved = resolved;
+    ret = compile(&s, flags, &at);
+    if (error) *error = (int)at;
+    if (resolved != few) free(resolved);
+    return ret;
+}
+
+
+void te_template_free(te_template *t) {
+    int i;
+    if (!t) return;
+    for (i = 0; i < t->name_count; ++i) free(t->names[i]);
+    free(t->names);
+    free(t->tokens);
+    free(t->slots);
+    free(t);
+}
+
+
+size_t te_read_file(void *file, char *buffer, size_t size) {
+    const size_t n = fread(buffer, 1, size, file);
+    return n == 0 && ferror((FILE*)file) ? (size_t)-1 : n;
+}
+
+
+/* te_compile_bulk hands out formulas in runs of this many to whichever
+ * thread asks next, so slow formulas do not hold back the others. */
+#define TE_BULK_GRAIN 64
+#define TE_MAX_THREADS 256
+
+typedef struct bulk {
+    const char **expressions;
+    size_t count;
+    const te_variable *variables;
+    int var_count;
+    const te_variable *const *index;
+    int flags;
+    te_expr **out;
+    int *errors;
+#ifdef TE_THREADS
+    atomic_size_t next, compiled;
+#else
+    size_t next, compiled;
+#endif
+} bulk;
+
+
+static int by_name(const void *a, const void *b) {
+    /* Orders variables by name, then by position so the first one wins. */
+    const te_variable *va = *(const te_variable *const *)a, *vb = *(const te_variable *const *)b;
+    const int c = strcmp(va->name, vb->name);
+    return c ? c : (va > vb) - (va < vb);
+}
+
+
+static int compile_some(void *arg) {
+    bulk *b = arg;
+    size_t first, i, compiled = 0;
+#ifdef TE_THREADS
+    chunk *c = malloc(offsetof(chunk, data) + TE_ARENA_CHUNK);
+    if (c) {
+        c->next = 0;
+        c->size = TE_ARENA_CHUNK;
+        c->used = 0;
+    }
+    arena = c;
+    while ((first = atomic_fetch_add(&b->next, TE_BULK_GRAIN)) < b->count) {
+#else
+    while ((first = b->next) < b->count) {
+        b->next += TE_BULK_GRAIN;
+#endif
+        const size_t last = first + TE_BULK_GRAIN < b->count ? first + TE_BULK_GRAIN : b->count;
+        for (i = first; i < last; ++i) {
+            state s;
+            size_t error;
+            init_state(&s, b->expressions[i], b->variables, b->var_count);
+            s.index = b->index;
+            b->out[i] = compile(&s, b->flags, &error);
+            if (b->errors) b->errors[i] = (int)error;
+            if (b->out[i]) ++compiled;
+#ifdef TE_THREADS
+            /* The tree is packed now, so its nodes can be reused. */
+            while (arena && arena->next) {
+                c = arena->next;
+                free(arena);
+                arena = c;
+            }
+            if (arena) arena->used = 0;
+#endif
+        }
+    }
+#ifdef TE_THREADS
+    free(arena);
+    arena = 0;
+    atomic_fetch_add(&b->compiled, compiled);
+#else
+    b->compiled += compiled;
+#endif
+    return 0;
+}
+
+
+size_t te_compile_bulk(const char **expressions, size_t count, const te_variable *variables, int var_count, int flags, int threads, te_expr **out, int *errors) {
+    const te_variable **index = 0;
+    bulk b;
+    int i;
+
+    if (var_count > 0) {
+        index = malloc(sizeof(te_variable*) * var_count);
+        if (index) {
+            for (i = 0; i < var_count; ++i) index[i] = variables + i;
+            qsort(index, var_count, sizeof(te_variable*), by_name);
+        }
+    }
+
+    b.expressions = expressions;
+    b.count = count;
+    b.variables = variables;
+    b.var_count = var_count;
+    b.index = index;
+    b.flags = flags;
+    b.out = out;
+    b.errors = errors;
+#ifdef TE_THREADS
+    atomic_init(&b.next, 0);
+    atomic_init(&b.compiled, 0);
+    {
+        /* The calling thread compiles too. A thread that fails to start
+         * just leaves its share to the others. */
+        thrd_t pool[TE_MAX_THREADS];
+        int started[TE_MAX_THREADS];
+        const size_t runs = (count + TE_BULK_GRAIN - 1) / TE_BULK_GRAIN;
+        if (threads < 1) threads = 1;
+        if ((size_t)threads > runs) threads = (int)runs;
+        if (threads > TE_MAX_THREADS) threads = TE_MAX_THREADS;
+        for (i = 1; i < threads; ++i) started[i] = thrd_create(&pool[i], compile_some, &b) == thrd_success;
+        compile_some(&b);
+        for (i = 1; i < threads; ++i) if (started[i]) thrd_join(pool[i], 0);
+    }
+#else
+    (void)threads;
+    b.next = 0;
+    b.compiled = 0;
+    compile_some(&b);
+#endif
+
+    free(index);
+    return b.compiled;
+}
+
+
+static te_expr *specialize(const te_expr *n, const te_variable *known, int known_count) {
+    const int arity = ARITY(n->type);
+    te_expr *ret = new_expr(n->type, 0);
+    int i;
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT:
+            ret->value = n->value;
+            break;
+
+        case TE_POLY:
+        case TE_CHEB:
+            free_node(ret);
+            for (i = 0; i < known_count; ++i) {
+                if (known[i].address == n->bound && TYPE_MASK(known[i].type) == TE_VARIABLE) {
+                    ret = new_expr(TE_CONSTANT, 0);
+                    ret->value = te_eval(n);
+                    return ret;
+                }
+            }
+            ret = alloc_node(node_size(n));
+            memcpy(ret, n, node_size(n));
+            break;
+
+        case TE_VARIABLE:
+            ret->bound = n->bound;
+            for (i = 0; i < known_count; ++i) {
+                if (known[i].address == n->bound && TYPE_MASK(known[i].type) == TE_VARIABLE) {
+                    ret->type = TE_CONSTANT;
+                    ret->value = *n->bound;
+                    break;
+                }
+            }
+            break;
+
+        default:
+            ret->function = n->function;
+            for (i = 0; i < arity; ++i) {
+                ret->parameters[i] = specialize(n->parameters[i], known, known_count);
+            }
+            if (IS_CLOSURE(n->type)) ret->parameters[arity] = n->parameters[arity];
+            break;
+    }
+
+    return ret;
+}
+
+
+te_expr *te_specialize(const te_expr *n, const te_variable *known, int known_count) {
+    return te_specialize_ex(n, known, known_count, TE_OPT_STRICT);
+}
+
+
+te_expr *te_specialize_ex(const te_expr *n, const te_variable *known, int known_count, int flags) {
+    if (!n) return 0;
+    te_expr *ret = specialize(n, known, known_count);
+    optimize(ret);
+    return pack(rewrite(ret, flags));
+}
+
+
+/* Chebyshev approximation. A pure subtree of one variable with a declared
+ * domain is sampled at Chebyshev points of increasing degree until the
+ * series matches it to within the tolerance on a fine grid, and is then
+ * replaced by a single TE_CHEB node. */
+
+#define TE_MAX_CHEB 64
+#define TE_CHEB_CHECKS 1024
+
+static int univariate(const te_expr *n, const double **var, int *costly) {
+    /* Returns 1 if n is pure and reads no variable other than *var. */
+    int i;
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return 1;
+        case TE_VARIABLE:
+        case TE_POLY:
+        case TE_CHEB:
+            if (*var && *var != n->bound) return 0;
+            *var = n->bound;
+            return 1;
+    }
+
+    if ((IS_FUNCTION(n->type) || IS_CLOSURE(n->type)) && !IS_PURE(n->type)) return 0;
+    if (n->function != add && n->function != sub && n->function != mul && n->function != divide
+        && n->function != negate && n->function != comma) *costly = 1;
+    for (i = 0; i < ARITY(n->type); ++i) {
+        if (!univariate(n->parameters[i], var, costly)) return 0;
+    }
+    return 1;
+}
+
+
+static te_expr *fit(const te_expr *n, const double *var, double lo, double hi, double tolerance, double *error) {
+    /* Returns a TE_CHEB node within tolerance of n on [lo, hi], or null. */
+    const double center = 0.5 * (lo + hi), half = 0.5 * (hi - lo);
+    double xs[TE_CHEB_CHECKS], exact[TE_CHEB_CHECKS], f[TE_MAX_CHEB + 1];
+    te_array array = {var, xs};
+    te_cheb *p = alloc_node(CHEB_SIZE(TE_MAX_CHEB));
+    int degree, i, j, k;
+
+    if (!p) return 0;
+    p->type = TE_CHEB;
+    p->bound = var;
+    p->center = center;
+    p->scale = 1 / half;
+
+    for (i = 0; i < TE_CHEB_CHECKS; ++i) {
+        xs[i] = i == TE_CHEB_CHECKS - 1 ? hi : lo + (hi - lo) * i / (TE_CHEB_CHECKS - 1);
+    }
+    te_eval_batch(n, &array, 1, TE_CHEB_CHECKS, exact);
+    for (i = 0; i < TE_CHEB_CHECKS; ++i) {
+        if (!isfinite(exact[i])) break;
+    }
+
+    for (degree = 4; i == TE_CHEB_CHECKS && degree <= TE_MAX_CHEB; degree *= 2) {
+        /* Interpolate at the roots of T_(degree+1). */
+        const int points = degree + 1;
+        double tail = 0, worst = 0;
+
+        for (j = 0; j < points; ++j) {
+            xs[j] = center + half * cos(3.14159265358979323846 * (j + 0.5) / points);
+        }
+        te_eval_batch(n, &array, 1, points, f);
+        for (k = 0; k <= degree; ++k) {
+            double c = 0;
+            for (j = 0; j < points; ++j) c += f[j] * cos(3.14159265358979323846 * k * (j + 0.5) / points);
+            p->coefficients[k] = (k ? 2.0 : 1.0) * c / points;
+        }
+
+        /* Drop trailing terms that are too small to matter. */
+        p->degree = degree;
+        while (p->degree > 0 && tail + fabs(p->coefficients[p->degree]) <= tolerance / 8) {
+            tail += fabs(p->coefficients[p->degree--]);
+        }
+
+        for (j = 0; j < TE_CHEB_CHECKS && worst <= tolerance; ++j) {
+            const double x = j == TE_CHEB_CHECKS - 1 ? hi : lo + (hi - lo) * j / (TE_CHEB_CHECKS - 1);
+            const double d = fabs(clenshaw(p, x) - exact[j]);
+            if (!(d <= worst)) worst = d;
+        }
+
+        if (worst <= tolerance) {
+            *error = worst;
+            return (te_expr*)p;
+        }
+    }
+
+    free_node(p);
+    return 0;
+}
+
+
+static te_expr *approximate(te_expr *n, const te_interval *domains, int domain_count, double tolerance, double *error) {
+    /* Replaces the largest univariate subtrees it can, top down. */
+    const double *var = 0;
+    int costly = 0, i;
+
+    if (ARITY(n->type) && univariate(n, &var, &costly) && var && costly) {
+        for (i = 0; i < domain_count; ++i) {
+            const te_interval *d = domains + i;
+            if (d->address == var && d->lo < d->hi && isfinite(d->lo) && isfinite(d->hi)) {
+                double e;
+                te_expr *p = fit(n, var, d->lo, d->hi, tolerance, &e);
+                if (p) {
+                    if (e > *error) *error = e;
+                    free_tree(n);
+                    return p;
+                }
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < ARITY(n->type); ++i) {
+        n->parameters[i] = approximate(n->parameters[i], domains, domain_count, tolerance, error);
+    }
+    return n;
+}
+
+
+te_expr *te_approximate(const te_expr *n, const te_interval *domains, int domain_count, double tolerance, double *max_error) {
+    double error = 0;
+    te_expr *ret;
+    if (max_error) *max_error = 0;
+    if (!n) return 0;
+    ret = specialize(n, 0, 0);
+    if (tolerance > 0) ret = approximate(ret, domains, domain_count, tolerance, &error);
+    if (max_error) *max_error = error;
+    return pack(ret);
+}
+
+
+static int uses(const te_expr *n, const te_variable *v) {
+    /* Returns 1 if binding v is referenced anywhere in n. */
+    const int arity = ARITY(n->type);
+    int i;
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return 0;
+        case TE_VARIABLE:
+        case TE_POLY:
+        case TE_CHEB:
+            return TYPE_MASK(v->type) == TE_VARIABLE && n->bound == v->address;
+        default:
+            if (TYPE_MASK(v->type) == TE_TABLE) {
+                if (n->function == table_lookup && n->parameters[arity] == v->address) return 1;
+            } else if (n->function == v->address && n->type == v->type
+                && (!IS_CLOSURE(n->type) || n->parameters[arity] == v->context)) return 1;
+            for (i = 0; i < arity; ++i) {
+                if (uses(n->parameters[i], v)) return 1;
+            }
+            return 0;
+    }
+}
+
+
+int te_dependencies(const te_expr *n, const te_variable *variables, int var_count, int *indices) {
+    int i, count = 0;
+    if (!n) return 0;
+    for (i = 0; i < var_count; ++i) {
+        if (uses(n, &variables[i])) indices[count++] = i;
+    }
+    return count;
+}
+
+
+/* Cost model. Each node costs the entry for its kind, and calls add the
+ * entry for their function. The defaults are rough cycle counts for a
+ * current x86-64 core; bench calibrate measures them on the host. */
+
+enum {COST_CONSTANT, COST_VARIABLE, COST_CALL, COST_FUNCTION, COST_POLY, COST_CHEB};
+
+typedef struct cost {
+    const char *name;
+    const void *function;
+    double cycles;
+} cost;
+
+static cost costs[] = {
+    {"constant", 0, 1}, {"variable", 0, 1}, {"call", 0, 4}, {"function", 0, 20},
+    {"poly", 0, 4}, {"cheb", 0, 6},
+    {"+", add, 1}, {"-", sub, 1}, {"*", mul, 1}, {"/", divide, 5}, {"negate", negate, 1},
+    {",", comma, 0}, {"^", pow, 60}, {"%", fmod, 20},
+    {"fma", fma, 4}, {"fms", fms, 4}, {"fnma", fnma, 4}, {"table", table_lookup, 15},
+    {"abs", fabs, 1}, {"acos", acos, 40}, {"asin", asin, 40}, {"atan", atan, 35},
+    {"atan2", atan2, 45}, {"ceil", ceil, 2}, {"cos", cos, 30}, {"cosh", cosh, 40},
+    {"e", e, 0}, {"erf", erf, 30}, {"erfc", erfc, 30}, {"exp", exp, 20}, {"fac", fac, 5},
+    {"floor", floor, 2}, {"gamma", tgamma, 60}, {"lgamma", lgamma, 60}, {"ln", log, 20},
+    {"log10", log10, 25}, {"ncr", ncr, 80}, {"normcdf", normcdf, 35}, {"npr", npr, 90},
+    {"pi", pi, 0}, {"sin", sin, 30}, {"sinh", sinh, 40}, {"sqrt", sqrt, 6},
+    {"tan", tan, 40}, {"tanh", tanh, 35},
+    {"delay", delay_step, 6}, {"ema", ema_step, 4}, {"rmax", rmax_step, 12}, {"rmin", rmin_step, 12},
+    {"rstd", rstd_step, 20}, {"rsum", rsum_step, 10},
+    {0, 0, 0}
+};
+
+
+static cost *find_cost(const char *name) {
+    const te_variable *b;
+    cost *c;
+    for (c = costs; c->name; ++c) {
+        if (!strcmp(c->name, name)) return c;
+    }
+    /* Builtins are also found by the name they are called with, e.g. log. */
+    b = find_builtin(name, strlen(name));
+    for (c = costs; b && c->name; ++c) {
+        if (c->function == b->address) return c;
+    }
+    return 0;
+}
+
+
+int te_set_cost(const char *name, double cycles) {
+    cost *c = find_cost(name);
+    if (!c) return 0;
+    c->cycles = cycles;
+    return 1;
+}
+
+
+double te_get_cost(const char *name) {
+    const cost *c = find_cost(name);
+    return c ? c->cycles : NAN;
+}
+
+
+static double node_cost(const te_expr *n) {
+    const cost *c;
+    double total;
+    int i;
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return costs[COST_CONSTANT].cycles;
+        case TE_VARIABLE: return costs[COST_VARIABLE].cycles;
+        case TE_POLY: return costs[COST_VARIABLE].cycles + costs[COST_POLY].cycles * ((const te_poly*)n)->degree;
+        case TE_CHEB: return costs[COST_VARIABLE].cycles + costs[COST_CHEB].cycles * ((const te_cheb*)n)->degree;
+    }
+
+    total = costs[COST_CALL].cycles + costs[COST_FUNCTION].cycles;
+    for (c = costs + COST_CHEB + 1; c->name; ++c) {
+        if (c->function == n->function) {
+            total = costs[COST_CALL].cycles + c->cycles;
+            break;
+        }
+    }
+    for (i = 0; i < ARITY(n->type); ++i) {
+        total += node_cost(n->parameters[i]);
+    }
+    return total;
+}
+
+
+double te_cost(const te_expr *n) {
+    return n ? node_cost(n) : 0;
+}
+
+
+double te_interp(const char *expression, int *error) {
+    state s;
+    init_state(&s, expression, 0, 0);
+    s.evaluate = 1;
+
+    next_token(&s);
+    const double ret = vlist(&s);
+
+    if (s.type != TOK_END) {
+        set_error(&s, error);
+        return NAN;
+    }
+    if (error) *error = 0;
+    return ret;
+}
+
+
+int te_validate(const char *expression, const te_variable *variables, int var_count, int *error) {
+    state s;
+    init_state(&s, expression, variables, var_count);
+
+    next_token(&s);
+    vlist(&s);
+
+    if (s.type != TOK_END) {
+        set_error(&s, error);
+        return 0;
+    }
+    if (error) *error = 0;
+    return 1;
+}
+
+
+/* Batch evaluation runs the tree as a postfix program over blocks of rows.
+ * Each step consumes its arguments from a stack of block buffers and pushes
+ * its result, so a node is dispatched once per block rather than once per row. */
+
+#define TE_BLOCK 256
+
+enum {STEP_CONSTANT, STEP_ARRAY, STEP_CALL, STEP_POLY, STEP_CHEB};
+
+typedef struct step {
+    int kind;
+    int type;
+    union {double value; int column; const void *function;};
+    void *context;
+} step;
+
+typedef struct program {
+    step *steps;
+    int count;
+    int depth;
+    const double **stack;
+    double *scratch;
+} program;
+
+
+static int find_column(const te_array *arrays, int array_count, const double *address) {
+    /* Returns the index of the array bound to address, or -1. */
+    int i;
+    for (i = 0; i < array_count; ++i) {
+        if (arrays[i].address == address) return i;
+    }
+    return -1;
+}
+
+
+static void call_block(const step *st, const double **a, double *out, int len);
+
+
+static int emit(program *p, const te_expr *n, const te_array *arrays, int array_count, int height) {
+    /* Returns the deepest stack height reached while evaluating n. */
+    step *st;
+    int i, deepest = height + 1;
+    const int arity = ARITY(n->type);
+
+    for (i = 0; i < arity; ++i) {
+        const int d = emit(p, n->parameters[i], arrays, array_count, height + i);
+        if (d > deepest) deepest = d;
+    }
+
+    st = p->steps + p->count++;
+    st->type = n->type;
+    st->context = 0;
+
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT:
+            st->kind = STEP_CONSTANT;
+            st->value = n->value;
+            break;
+
+        case TE_VARIABLE:
+            st->column = find_column(arrays, array_count, n->bound);
+            if (st->column >= 0) {
+                st->kind = STEP_ARRAY;
+            } else {
+                st->kind = STEP_CONSTANT;
+                st->value = *n->bound;
+            }
+            break;
+
+        case TE_POLY:
+        case TE_CHEB:
+            st->column = find_column(arrays, array_count, n->bound);
+            st->context = (void*)n;
+            if (st->column >= 0) {
+                st->kind = TYPE_MASK(n->type) == TE_POLY ? STEP_POLY : STEP_CHEB;
+            } else {
+                st->kind = STEP_CONSTANT;
+                st->value = te_eval(n);
+            }
+            break;
+
+        default:
+            st->kind = STEP_CALL;
+            st->function = n->function;
+            if (IS_CLOSURE(n->type) && !(n->type & TE_FLAG_STATE)) st->context = n->parameters[arity];
+
+            /* A pure call whose arguments are all uniform across rows is
+             * evaluated once here and broadcast like a constant. */
+            if (IS_PURE(n->type)) {
+                const double *args[7];
+                double value;
+                for (i = 0; i < arity; ++i) {
+                    if (st[i - arity].kind != STEP_CONSTANT) break;
+                    args[i] = &st[i - arity].value;
+                }
+                if (i == arity) {
+                    call_block(st, args, &value, 1);
+                    p->count -= arity;
+                    st = p->steps + p->count - 1;
+                    st->kind = STEP_CONSTANT;
+                    st->type = TE_CONSTANT;
+                    st->value = value;
+                }
+            }
+            break;
+    }
+
+    return deepest;
+}
+
+
+static int compile_program(program *p, const te_expr *n, const te_array *arrays, int array_count) {
+    const int count = count_nodes(n);
+
+    /* The stack can never be deeper than the number of nodes. */
+    p->steps = malloc(sizeof(step) * count);
+    if (!p->steps) return 0;
+    p->count = 0;
+    p->depth = emit(p, n, arrays, array_count, 0);
+
+    p->scratch = malloc(sizeof(double) * TE_BLOCK * p->depth + sizeof(double*) * p->depth);
+    if (!p->scratch) {
+        free(p->steps);
+        return 0;
+    }
+    p->stack = (const double**)(p->scratch + TE_BLOCK * p->depth);
+    return 1;
+}
+
+
+static void free_program(program *p) {
+    free(p->steps);
+    free(p->scratch);
+}
+
+
+#define TE_FUN(...) ((double(*)(__VA_ARGS__))st->function)
+#define A(e) a[e][i]
+#define C st->context
+
+static void call_block(const step *st, const double **a, double *out, int len) {
+    int i;
+
+    /* The arithmetic operators are inlined so the compiler can vectorize them. */
+    if (st->function == add) {for (i = 0; i < len; ++i) out[i] = A(0) + A(1); return;}
+    if (st->function == sub) {for (i = 0; i < len; ++i) out[i] = A(0) - A(1); return;}
+    if (st->function == mul) {for (i = 0; i < len; ++i) out[i] = A(0) * A(1); return;}
+    if (st->function == divide) {for (i = 0; i < len; ++i) out[i] = A(0) / A(1); return;}
+    if (st->function == negate) {for (i = 0; i < len; ++i) out[i] = -A(0); return;}
+    if (st->function == comma) {if (out != a[1]) memcpy(out, a[1], sizeof(double) * len); return;}
+    if (st->function == fma) {for (i = 0; i < len; ++i) out[i] = fma(A(0), A(1), A(2)); return;}
+    if (st->function == fms) {for (i = 0; i < len; ++i) out[i] = fma(A(0), A(1), -A(2)); return;}
+    if (st->function == fnma) {for (i = 0; i < len; ++i) out[i] = fma(-A(0), A(1), A(2)); return;}
+    if (st->function == table_lookup) {for (i = 0; i < len; ++i) out[i] = table_lookup(C, A(0)); return;}
+
+    if (IS_CLOSURE(st->type)) {
+        switch (ARITY(st->type)) {
+            case 0: for (i = 0; i < len; ++i) out[i] = TE_FUN(void*)(C); break;
+            case 1: for (i = 0; i < len; ++i) out[i] = TE_FUN(void*, double)(C, A(0)); break;
+            case 2: for (i = 0; i < len; ++i) out[i] = TE_FUN(void*, double, double)(C, A(0), A(1)); break;
+            case 3: for (i = 0; i < len; ++i) out[i] = TE_FUN(void*, double, double, double)(C, A(0), A(1), A(2)); break;
+            case 4: for (i = 0; i < len; ++i) out[i] = TE_FUN(void*, double, double, double, double)(C, A(0), A(1), A(2), A(3)); break;
+            case 5: for (i = 0; i < len; ++i) out[i] = TE_FUN(void*, double, double, double, double, double)(C, A(0), A(1), A(2), A(3), A(4)); break;
+            case 6: for (i = 0; i < len; ++i) out[i] = TE_FUN(void*, double, double, double, double, double, double)(C, A(0), A(1), A(2), A(3), A(4), A(5)); break;
+            case 7: for (i = 0; i < len; ++i) out[i] = TE_FUN(void*, double, double, double, double, double, double, double)(C, A(0), A(1), A(2), A(3), A(4), A(5), A(6)); break;
+        }
+    } else {
+        switch (ARITY(st->type)) {
+            case 0: for (i = 0; i < len; ++i) out[i] = TE_FUN(void)(); break;
+            case 1: for (i = 0; i < len; ++i) out[i] = TE_FUN(double)(A(0)); break;
+            case 2: for (i = 0; i < len; ++i) out[i] = TE_FUN(double, double)(A(0), A(1)); break;
+            case 3: for (i = 0; i < len; ++i) out[i] = TE_FUN(double, double, double)(A(0), A(1), A(2)); break;
+            case 4: for (i = 0; i < len; ++i) out[i] = TE_FUN(double, double, double, double)(A(0), A(1), A(2), A(3)); break;
+            case 5: for (i = 0; i < len; ++i) out[i] = TE_FUN(double, double, double, double, double)(A(0), A(1), A(2), A(3), A(4)); break;
+            case 6: for (i = 0; i < len; ++i) out[i] = TE_FUN(double, double, double, double, double, double)(A(0), A(1), A(2), A(3), A(4), A(5)); break;
+            case 7: for (i = 0; i < len; ++i) out[i] = TE_FUN(double, double, double, double, double, double, double)(A(0), A(1), A(2), A(3), A(4), A(5), A(6)); break;
+        }
+    }
+}
+
+#undef TE_FUN
+#undef A
+#undef C
+
+
+static void poly_block(const te_poly *poly, const double *x, double *out, int len) {
+    /* Horner's rule, one coefficient at a time across the whole block. */
+    int i, k;
+    for (i = 0; i < len; ++i) out[i] = poly->coefficients[poly->degree];
+    for (k = poly->degree - 1; k >= 0; --k) {
+        const double c = poly->coefficients[k];
+        for (i = 0; i < len; ++i) out[i] = out[i] * x[i] + c;
+    }
+}
+
+
+static void poly_gather(const te_poly *poly, const double *x, const size_t *selection, double *out, int len) {
+    int i, k;
+    for (i = 0; i < len; ++i) {
+        const double v = x[selection[i]];
+        double r = poly->coefficients[poly->degree];
+        for (k = poly->degree - 1; k >= 0; --k) r = r * v + poly->coefficients[k];
+        out[i] = r;
+    }
+}
 
-    next_token(&s);
-    te_expr *root = list(&s);
 
-    if (s.type != TOK_END) {
-        te_free(root);
-        if (error) {
-            *error = (s.next - s.start);
-            if (*error == 0) *error = 1;
+static void cheb_block(const te_cheb *cheb, const double *x, double *out, int len) {
+    /* Clenshaw's recurrence across the whole block, in the same order as
+     * clenshaw() so both give the same results. x may be out. */
+    double t[TE_BLOCK], b1[TE_BLOCK], b2[TE_BLOCK];
+    int i, k;
+    for (i = 0; i < len; ++i) {
+        t[i] = (x[i] - cheb->center) * cheb->scale;
+        b1[i] = b2[i] = 0;
+    }
+    for (k = cheb->degree; k >= 1; --k) {
+        const double c = cheb->coefficients[k];
+        for (i = 0; i < len; ++i) {
+            const double b0 = 2 * t[i] * b1[i] - b2[i] + c;
+            b2[i] = b1[i];
+            b1[i] = b0;
+        }
+    }
+    for (i = 0; i < len; ++i) out[i] = t[i] * b1[i] - b2[i] + cheb->coefficients[0];
+}
+
+
+static const double *run_block(const program *p, const te_array *arrays, size_t row, const size_t *selection, int len) {
+    /* Evaluates rows [row, row+len), or rows selection[0..len) if selection
+     * is not null, and returns the block of results. Selected array values
+     * are gathered into the block first so every call still runs densely. */
+    const double **stack = p->stack;
+    int top = 0, k, i;
+
+    for (k = 0; k < p->count; ++k) {
+        const step *st = p->steps + k;
+        const double *values = st->kind == STEP_CONSTANT || st->kind == STEP_CALL ? 0 : arrays[st->column].values;
+        double *buf;
+        int arity;
+
+        switch (st->kind) {
+            case STEP_CONSTANT:
+                buf = p->scratch + top * TE_BLOCK;
+                for (i = 0; i < len; ++i) buf[i] = st->value;
+                stack[top++] = buf;
+                break;
+
+            case STEP_ARRAY:
+                if (selection) {
+                    buf = p->scratch + top * TE_BLOCK;
+                    for (i = 0; i < len; ++i) buf[i] = values[selection[i]];
+                    stack[top++] = buf;
+                } else {
+                    stack[top++] = values + row;
+                }
+                break;
+
+            case STEP_POLY:
+                buf = p->scratch + top * TE_BLOCK;
+                if (selection) poly_gather(st->context, values, selection, buf, len);
+                else poly_block(st->context, values + row, buf, len);
+                stack[top++] = buf;
+                break;
+
+            case STEP_CHEB:
+                buf = p->scratch + top * TE_BLOCK;
+                if (selection) {
+                    for (i = 0; i < len; ++i) buf[i] = values[selection[i]];
+                    cheb_block(st->context, buf, buf, len);
+                } else {
+                    cheb_block(st->context, values + row, buf, len);
+                }
+                stack[top++] = buf;
+                break;
+
+            case STEP_CALL:
+                arity = ARITY(st->type);
+                top -= arity;
+                buf = p->scratch + top * TE_BLOCK;
+                call_block(st, stack + top, buf, len);
+                stack[top++] = buf;
+                break;
+        }
+    }
+
+    return stack[0];
+}
+
+
+static void eval_rows(program *p, const te_array *arrays, const size_t *selection, size_t count, double *out) {
+    size_t row;
+    for (row = 0; row < count; row += TE_BLOCK) {
+        const int block = count - row < TE_BLOCK ? (int)(count - row) : TE_BLOCK;
+        const double *v = selection ? run_block(p, arrays, 0, selection + row, block) : run_block(p, arrays, row, 0, block);
+        memcpy(out + row, v, sizeof(double) * block);
+    }
+    COUNT(M_EVALUATIONS, count);
+}
+
+
+static size_t filter_rows(program *p, const te_array *arrays, const size_t *selection, size_t count, size_t *passed) {
+    size_t row, m = 0;
+    int i;
+
+    for (row = 0; row < count; row += TE_BLOCK) {
+        const int block = count - row < TE_BLOCK ? (int)(count - row) : TE_BLOCK;
+        const size_t *s = selection ? selection + row : 0;
+        const double *v = run_block(p, arrays, row, s, block);
+
+        /* Every row is written and only the passing ones are kept, so there
+         * is no branch to mispredict. m never passes row + i, which makes it
+         * safe for passed to be selection itself. */
+        if (s) {
+            for (i = 0; i < block; ++i) {
+                passed[m] = s[i];
+                m += v[i] != 0.0 && v[i] == v[i];
+            }
+        } else {
+            for (i = 0; i < block; ++i) {
+                passed[m] = row + i;
+                m += v[i] != 0.0 && v[i] == v[i];
+            }
+        }
+    }
+
+    COUNT(M_EVALUATIONS, count);
+    return m;
+}
+
+
+void te_eval_batch(const te_expr *n, const te_array *arrays, int array_count, size_t len, double *out) {
+    te_eval_select(n, arrays, array_count, 0, len, out);
+}
+
+
+void te_eval_select(const te_expr *n, const te_array *arrays, int array_count, const size_t *selection, size_t count, double *out) {
+    program p;
+    size_t row;
+
+    if (!n || !compile_program(&p, n, arrays, array_count)) {
+        for (row = 0; row < count; ++row) out[row] = NAN;
+        return;
+    }
+    eval_rows(&p, arrays, selection, count, out);
+    free_program(&p);
+}
+
+
+size_t te_filter(const te_expr *n, const te_array *arrays, int array_count, const size_t *selection, size_t count, size_t *passed) {
+    program p;
+    size_t m;
+
+    if (!n || !compile_program(&p, n, arrays, array_count)) return 0;
+    m = filter_rows(&p, arrays, selection, count, passed);
+    free_program(&p);
+    return m;
+}
+
+
+size_t te_mask_selection(const unsigned char *mask, size_t len, size_t *selection) {
+    size_t row, m = 0;
+    for (row = 0; row < len; ++row) {
+        selection[m] = row;
+        m += (mask[row >> 3] >> (row & 7)) & 1;
+    }
+    return m;
+}
+
+
+void te_reduce_init(te_reduction *r, double lo, double hi, int bins, size_t *histogram) {
+    r->rows = r->count = 0;
+    r->sum = 0.0;
+    r->min = INFINITY;
+    r->max = -INFINITY;
+    r->lo = lo;
+    r->hi = hi;
+    /* An empty or unbounded range has no bin width, so keeps no histogram. */
+    r->bins = histogram && lo < hi && isfinite(hi - lo) ? bins : 0;
+    r->histogram = histogram;
+    if (histogram && bins > 0) memset(histogram, 0, sizeof(size_t) * bins);
+}
+
+
+static void reduce_block(te_reduction *r, const double *v, int len) {
+    double sum = 0.0, min = r->min, max = r->max;
+    size_t count = 0;
+    int i;
+
+    for (i = 0; i < len; ++i) {
+        if (v[i] != v[i]) continue;
+        ++count;
+        sum += v[i];
+        if (v[i] < min) min = v[i];
+        if (v[i] > max) max = v[i];
+    }
+
+    if (r->bins > 0) {
+        const double scale = r->bins / (r->hi - r->lo);
+        for (i = 0; i < len; ++i) {
+            const double b = (v[i] - r->lo) * scale;
+            if (v[i] != v[i]) continue;
+            if (b < 1.0) ++r->histogram[0];
+            else if (b >= r->bins) ++r->histogram[r->bins - 1];
+            else ++r->histogram[(int)b];
         }
+    }
+
+    r->rows += len;
+    r->count += count;
+    r->sum += sum;
+    r->min = min;
+    r->max = max;
+}
+
+
+static void reduce_rows(program *p, const te_array *arrays, size_t first, size_t len, te_reduction *r) {
+    size_t row;
+    for (row = first; row < first + len; row += TE_BLOCK) {
+        const int block = first + len - row < TE_BLOCK ? (int)(first + len - row) : TE_BLOCK;
+        reduce_block(r, run_block(p, arrays, row, 0, block), block);
+    }
+    COUNT(M_EVALUATIONS, len);
+}
+
+
+void te_reduce(const te_expr *n, const te_array *arrays, int array_count, size_t len, te_reduction *r) {
+    program p;
+
+    if (!n || !compile_program(&p, n, arrays, array_count)) {
+        r->rows += len;
+        return;
+    }
+    reduce_rows(&p, arrays, 0, len, r);
+    free_program(&p);
+}
+
+
+struct te_batch {
+    program p;
+};
+
+
+te_batch *te_batch_new(const te_expr *n, const te_array *arrays, int array_count) {
+    te_batch *b;
+    if (!n) return 0;
+    b = malloc(sizeof(te_batch));
+    if (!b) return 0;
+    if (!compile_program(&b->p, n, arrays, array_count)) {
+        free(b);
         return 0;
-    } else {
-        optimize(root);
-        if (error) *error = 0;
-        return root;
     }
+    return b;
 }
 
 
-double te_interp(const char *expression, int *error) {
-    te_expr *n = te_compile(expression, 0, 0, error);
-    double ret;
-    if (n) {
-        ret = te_eval(n);
-        te_free(n);
-    } else {
-        ret = NAN;
+void te_batch_eval(te_batch *b, const te_array *arrays, const size_t *selection, size_t count, double *out) {
+    eval_rows(&b->p, arrays, selection, count, out);
+}
+
+
+size_t te_batch_filter(te_batch *b, const te_array *arrays, const size_t *selection, size_t count, size_t *passed) {
+    return filter_rows(&b->p, arrays, selection, count, passed);
+}
+
+
+void te_batch_reduce(te_batch *b, const te_array *arrays, size_t len, te_reduction *r) {
+    reduce_rows(&b->p, arrays, 0, len, r);
+}
+
+
+void te_batch_free(te_batch *b) {
+    if (!b) return;
+    free_program(&b->p);
+    free(b);
+}
+
+
+void te_reduce_merge(te_reduction *r, const te_reduction *other) {
+    int i;
+    r->rows += other->rows;
+    r->count += other->count;
+    r->sum += other->sum;
+    if (other->min < r->min) r->min = other->min;
+    if (other->max > r->max) r->max = other->max;
+    if (r->bins > 0 && r->bins == other->bins && r->histogram != other->histogram) {
+        for (i = 0; i < r->bins; ++i) r->histogram[i] += other->histogram[i];
     }
-    return ret;
 }
 
-static void pn (const te_expr *n, int depth) {
+
+/* te_reduce_parallel gives each thread one contiguous range of rows, and its
+ * own scratch space over the shared program. Once done with its range, thread
+ * t joins threads t+1, t+2, t+4, ... for as long as t is a multiple of twice
+ * the distance, and merges their results, so the partial results meet in a
+ * tree of depth log2(threads) while other threads are still reducing. */
+typedef struct reducer {
+    program p;
+    const te_array *arrays;
+    size_t first, len;
+    te_reduction r;
+    struct reducer *all;
+    int index, count;
+    int started;
+#ifdef TE_THREADS
+    thrd_t thread;
+#endif
+} reducer;
+
+
+static int reduce_range(void *arg) {
+    reducer *d = arg;
+    int gap;
+    reduce_rows(&d->p, d->arrays, d->first, d->len, &d->r);
+    for (gap = 1; d->index % (2 * gap) == 0 && d->index + gap < d->count; gap *= 2) {
+        reducer *other = d->all + d->index + gap;
+#ifdef TE_THREADS
+        if (other->started) thrd_join(other->thread, 0);
+        else reduce_range(other);
+#else
+        reduce_range(other);
+#endif
+        te_reduce_merge(&d->r, &other->r);
+    }
+    return 0;
+}
+
+
+void te_reduce_parallel(const te_expr *n, const te_array *arrays, int array_count, size_t len, te_reduction *r, int threads) {
+    const size_t blocks = (len + TE_BLOCK - 1) / TE_BLOCK;
+    const int bins = r->bins > 0 ? r->bins : 0;
+    reducer *all = 0;
+    size_t *histograms = 0;
+    program p;
+    int count, i;
+
+    if (threads > TE_MAX_THREADS) threads = TE_MAX_THREADS;
+    if ((size_t)threads > blocks) threads = (int)blocks;
+#ifndef TE_THREADS
+    threads = 1;
+#endif
+    if (threads <= 1) {
+        te_reduce(n, arrays, array_count, len, r);
+        return;
+    }
+
+    if (!n || !compile_program(&p, n, arrays, array_count)) {
+        r->rows += len;
+        return;
+    }
+
+    /* Falls back to fewer threads, down to the caller alone, if short of memory. */
+    all = malloc(sizeof(reducer) * threads);
+    if (all && bins) histograms = malloc(sizeof(size_t) * bins * (threads - 1));
+    if (!all || (bins && !histograms)) threads = 1;
+    for (count = 1; count < threads; ++count) {
+        all[count].p = p;
+        all[count].p.scratch = malloc(sizeof(double) * TE_BLOCK * p.depth + sizeof(double*) * p.depth);
+        if (!all[count].p.scratch) break;
+        all[count].p.stack = (const double**)(all[count].p.scratch + TE_BLOCK * p.depth);
+    }
+    if (threads == 1) {
+        reduce_rows(&p, arrays, 0, len, r);
+        free(all);
+        free_program(&p);
+        return;
+    }
+
+    for (i = 0; i < count; ++i) {
+        reducer *d = all + i;
+        d->arrays = arrays;
+        d->first = blocks * i / count * TE_BLOCK;
+        d->len = i + 1 < count ? blocks * (i + 1) / count * TE_BLOCK - d->first : len - d->first;
+        d->all = all;
+        d->index = i;
+        d->count = count;
+        d->started = 0;
+        if (i) te_reduce_init(&d->r, r->lo, r->hi, bins, bins ? histograms + (size_t)bins * (i - 1) : 0);
+    }
+    all[0].p = p;
+    all[0].r = *r;
+
+#ifdef TE_THREADS
+    /* Last first, so each thread's subtree has started, or is known not to
+     * have, by the time it may join it. */
+    for (i = count - 1; i > 0; --i) {
+        all[i].started = thrd_create(&all[i].thread, reduce_range, all + i) == thrd_success;
+    }
+#endif
+    reduce_range(all);
+    *r = all[0].r;
+
+    for (i = 1; i < count; ++i) free(all[i].p.scratch);
+    free(histograms);
+    free(all);
+    free_program(&p);
+}
+
+
+/* Interval evaluation bounds every value a tree can take while its variables
+ * range over a box. Bounds are rounded outward after each inexact step, so
+ * they contain whatever te_eval returns at any point of the box. NaN results
+ * are left out; a range whose bounds are NaN means every result is NaN. */
+
+typedef struct range {double lo, hi;} range;
+
+#define EMPTY(R) ((R).lo != (R).lo)
+#define PI 3.14159265358979323846
+
+static range make_range(double lo, double hi) {
+    range r;
+    r.lo = lo;
+    r.hi = hi;
+    return r;
+}
+
+static range whole(void) {return make_range(-INFINITY, INFINITY);}
+static range point(double v) {return make_range(v, v);}
+
+static range outward(range r, int ulps) {
+    /* NaN bounds, e.g. from inf - inf, widen to the whole line. */
+    if (r.lo != r.lo) r.lo = -INFINITY;
+    if (r.hi != r.hi) r.hi = INFINITY;
+    while (ulps--) {
+        r.lo = nextafter(r.lo, -INFINITY);
+        r.hi = nextafter(r.hi, INFINITY);
+    }
+    return r;
+}
+
+static range hull(const double *v, int count, int ulps) {
+    range r = make_range(INFINITY, -INFINITY);
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (v[i] != v[i]) return outward(whole(), 0);
+        if (v[i] < r.lo) r.lo = v[i];
+        if (v[i] > r.hi) r.hi = v[i];
+    }
+    return outward(r, ulps);
+}
+
+static range clamp(range r, double lo, double hi) {
+    if (r.lo < lo) r.lo = lo;
+    if (r.hi > hi) r.hi = hi;
+    return r;
+}
+
+static double product(double a, double b) {
+    /* 0 * inf counts as 0, the limit from inside the box. */
+    return (a == 0 || b == 0) ? 0 : a * b;
+}
+
+
+static range range_add(range a, range b) {return outward(make_range(a.lo + b.lo, a.hi + b.hi), 1);}
+static range range_sub(range a, range b) {return outward(make_range(a.lo - b.hi, a.hi - b.lo), 1);}
+static range range_negate(range a) {return make_range(-a.hi, -a.lo);}
+
+static range range_mul(range a, range b) {
+    const double v[] = {product(a.lo, b.lo), product(a.lo, b.hi), product(a.hi, b.lo), product(a.hi, b.hi)};
+    return hull(v, 4, 1);
+}
+
+static range range_divide(range a, range b) {
+    if (b.lo <= 0 && b.hi >= 0) return whole();
+    const double v[] = {a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi};
+    return hull(v, 4, 1);
+}
+
+static range range_fmod(range a, range b) {
+    /* The result has the sign of a and is smaller than |b|. fmod is exact. */
+    const double m = fmax(fabs(b.lo), fabs(b.hi));
+    return make_range(a.lo >= 0 ? 0 : fmax(a.lo, -m), a.hi <= 0 ? 0 : fmin(a.hi, m));
+}
+
+static range abs_range(range a) {
+    if (a.lo >= 0) return a;
+    if (a.hi <= 0) return make_range(fabs(a.hi), fabs(a.lo));
+    return make_range(0, fmax(-a.lo, a.hi));
+}
+
+static range increasing(double (*f)(double), range a, double lo, double hi, int ulps) {
+    /* f is nondecreasing on [lo, hi] and NaN outside it. */
+    if (a.hi < lo || a.lo > hi) return make_range(NAN, NAN);
+    return outward(make_range(f(fmax(a.lo, lo)), f(fmin(a.hi, hi))), ulps);
+}
+
+static range decreasing(double (*f)(double), range a, double lo, double hi, int ulps) {
+    if (a.hi < lo || a.lo > hi) return make_range(NAN, NAN);
+    return outward(make_range(f(fmin(a.hi, hi)), f(fmax(a.lo, lo))), ulps);
+}
+
+static int hits(range a, double phase, double period) {
+    /* Returns 1 if phase + k * period lies in a for some integer k.
+     * Points within rounding distance of a count as inside. */
+    const double k = floor((a.lo - phase) / period);
+    int i;
+    for (i = 0; i < 3; ++i) {
+        const double x = phase + (k + i) * period;
+        const double slack = 1e-12 * (1 + fabs(x));
+        if (x >= a.lo - slack && x <= a.hi + slack) return 1;
+    }
+    return 0;
+}
+
+static range periodic(double (*f)(double), range a, double peak) {
+    /* sin and cos: peak is where f reaches 1, f is -1 half a turn later. */
+    if (!(a.hi - a.lo < 2 * PI)) return make_range(-1, 1);
+    range r = outward(make_range(fmin(f(a.lo), f(a.hi)), fmax(f(a.lo), f(a.hi))), 1);
+    if (hits(a, peak, 2 * PI)) r.hi = 1;
+    if (hits(a, peak + PI, 2 * PI)) r.lo = -1;
+    return clamp(r, -1, 1);
+}
+
+static range range_tan(range a) {
+    if (!(a.hi - a.lo < PI) || hits(a, PI / 2, PI)) return whole();
+    return outward(make_range(tan(a.lo), tan(a.hi)), 1);
+}
+
+static range range_atan2(range y, range x) {
+    /* Away from the origin and the cut along negative x, atan2 over a box
+     * is extreme at a corner. */
+    if (x.lo <= 0 && y.lo <= 0 && y.hi >= 0) return outward(make_range(-PI, PI), 1);
+    const double v[] = {atan2(y.lo, x.lo), atan2(y.lo, x.hi), atan2(y.hi, x.lo), atan2(y.hi, x.hi)};
+    return hull(v, 4, 1);
+}
+
+static range range_pow(range a, range b) {
+    if (b.lo == 0 && b.hi == 0) return point(1);
+
+    /* -0 counts as negative: pow(-0, -1) is -inf. */
+    const int negative = signbit(a.lo);
+
+    if (b.lo == b.hi && b.lo == floor(b.lo) && isfinite(b.lo) && negative) {
+        /* Integer powers of a possibly negative base. */
+        const double k = b.lo;
+        const int odd = fmod(k, 2) != 0;
+        if (k > 0) {
+            if (odd) return outward(make_range(pow(a.lo, k), pow(a.hi, k)), 1);
+            const range m = abs_range(a);
+            return outward(make_range(pow(m.lo, k), pow(m.hi, k)), 1);
+        }
+        if (a.hi >= 0) {
+            if (odd) return whole();
+            return outward(make_range(pow(fmax(-a.lo, a.hi), k), INFINITY), 1);
+        }
+        if (odd) return outward(make_range(pow(a.hi, k), pow(a.lo, k)), 1);
+        return outward(make_range(pow(-a.lo, k), pow(-a.hi, k)), 1);
+    }
+
+    /* For a base of at least 0, pow is monotonic in each argument on either
+     * side of a = 1 and b = 0, so the corners and 1 bound it. */
+    const range m = abs_range(a);
+    const int one = (m.lo <= 1 && m.hi >= 1) || (b.lo <= 0 && b.hi >= 0);
+    const double v[] = {pow(m.lo, b.lo), pow(m.lo, b.hi), pow(m.hi, b.lo), pow(m.hi, b.hi), 1};
+    const range r = hull(v, one ? 5 : 4, 2);
+
+    /* A negative base only gives numbers for integer b, where |a^b| = |a|^b. */
+    if (negative) return make_range(-r.hi, r.hi);
+    return r;
+}
+
+static range range_gamma(double (*f)(double), range a, double minimum) {
+    /* tgamma and lgamma fall then rise on the positive axis. */
+    static const double turn = 1.4616321449683623;
+    if (!(a.lo > 0)) return whole();
+    if (a.hi <= turn) return decreasing(f, a, a.lo, a.hi, 16);
+    if (a.lo >= turn) return increasing(f, a, a.lo, a.hi, 16);
+    return outward(make_range(minimum, fmax(f(a.lo), f(a.hi))), 16);
+}
+
+static range range_ncr(range n, range r, int permutations) {
+    /* Both grow with n. ncr peaks at r = n/2 and npr grows with r. */
+    if (r.lo > n.hi || r.hi < 0 || n.hi < 0) return make_range(NAN, NAN);
+    const double top = floor(n.hi);
+    double k = floor(fmin(r.hi, top));
+    if (!permutations && k > floor(top / 2)) k = fmax(floor(top / 2), floor(fmax(r.lo, 0)));
+    const double hi = permutations ? npr(top, k) : ncr(top, k);
+    return make_range(1, hi * (1 + 1e-6));
+}
+
+
+static range bounds(const double *address, const te_interval *ranges, int range_count) {
+    int i;
+    for (i = 0; i < range_count; ++i) {
+        if (ranges[i].address == address) return make_range(ranges[i].lo, ranges[i].hi);
+    }
+    return point(*address);
+}
+
+
+static range range_table(const te_table *t, range a) {
+    /* Every cell stays between the values at its ends, for both kinds of
+     * interpolation, so the bounds are those of the grid values over the
+     * cells a covers, plus slack for rounding. */
+    const int last = t->count - 1;
+    range r;
+    int i, j;
+    double slack;
+
+    if (last < 1) return last == 0 ? point(t->y[0]) : make_range(NAN, NAN);
+    i = a.lo <= table_x(t, 0) ? 0 : a.lo >= table_x(t, last) ? last : table_cell(t, a.lo);
+    j = a.hi >= table_x(t, last) ? last : a.hi <= table_x(t, 0) ? 0 : table_cell(t, a.hi) + 1;
+    r = hull(t->y + i, j - i + 1, 0);
+    slack = 4e-16 * fmax(fabs(r.lo), fabs(r.hi));
+    return outward(make_range(r.lo - slack, r.hi + slack), 1);
+}
+
+
+static int known(const void *f) {
+    /* Returns 1 for the operators and builtins, which all give NaN for NaN. */
+    const te_variable *b;
+    if (f == add || f == sub || f == mul || f == divide || f == negate || f == fmod
+        || f == fma || f == fms || f == fnma) return 1;
+    for (b = functions; b->name; ++b) {
+        if (b->address == f) return 1;
+    }
+    return 0;
+}
+
+
+static range apply(const te_expr *n, const range *a) {
+    /* Bounds for the operators and builtins. Anything else is unknown. */
+    const void *f = n->function;
+    int i;
+
+    if (f == table_lookup) return EMPTY(a[0]) ? a[0] : range_table(n->parameters[1], a[0]);
+    if (IS_CLOSURE(n->type)) return whole();
+    if (f == comma) return a[1];
+    if (f == pow && (EMPTY(a[0]) || EMPTY(a[1]))) {
+        /* pow(NaN, 0) and pow(1, NaN) are both 1. */
+        const int one = EMPTY(a[0]) ? a[1].lo <= 0 && a[1].hi >= 0 : a[0].lo <= 1 && a[0].hi >= 1;
+        return one ? point(1) : make_range(NAN, NAN);
+    }
+    for (i = 0; i < ARITY(n->type); ++i) {
+        if (EMPTY(a[i])) return known(f) ? make_range(NAN, NAN) : whole();
+    }
+
+    switch (ARITY(n->type)) {
+        case 1:
+            if (f == negate) return range_negate(a[0]);
+            if (f == fabs) return abs_range(a[0]);
+            if (f == acos) return decreasing(acos, a[0], -1, 1, 1);
+            if (f == asin) return increasing(asin, a[0], -1, 1, 1);
+            if (f == atan) return increasing(atan, a[0], -INFINITY, INFINITY, 1);
+            if (f == ceil) return increasing(ceil, a[0], -INFINITY, INFINITY, 0);
+            if (f == cos) return periodic(cos, a[0], 0);
+            if (f == cosh) return increasing(cosh, abs_range(a[0]), 0, INFINITY, 1);
+            if (f == erf) return clamp(increasing(erf, a[0], -INFINITY, INFINITY, 2), -1, 1);
+            if (f == erfc) return clamp(decreasing(erfc, a[0], -INFINITY, INFINITY, 2), 0, 2);
+            if (f == exp) return clamp(increasing(exp, a[0], -INFINITY, INFINITY, 1), 0, INFINITY);
+            if (f == fac) return increasing(fac, a[0], 0, INFINITY, 0);
+            if (f == floor) return increasing(floor, a[0], -INFINITY, INFINITY, 0);
+            if (f == tgamma) return range_gamma(tgamma, a[0], 0.88560319441088870);
+            if (f == lgamma) return range_gamma(lgamma, a[0], -0.12148629053584961);
+            if (f == log) return increasing(log, a[0], 0, INFINITY, 1);
+            if (f == log10) return increasing(log10, a[0], 0, INFINITY, 1);
+            if (f == normcdf) return clamp(increasing(normcdf, a[0], -INFINITY, INFINITY, 2), 0, 1);
+            if (f == sin) return periodic(sin, a[0], PI / 2);
+            if (f == sinh) return increasing(sinh, a[0], -INFINITY, INFINITY, 1);
+            if (f == sqrt) return increasing(sqrt, a[0], 0, INFINITY, 0);
+            if (f == tan) return range_tan(a[0]);
+            if (f == tanh) return clamp(increasing(tanh, a[0], -INFINITY, INFINITY, 1), -1, 1);
+            break;
+
+        case 2:
+            if (f == add) return range_add(a[0], a[1]);
+            if (f == sub) return range_sub(a[0], a[1]);
+            if (f == mul) return range_mul(a[0], a[1]);
+            if (f == divide) return range_divide(a[0], a[1]);
+            if (f == fmod) return range_fmod(a[0], a[1]);
+            if (f == pow) return range_pow(a[0], a[1]);
+            if (f == atan2) return range_atan2(a[0], a[1]);
+            if (f == ncr) return range_ncr(a[0], a[1], 0);
+            if (f == npr) return range_ncr(a[0], a[1], 1);
+            break;
+
+        case 3:
+            if (f == fma) return range_add(range_mul(a[0], a[1]), a[2]);
+            if (f == fms) return range_sub(range_mul(a[0], a[1]), a[2]);
+            if (f == fnma) return range_sub(a[2], range_mul(a[0], a[1]));
+            break;
+    }
+
+    return whole();
+}
+
+
+static range range_cheb(const te_cheb *p, range x) {
+    /* T_k(cos u) = cos(k u), so each term is bounded by cos over k times the
+     * range of u = acos(t). Clenshaw's rounding error, and t rounding just
+     * past the ends of [-1, 1], are covered by slack in the sum of |c_k|. */
+    const range t = range_mul(range_sub(x, point(p->center)), point(p->scale));
+    const double past = fmax(fmax(-1 - t.lo, t.hi - 1), 0);
+    range u, r = point(p->coefficients[0]);
+    double size = fabs(p->coefficients[0]);
+    int k;
+
+    if (EMPTY(t)) return t;
+    if (past > 1e-12) return whole();
+    u = outward(make_range(acos(fmin(t.hi, 1)), acos(fmax(t.lo, -1))), 2);
+    for (k = 1; k <= p->degree; ++k) {
+        const range ku = outward(make_range(k * u.lo, k * u.hi), 1);
+        r = range_add(r, range_mul(point(p->coefficients[k]), clamp(periodic(cos, ku, 0), -1, 1)));
+        size += fabs(p->coefficients[k]);
+    }
+    size *= (p->degree + 1.0) * (p->degree + 1.0) * (1e-15 + past);
+    return outward(make_range(r.lo - size, r.hi + size), 1);
+}
+
+
+static range interval(const te_expr *n, const te_interval *ranges, int range_count) {
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return point(n->value);
+        case TE_VARIABLE: return bounds(n->bound, ranges, range_count);
+
+        case TE_POLY: {
+            const te_poly *p = (const te_poly*)n;
+            const range x = bounds(n->bound, ranges, range_count);
+            range r = point(p->coefficients[p->degree]);
+            int k;
+            for (k = p->degree - 1; k >= 0; --k) {
+                r = range_add(range_mul(r, x), point(p->coefficients[k]));
+            }
+            return r;
+        }
+
+        case TE_CHEB: return range_cheb((const te_cheb*)n, bounds(n->bound, ranges, range_count));
+
+        default: {
+            const int arity = ARITY(n->type);
+            range a[7];
+            double v[7];
+            int i, points = 1;
+            for (i = 0; i < arity; ++i) {
+                a[i] = interval(n->parameters[i], ranges, range_count);
+                v[i] = a[i].lo;
+                if (a[i].lo != a[i].hi) points = 0;
+            }
+            if (points && IS_PURE(n->type)) {
+                /* Every argument is known, so the result is too. */
+                const double r = call(n->type, n->function, IS_CLOSURE(n->type) ? n->parameters[arity] : 0, v);
+                return point(r);
+            }
+            return apply(n, a);
+        }
+    }
+}
+
+
+void te_eval_interval(const te_expr *n, const te_interval *ranges, int range_count, double *lo, double *hi) {
+    const range r = interval(n, ranges, range_count);
+    *lo = r.lo;
+    *hi = r.hi;
+}
+
+
+static int varying(const te_expr *n, const te_array *arrays, int array_count) {
+    /* Returns 1 if n must be evaluated for every row of a batch. */
+    int i;
+    if (TYPE_MASK(n->type) == TE_VARIABLE || TYPE_MASK(n->type) == TE_POLY || TYPE_MASK(n->type) == TE_CHEB) {
+        return find_column(arrays, array_count, n->bound) >= 0;
+    }
+    if ((IS_FUNCTION(n->type) || IS_CLOSURE(n->type)) && !IS_PURE(n->type)) return 1;
+    for (i = 0; i < ARITY(n->type); ++i) {
+        if (varying(n->parameters[i], arrays, array_count)) return 1;
+    }
+    return 0;
+}
+
+
+int te_get_metrics(te_metrics *m) {
+    memset(m, 0, sizeof(te_metrics));
+#ifdef TE_METRICS
+    const counters *c;
+    int i;
+    for (c = atomic_load(&all_counters); c; c = c->next) {
+        unsigned long long v[M_COUNT];
+        for (i = 0; i < M_COUNT; ++i) v[i] = atomic_load_explicit(&c->value[i], memory_order_relaxed);
+        m->compiles += v[M_COMPILES];
+        m->compile_failures += v[M_FAILURES];
+        m->nodes_allocated += v[M_NODES_ALLOCATED];
+        m->nodes_freed += v[M_NODES_FREED];
+        m->bytes_allocated += v[M_BYTES_ALLOCATED];
+        m->bytes_freed += v[M_BYTES_FREED];
+        m->evaluations += v[M_EVALUATIONS];
+        m->fold_attempts += v[M_FOLD_ATTEMPTS];
+        m->folds += v[M_FOLDS];
+        for (i = 0; i < TE_METRICS_BUCKETS; ++i) m->compile_latency[i] += v[M_LATENCY + i];
+    }
+    m->bytes_live = m->bytes_allocated - m->bytes_freed;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+static void pn (const te_expr *n, int depth, const te_array *arrays, int array_count, int hoisted) {
     int i, arity;
     printf("%*s", depth, "");
 
     switch(TYPE_MASK(n->type)) {
     case TE_CONSTANT: printf("%f\n", n->value); break;
     case TE_VARIABLE: printf("bound %p\n", n->bound); break;
+    case TE_POLY: printf("poly%d bound %p\n", ((const te_poly*)n)->degree, n->bound); break;
+    case TE_CHEB: printf("cheb%d bound %p\n", ((const te_cheb*)n)->degree, n->bound); break;
 
     case TE_FUNCTION0: case TE_FUNCTION1: case TE_FUNCTION2: case TE_FUNCTION3:
     case TE_FUNCTION4: case TE_FUNCTION5: case TE_FUNCTION6: case TE_FUNCTION7:
@@ -640,9 +3862,13 @@ static void pn (const te_expr *n, int depth) {
          for(i = 0; i < arity; i++) {
              printf(" %p", n->parameters[i]);
          }
+         if (!hoisted && !varying(n, arrays, array_count)) {
+             printf(" hoisted");
+             hoisted = 1;
+         }
          printf("\n");
          for(i = 0; i < arity; i++) {
-             pn(n->parameters[i], depth + 1);
+             pn(n->parameters[i], depth + 1, arrays, array_count, hoisted);
          }
          break;
     }
@@ -650,5 +3876,10 @@ static void pn (const te_expr *n, int depth) {
 
 
 void te_print(const te_expr *n) {
-    pn(n, 0);
+    pn(n, 0, 0, 0, 1);
+}
+
+
+void te_print_batch(const te_expr *n, const te_array *arrays, int array_count) {
+    pn(n, 0, arrays, array_count, 0);
 }
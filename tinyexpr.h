@@ -25,6 +25,7 @@
 #ifndef TINYEXPR_H
 #define TINYEXPR_H
 
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -48,9 +49,18 @@ enum {
     TE_CLOSURE0 = 16, TE_CLOSURE1, TE_CLOSURE2, TE_CLOSURE3,
     TE_CLOSURE4, TE_CLOSURE5, TE_CLOSURE6, TE_CLOSURE7,
 
+    TE_TABLE = 24,
+
     TE_FLAG_PURE = 32
 };
 
+enum {
+    TE_OPT_STRICT = 0,
+    TE_OPT_FMA = 1,
+    TE_OPT_POLY = 2,
+    TE_OPT_REASSOC = 4
+};
+
 typedef struct te_variable {
     const char *name;
     const void *address;
@@ -58,26 +68,303 @@ typedef struct te_variable {
     void *context;
 } te_variable;
 
+enum {
+    TE_TABLE_LINEAR = 0,
+    TE_TABLE_CUBIC = 1
+};
+
+/* A function of one variable given by its values y[i] at count ascending */
+/* grid points x[i], bound with type TE_TABLE and the table's address. */
+/* With x NULL the grid is uniform, x[i] = start + i*step with step > 0. */
+typedef struct te_table {
+    const double *x;
+    const double *y;
+    int count;
+    int interpolation;
+    double start, step;
+} te_table;
+
+/* Windows of the stateful builtins (ema, delay, rsum, ...) for one stream. */
+typedef struct te_state te_state;
+
+/* Reads up to size bytes of an expression into buffer for te_compile_stream. */
+/* Returns the number of bytes read, 0 at the end, or (size_t)-1 on failure. */
+typedef size_t (*te_source)(void *context, char *buffer, size_t size);
+
+/* An expression parsed once, to be compiled against many bindings with te_bind. */
+typedef struct te_template te_template;
+
+/* A compiled expression that can be replaced while other threads evaluate it, */
+/* and one thread's registration for reading it. */
+typedef struct te_handle te_handle;
+typedef struct te_reader te_reader;
+
+typedef struct te_array {
+    const double *address;
+    const double *values;
+} te_array;
+
+/* An expression prepared once for many calls of batch evaluation. */
+typedef struct te_batch te_batch;
+
+#define TE_METRICS_BUCKETS 32
+
+typedef struct te_metrics {
+    unsigned long long compiles, compile_failures;
+    unsigned long long nodes_allocated, nodes_freed;
+    unsigned long long bytes_allocated, bytes_freed, bytes_live;
+    unsigned long long evaluations;
+    unsigned long long fold_attempts, folds;
+    unsigned long long compile_latency[TE_METRICS_BUCKETS];
+} te_metrics;
+
+typedef struct te_interval {
+    const double *address;
+    double lo, hi;
+} te_interval;
 
+typedef struct te_reduction {
+    size_t rows, count;
+    double sum, min, max;
+    double lo, hi;
+    int bins;
+    size_t *histogram;
+} te_reduction;
 
-/* Parses the input expression, evaluates it, and frees it. */
+
+/* Parses the input expression and evaluates it as it goes, without allocating. */
 /* Returns NaN on error. */
 double te_interp(const char *expression, int *error);
 
+/* Checks the syntax of the input expression without compiling it. */
+/* Returns 1 if te_compile would succeed, otherwise 0 with *error set as by te_compile. */
+/* Nothing is allocated and no function or variable is called or read. */
+int te_validate(const char *expression, const te_variable *variables, int var_count, int *error);
+
 /* Parses the input expression and binds variables. */
 /* Returns NULL on error. */
 te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error);
 
+/* Like te_compile, with optimizations selected by flags (TE_OPT_*). */
+/* TE_OPT_STRICT keeps results bitwise identical to te_compile. */
+/* TE_OPT_FMA fuses multiply-add/subtract into fma(), rounding once instead of twice. */
+/* TE_OPT_POLY evaluates sums of powers of one variable with Horner's rule. */
+/* TE_OPT_REASSOC rebalances long chains of + and - or of * and folds their constants. */
+te_expr *te_compile_ex(const char *expression, const te_variable *variables, int var_count, int flags, int *error);
+
+/* Like te_compile_ex, reading the expression from source in chunks instead of */
+/* from a string. Tokens are limited to 1024 bytes, which bounds the buffering. */
+/* *error, if not NULL, receives 0 on success or the byte offset of the error, */
+/* also reported where a read failed or a NUL byte was met. */
+te_expr *te_compile_stream(te_source source, void *context, const te_variable *variables, int var_count, int flags, size_t *error);
+
+/* A te_source reading from the FILE* passed as context. */
+size_t te_read_file(void *file, char *buffer, size_t size);
+
+/* Parses the expression into a template without binding any name. Syntax */
+/* errors are only reported by te_bind. Returns NULL if out of memory. */
+te_template *te_template_new(const char *expression);
+
+/* Compiles the template against variables, with the same result and error as */
+/* te_compile_ex on its text. Each name is looked up once and nothing is parsed. */
+te_expr *te_bind(const te_template *t, const te_variable *variables, int var_count, int flags, int *error);
+
+/* Frees the template. This is safe to call on NULL pointers. */
+void te_template_free(te_template *t);
+
+/* Compiles count expressions like te_compile_ex, against the same variables, */
+/* on up to threads threads including the calling one. Names are looked up in */
+/* one sorted copy of variables shared by all threads, and each thread builds */
+/* trees in its own arena. out[i] receives expression i compiled, or NULL, and */
+/* errors[i], unless errors is NULL, the error te_compile would report. */
+/* Without C11 threads everything is compiled on the calling thread. */
+/* Returns the number of expressions compiled. */
+size_t te_compile_bulk(const char **expressions, size_t count, const te_variable *variables, int var_count, int flags, int threads, te_expr **out, int *errors);
+
+/* Returns a new compiled copy of the expression with each variable listed in */
+/* known replaced by its current value, then folded again. */
+/* The original expression is unchanged. Returns NULL if n is NULL. */
+/* Rewrites already in n are kept, but no TE_OPT_* pass is run again, so */
+/* one that only applies once values are known is missed. */
+te_expr *te_specialize(const te_expr *n, const te_variable *known, int known_count);
+
+/* Like te_specialize, then runs the passes selected by flags (TE_OPT_*), */
+/* normally the flags n was compiled with. */
+te_expr *te_specialize_ex(const te_expr *n, const te_variable *known, int known_count, int flags);
+
+/* Returns a new compiled copy of the expression in which each pure subtree */
+/* of a single variable listed in domains, and calling something other than */
+/* + - * /, is replaced by a Chebyshev series of degree at most 64 over the */
+/* variable's [lo, hi], if one is found within tolerance of it there. */
+/* Outside [lo, hi] a replaced subtree is extrapolated and may be far off. */
+/* *max_error, if not NULL, receives the largest difference measured on a */
+/* grid over the domain, or 0 if nothing was replaced. */
+te_expr *te_approximate(const te_expr *n, const te_interval *domains, int domain_count, double tolerance, double *max_error);
+
+/* Writes to indices, in ascending order, the position in variables of each */
+/* variable, function or closure the compiled expression still references */
+/* after optimization. indices must have room for var_count entries. */
+/* Returns the number of indices written. */
+int te_dependencies(const te_expr *n, const te_variable *variables, int var_count, int *indices);
+
+/* Estimates the cycles one te_eval() of the compiled expression takes, */
+/* summing the cost table over its nodes. Returns 0 if n is NULL. */
+double te_cost(const te_expr *n);
+
+/* Sets the cost table entry for an operator ("+", "-", "*", "/", "^", "%", */
+/* ",", "negate"), a builtin, or one of "constant", "variable", "call" (per */
+/* call node), "function" (bound functions and closures), "table", and */
+/* "poly" and "cheb" (per degree). Not thread-safe; set costs before use. */
+/* Returns 0 if the name is unknown. */
+int te_set_cost(const char *name, double cycles);
+
+/* Returns the cost table entry for name, or NaN if the name is unknown. */
+double te_get_cost(const char *name);
+
 /* Evaluates the expression. */
 double te_eval(const te_expr *n);
 
+/* Evaluates the expression, passing context to every closure that was bound */
+/* with a NULL context. One compiled expression can then be shared by threads */
+/* that each need their own context. */
+double te_eval_ctx(const te_expr *n, void *context);
+
+/* Creates the state one stream needs to evaluate n with te_eval_state: a */
+/* window for every call to ema, delay, rsum, rstd, rmax and rmin. Window */
+/* sizes are read from their second argument now. Returns NULL if out of memory. */
+te_state *te_state_new(const te_expr *n);
+
+/* Returns an independent copy of the state, e.g. to fork a stream. */
+te_state *te_state_clone(const te_state *state);
+
+/* Empties every window, as if no event had been seen. */
+void te_state_reset(te_state *state);
+
+/* Frees the state. This is safe to call on NULL pointers. */
+void te_state_free(te_state *state);
+
+/* Evaluates the expression for the next event of the stream state follows. */
+/* The stateful builtins return NaN when evaluated any other way. */
+double te_eval_state(const te_expr *n, te_state *state);
+
+/* Takes ownership of n, which may be NULL, and returns a handle to it, or NULL */
+/* if out of memory. Handles need tinyexpr.c built as C11 with atomics. */
+/* Otherwise te_handle_new and te_reader_new always return NULL, and */
+/* te_handle_swap frees the replacement and returns -1. */
+te_handle *te_handle_new(te_expr *n);
+
+/* Makes replacement, which may be NULL, the handle's expression and takes */
+/* ownership of it. The previous one is freed once no reader can still be using */
+/* it, by this or a later swap or collect. Writers may run on any thread. */
+/* Returns the number of replaced expressions not freed yet. */
+int te_handle_swap(te_handle *h, te_expr *replacement);
+
+/* Frees the replaced expressions no reader can still be using. */
+/* Returns the number of replaced expressions not freed yet. */
+int te_handle_collect(te_handle *h);
+
+/* Frees the handle, its expression and its readers. No thread may still be */
+/* reading it. This is safe to call on NULL pointers. */
+void te_handle_free(te_handle *h);
+
+/* Registers a thread that reads h. Each reader is used by one thread at a time. */
+/* Returns NULL if out of memory. */
+te_reader *te_reader_new(te_handle *h);
+
+/* Unregisters the reader, whose record is reused by the next te_reader_new(). */
+void te_reader_free(te_reader *r);
+
+/* Returns the handle's current expression, which stays valid until te_read_end(), */
+/* even if it is swapped meanwhile. Neither call waits or allocates. */
+const te_expr *te_read_begin(te_reader *r);
+void te_read_end(te_reader *r);
+
+/* Evaluates the handle's current expression between te_read_begin and te_read_end. */
+double te_read_eval(te_reader *r);
+
+/* Evaluates the expression for len rows, writing one result per row to out. */
+/* Variables whose address appears in arrays take values[i] on row i, */
+/* all other variables keep their current value for the whole call, and pure */
+/* branches that only depend on them are evaluated once per call. */
+void te_eval_batch(const te_expr *n, const te_array *arrays, int array_count, size_t len, double *out);
+
+/* Like te_eval_batch for only the count rows listed in selection, in any order. */
+/* out[k] receives the result of row selection[k]. A NULL selection means */
+/* rows 0 to count-1. */
+void te_eval_select(const te_expr *n, const te_array *arrays, int array_count, const size_t *selection, size_t count, double *out);
+
+/* Evaluates a condition on the rows listed in selection, or on rows 0 to */
+/* count-1 if selection is NULL, and writes to passed, in order, each row */
+/* whose result is neither zero nor NaN. passed may be selection itself. */
+/* Rows are stored without branching, so passed must have room for count */
+/* entries even when fewer pass. Returns the number of rows written. */
+size_t te_filter(const te_expr *n, const te_array *arrays, int array_count, const size_t *selection, size_t count, size_t *passed);
+
+/* Writes to selection the index of each of the len rows whose bit is set in */
+/* mask, bit i%8 of mask[i/8] standing for row i. selection must have room */
+/* for len entries, however many bits are set. */
+/* Returns the number of indices written. */
+size_t te_mask_selection(const unsigned char *mask, size_t len, size_t *selection);
+
+/* Prepares a reduction, with an optional histogram of bins buckets over [lo, hi). */
+/* Values below lo count towards the first bin and values from hi up towards */
+/* the last. No histogram is kept unless lo < hi and both are finite. */
+void te_reduce_init(te_reduction *r, double lo, double hi, int bins, size_t *histogram);
+
+/* Evaluates len rows like te_eval_batch and accumulates them into r. */
+/* Nothing is written per row. NaN results only count towards r->rows. */
+void te_reduce(const te_expr *n, const te_array *arrays, int array_count, size_t len, te_reduction *r);
+
+/* Combines two reductions of disjoint rows, e.g. computed on separate threads. */
+void te_reduce_merge(te_reduction *r, const te_reduction *other);
+
+/* Like te_reduce, with the rows split over up to threads threads, the calling */
+/* one included, whose partial results are merged in a tree. Functions the */
+/* expression calls run on several threads at once, and the sum may round */
+/* differently from te_reduce. Without C11 threads this is te_reduce. */
+void te_reduce_parallel(const te_expr *n, const te_array *arrays, int array_count, size_t len, te_reduction *r, int threads);
+
+/* Prepares n for batch evaluation against arrays, so that many small batches */
+/* do not each rebuild the evaluation program. Later calls must pass arrays */
+/* bound to the same addresses in the same order, but may point them at other */
+/* values. Variables not in arrays, and pure branches that only depend on */
+/* them, are read here once for all calls. Returns NULL if n is NULL or out */
+/* of memory. A batch is used by one thread at a time and must not outlive n. */
+te_batch *te_batch_new(const te_expr *n, const te_array *arrays, int array_count);
+
+/* Like te_eval_select, te_filter and te_reduce, with a prepared batch. */
+void te_batch_eval(te_batch *b, const te_array *arrays, const size_t *selection, size_t count, double *out);
+size_t te_batch_filter(te_batch *b, const te_array *arrays, const size_t *selection, size_t count, size_t *passed);
+void te_batch_reduce(te_batch *b, const te_array *arrays, size_t len, te_reduction *r);
+
+/* Frees the batch. This is safe to call on NULL pointers. */
+void te_batch_free(te_batch *b);
+
+/* Sets [*lo, *hi] to bounds on every value the expression takes while each */
+/* variable whose address appears in ranges stays within its [lo, hi]. */
+/* Other variables keep their current value. NaN results are not counted, */
+/* and both bounds are NaN if every result would be NaN. */
+void te_eval_interval(const te_expr *n, const te_interval *ranges, int range_count, double *lo, double *hi);
+
+/* Fills m with counters summed over all threads. */
+/* compile_latency[i] counts compiles that took under 2^(i+1) ns. */
+/* Returns 0, with m zeroed, unless tinyexpr.c was built with TE_METRICS. */
+int te_get_metrics(te_metrics *m);
+
 /* Prints debugging information on the syntax tree. */
 void te_print(const te_expr *n);
 
+/* Like te_print, also marking the branches te_eval_batch evaluates only once */
+/* per call because they do not depend on any of the arrays. */
+void te_print_batch(const te_expr *n, const te_array *arrays, int array_count);
+
 /* Frees the expression. */
 /* This is safe to call on NULL pointers. */
 void te_free(te_expr *n);
 
+/* Returns the number of bytes held by the compiled expression. */
+size_t te_memory_usage(const te_expr *n);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,455 @@
+/*
+ * TINYEXPR - Tiny recursive descent parser and evaluation engine in C
+ *
+ * Copyright (c) 2015-2020 Lewis Van Winkle
+ *
+ * http://CodePlea.com
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software
+ * in a product, an acknowledgement in the product documentation would be
+ * appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef TINYEXPR_HPP
+#define TINYEXPR_HPP
+
+/* Header-only C++17 wrapper around tinyexpr.h. Link with tinyexpr.c as usual.
+ * The std::span overloads are only available when compiling as C++20. */
+
+#include "tinyexpr.h"
+
+#include <cstddef>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#define TE_HAVE_SPAN 1
+#endif
+#endif
+
+
+namespace te {
+
+/* Thrown when an expression fails to compile. */
+class Error : public std::runtime_error {
+public:
+    Error(int position)
+        : std::runtime_error("tinyexpr: parse error at position " + std::to_string(position)),
+          position_(position) {}
+
+    /* Same as the error position reported by te_compile. */
+    int position() const noexcept { return position_; }
+
+private:
+    int position_;
+};
+
+
+namespace detail {
+
+template<std::size_t> using dbl = double;
+
+/* Number of arguments of a function pointer or of a lambda's call operator. */
+template<class F> struct arity : arity<decltype(&F::operator())> {};
+template<class R, class... A> struct arity<R (*)(A...)> : std::integral_constant<int, sizeof...(A)> {};
+template<class C, class R, class... A> struct arity<R (C::*)(A...)> : std::integral_constant<int, sizeof...(A)> {};
+template<class C, class R, class... A> struct arity<R (C::*)(A...) const> : std::integral_constant<int, sizeof...(A)> {};
+
+template<class F, class... A>
+double trampoline(void *context, A... a) {
+    return (*static_cast<F*>(context))(a...);
+}
+
+/* Plain function pointer type taking N doubles. */
+template<class I> struct plain;
+template<std::size_t... I> struct plain<std::index_sequence<I...>> {
+    typedef double (*type)(dbl<I>...);
+};
+
+template<class F, std::size_t... I>
+const void *closure(std::index_sequence<I...>) {
+    double (*f)(void*, dbl<I>...) = &trampoline<F, dbl<I>...>;
+    return reinterpret_cast<const void*>(f);
+}
+
+} /* namespace detail */
+
+
+/* A binding table for te_compile. Variables, struct members and functions are
+ * bound by address, so everything passed in must outlive every Expression
+ * compiled against the table. Function objects passed as rvalues are the only
+ * thing the table stores itself. */
+class Bindings {
+public:
+    Bindings() = default;
+    Bindings(const Bindings&) = delete;
+    Bindings &operator=(const Bindings&) = delete;
+    Bindings(Bindings&&) = default;
+    Bindings &operator=(Bindings&&) = default;
+
+    Bindings &variable(const char *name, const double &x) {
+        table_.push_back(te_variable{name, &x, TE_VARIABLE, nullptr});
+        inputs_.push_back(&x);
+        return *this;
+    }
+
+    template<class T>
+    Bindings &member(const char *name, const T &object, double T::*field) {
+        return variable(name, object.*field);
+    }
+
+    /* Temporaries would be gone before the first evaluation. */
+    Bindings &variable(const char *name, const double &&x) = delete;
+    template<class T>
+    Bindings &member(const char *name, const T &&object, double T::*field) = delete;
+
+    /* Binds a tabulated function of one argument. The table and its arrays
+     * are read at every call, not copied. */
+    Bindings &table(const char *name, const te_table &t) {
+        table_.push_back(te_variable{name, &t, TE_TABLE, nullptr});
+        return *this;
+    }
+    Bindings &table(const char *name, const te_table &&t) = delete;
+
+    /* Binds a function of up to seven doubles. Function pointers and lambdas
+     * without captures become plain functions. Other function objects become
+     * closures whose context points at the object, or at a copy owned by the
+     * table if an rvalue was passed. */
+    template<class F>
+    Bindings &function(const char *name, F &&f) {
+        return bind(name, std::forward<F>(f), 0);
+    }
+
+    /* Like function, for functions without side effects. Calls whose arguments
+     * are all constant are folded at compile time. */
+    template<class F>
+    Bindings &pure_function(const char *name, F &&f) {
+        return bind(name, std::forward<F>(f), TE_FLAG_PURE);
+    }
+
+    const te_variable *data() const noexcept { return table_.data(); }
+    int size() const noexcept { return static_cast<int>(table_.size()); }
+
+    /* Addresses of the bound variables, in the order they were added. */
+    const std::vector<const double*> &inputs() const noexcept { return inputs_; }
+
+private:
+    template<class F>
+    Bindings &bind(const char *name, F &&f, int flags) {
+        typedef typename std::decay<F>::type D;
+        constexpr int n = detail::arity<D>::value;
+        static_assert(n <= 7, "tinyexpr functions take at most seven arguments");
+        typedef std::make_index_sequence<n> seq;
+        typedef typename detail::plain<seq>::type plain;
+
+        if constexpr (std::is_convertible<D, plain>::value) {
+            const plain p = f;
+            table_.push_back(te_variable{name, reinterpret_cast<const void*>(p), (TE_FUNCTION0 + n) | flags, nullptr});
+        } else {
+            void *context;
+            if constexpr (std::is_lvalue_reference<F>::value) {
+                context = const_cast<void*>(static_cast<const void*>(&f));
+            } else {
+                D *copy = new D(std::forward<F>(f));
+                owned_.emplace_back(copy, [](void *p) { delete static_cast<D*>(p); });
+                context = copy;
+            }
+            table_.push_back(te_variable{name, detail::closure<D>(seq()), (TE_CLOSURE0 + n) | flags, context});
+        }
+        return *this;
+    }
+
+    std::vector<te_variable> table_;
+    std::vector<const double*> inputs_;
+    std::vector<std::unique_ptr<void, void (*)(void*)>> owned_;
+};
+
+
+class State;
+
+
+/* A compiled expression. Move-only; the tree is freed with te_free. */
+class Expression {
+public:
+    Expression() noexcept = default;
+
+    explicit Expression(const char *text, const Bindings &bindings = Bindings(), int flags = TE_OPT_STRICT)
+        : inputs_(bindings.inputs()) {
+        int error;
+        n_ = te_compile_ex(text, bindings.data(), bindings.size(), flags, &error);
+        if (!n_) {
+            if (error) throw Error(error);
+            throw std::bad_alloc();
+        }
+    }
+
+    explicit Expression(const std::string &text, const Bindings &bindings = Bindings(), int flags = TE_OPT_STRICT)
+        : Expression(text.c_str(), bindings, flags) {}
+
+    Expression(const Expression&) = delete;
+    Expression &operator=(const Expression&) = delete;
+
+    Expression(Expression &&other) noexcept
+        : n_(std::exchange(other.n_, nullptr)), inputs_(std::move(other.inputs_)) {}
+
+    Expression &operator=(Expression &&other) noexcept {
+        if (this != &other) {
+            te_free(n_);
+            n_ = std::exchange(other.n_, nullptr);
+            inputs_ = std::move(other.inputs_);
+        }
+        return *this;
+    }
+
+    ~Expression() { te_free(n_); }
+
+    explicit operator bool() const noexcept { return n_ != nullptr; }
+    const te_expr *get() const noexcept { return n_; }
+
+    /* Gives up ownership of the tree, leaving the expression empty. */
+    te_expr *release() noexcept {
+        inputs_.clear();
+        return std::exchange(n_, nullptr);
+    }
+
+    double operator()() const { return te_eval(n_); }
+
+    /* Passes context to every closure bound with a null context. */
+    double operator()(void *context) const { return te_eval_ctx(n_, context); }
+
+    /* Evaluates the next event of the stream whose windows are in state. */
+    double operator()(State &state) const;
+
+    /* Evaluates len rows with te_eval_batch. columns[i] holds the values of the
+     * i-th variable of the bindings, remaining variables keep their value. */
+    void eval(double *out, std::size_t len, std::initializer_list<const double*> columns) const {
+        if (columns.size() > inputs_.size()) throw std::invalid_argument("tinyexpr: more columns than variables");
+        te_array arrays[8];
+        std::vector<te_array> many;
+        te_array *a = arrays;
+        if (columns.size() > 8) {
+            many.resize(columns.size());
+            a = many.data();
+        }
+        std::size_t i = 0;
+        for (const double *c : columns) {
+            a[i] = te_array{inputs_[i], c};
+            ++i;
+        }
+        te_eval_batch(n_, a, static_cast<int>(columns.size()), len, out);
+    }
+
+#ifdef TE_HAVE_SPAN
+    /* Evaluates out.size() rows, binding each column to the variables in the
+     * order they were added to the bindings. */
+    template<class... C>
+    void eval(std::span<double> out, const C &...columns) const {
+        const std::span<const double> spans[] = {std::span<const double>(columns)..., {}};
+        for (std::size_t i = 0; i < sizeof...(C); ++i) {
+            if (spans[i].size() < out.size()) throw std::invalid_argument("tinyexpr: column shorter than output");
+        }
+        eval(out.data(), out.size(), {std::span<const double>(columns).data()...});
+    }
+#endif
+
+    /* Returns a copy with the variables of known replaced by their current
+     * value, then rewritten by the passes in flags, as te_specialize_ex. */
+    Expression specialize(const Bindings &known, int flags = TE_OPT_STRICT) const {
+        te_expr *s = te_specialize_ex(n_, known.data(), known.size(), flags);
+        if (!s && n_) throw std::bad_alloc();
+        return Expression(s, inputs_);
+    }
+
+    /* Returns a copy with costly subtrees of one variable replaced by
+     * Chebyshev series over that variable's domain, see te_approximate. */
+    Expression approximate(std::initializer_list<te_interval> domains, double tolerance, double *max_error = nullptr) const {
+        te_expr *a = te_approximate(n_, domains.begin(), static_cast<int>(domains.size()), tolerance, max_error);
+        if (!a && n_) throw std::bad_alloc();
+        return Expression(a, inputs_);
+    }
+
+    /* Indices into bindings of everything the expression still references. */
+    std::vector<int> dependencies(const Bindings &bindings) const {
+        std::vector<int> indices(bindings.size());
+        indices.resize(te_dependencies(n_, bindings.data(), bindings.size(), indices.data()));
+        return indices;
+    }
+
+    std::size_t memory_usage() const noexcept { return te_memory_usage(n_); }
+
+    /* Estimated cycles per evaluation, see te_cost. */
+    double cost() const noexcept { return te_cost(n_); }
+
+private:
+    friend class Template;
+
+    Expression(te_expr *n, std::vector<const double*> inputs) noexcept
+        : n_(n), inputs_(std::move(inputs)) {}
+
+    te_expr *n_ = nullptr;
+    std::vector<const double*> inputs_;
+};
+
+
+/* An expression parsed once, to be compiled against many Bindings. Move-only. */
+class Template {
+public:
+    explicit Template(const char *text) : t_(te_template_new(text)) {
+        if (!t_) throw std::bad_alloc();
+    }
+
+    explicit Template(const std::string &text) : Template(text.c_str()) {}
+
+    Template(const Template&) = delete;
+    Template &operator=(const Template&) = delete;
+    Template(Template &&other) noexcept : t_(std::exchange(other.t_, nullptr)) {}
+
+    Template &operator=(Template &&other) noexcept {
+        std::swap(t_, other.t_);
+        return *this;
+    }
+
+    ~Template() { te_template_free(t_); }
+
+    /* Same as Expression(text, bindings, flags), without parsing the text. */
+    Expression bind(const Bindings &bindings, int flags = TE_OPT_STRICT) const {
+        int error;
+        te_expr *n = te_bind(t_, bindings.data(), bindings.size(), flags, &error);
+        if (!n) {
+            if (error) throw Error(error);
+            throw std::bad_alloc();
+        }
+        return Expression(n, bindings.inputs());
+    }
+
+private:
+    te_template *t_;
+};
+
+
+/* The windows of the stateful builtins for one stream. Copies are clones. */
+class State {
+public:
+    explicit State(const Expression &e) : s_(te_state_new(e.get())) {
+        if (!s_) throw std::bad_alloc();
+    }
+
+    State(const State &other) : s_(te_state_clone(other.s_)) {
+        if (!s_) throw std::bad_alloc();
+    }
+
+    State &operator=(const State &other) {
+        if (this != &other) {
+            te_state *copy = te_state_clone(other.s_);
+            if (!copy) throw std::bad_alloc();
+            te_state_free(s_);
+            s_ = copy;
+        }
+        return *this;
+    }
+
+    State(State &&other) noexcept : s_(std::exchange(other.s_, nullptr)) {}
+
+    State &operator=(State &&other) noexcept {
+        std::swap(s_, other.s_);
+        return *this;
+    }
+
+    ~State() { te_state_free(s_); }
+
+    void reset() noexcept { te_state_reset(s_); }
+    te_state *get() const noexcept { return s_; }
+
+private:
+    te_state *s_;
+};
+
+
+inline double Expression::operator()(State &state) const {
+    return te_eval_state(n_, state.get());
+}
+
+
+/* An expression that can be replaced while Readers on other threads keep
+ * evaluating it, see te_handle_new. Neither copyable nor movable. Throws
+ * std::bad_alloc, as if out of memory, when tinyexpr.c was built without
+ * atomics. */
+class Handle {
+public:
+    explicit Handle(Expression e = Expression()) {
+        te_expr *n = e.release();
+        h_ = te_handle_new(n);
+        if (!h_) {
+            te_free(n);
+            throw std::bad_alloc();
+        }
+    }
+
+    Handle(const Handle&) = delete;
+    Handle &operator=(const Handle&) = delete;
+    ~Handle() { te_handle_free(h_); }
+
+    /* Publishes e; the previous expression is freed once no Reader uses it.
+     * Returns the number of replaced expressions not freed yet. */
+    int replace(Expression e) { return te_handle_swap(h_, e.release()); }
+    int collect() { return te_handle_collect(h_); }
+
+    te_handle *get() const noexcept { return h_; }
+
+private:
+    te_handle *h_;
+};
+
+
+/* One thread's registration with a Handle, which must outlive it. */
+class Reader {
+public:
+    explicit Reader(Handle &h) : r_(te_reader_new(h.get())) {
+        if (!r_) throw std::bad_alloc();
+    }
+
+    Reader(const Reader&) = delete;
+    Reader &operator=(const Reader&) = delete;
+    ~Reader() { te_reader_free(r_); }
+
+    /* Evaluates the current expression. Never waits. */
+    double operator()() { return te_read_eval(r_); }
+
+    te_reader *get() const noexcept { return r_; }
+
+private:
+    te_reader *r_;
+};
+
+
+/* Parses and evaluates a constant expression. Throws Error on failure. */
+inline double interp(const char *text) {
+    int error;
+    const double r = te_interp(text, &error);
+    if (error) throw Error(error);
+    return r;
+}
+
+} /* namespace te */
+
+#endif /*TINYEXPR_HPP*/
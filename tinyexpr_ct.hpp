@@ -0,0 +1,887 @@
+/*
+ * TINYEXPR - Tiny recursive descent parser and evaluation engine in C
+ *
+ * Copyright (c) 2015-2020 Lewis Van Winkle
+ *
+ * http://CodePlea.com
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software
+ * in a product, an acknowledgement in the product documentation would be
+ * appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef TINYEXPR_CT_HPP
+#define TINYEXPR_CT_HPP
+
+/* C++20 front end that parses string literal formulas at compile time.
+ *
+ *     constexpr auto f = te::ct::compile<"sqrt(x^2+y^2)", "x", "y">;
+ *     double r = f(3, 4);
+ *
+ * The formula is checked against the same grammar as te_compile, including
+ * TE_POW_FROM_RIGHT and TE_NAT_LOG, and a syntax error stops compilation at
+ * check_syntax<Position>, where Position is what te_compile would report.
+ * Only the builtin functions are available, except the stateful ones (delay,
+ * ema, rmax, rmin, rstd, rsum), which stop compilation at check_builtins.
+ * Each node of the parsed tree becomes its own inlined function, so
+ * evaluation costs the same as the equivalent hand-written C++. Nothing here
+ * needs tinyexpr.c. */
+
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <span>
+#include <string_view>
+
+
+namespace te::ct {
+
+template<std::size_t N>
+struct fixed_string {
+    char data[N] = {};
+
+    constexpr fixed_string(const char (&s)[N]) {
+        for (std::size_t i = 0; i < N; ++i) data[i] = s[i];
+    }
+
+    constexpr std::size_t size() const { return N - 1; }
+    constexpr std::string_view view() const { return std::string_view(data, N - 1); }
+};
+
+
+enum kind {
+    K_NONE, K_NUMBER, K_VARIABLE, K_NEGATE,
+    K_ADD, K_SUB, K_MUL, K_DIV, K_MOD, K_POW, K_COMMA, K_CALL
+};
+
+/* Must match the pure functions in the table in tinyexpr.c, in the same
+ * order. The stateful builtins are left out, see stateful below. */
+enum builtin {
+    B_ABS, B_ACOS, B_ASIN, B_ATAN, B_ATAN2, B_CEIL, B_COS, B_COSH, B_E, B_ERF, B_ERFC, B_EXP,
+    B_FAC, B_FLOOR, B_GAMMA, B_LGAMMA, B_LN, B_LOG, B_LOG10, B_NCR, B_NORMCDF, B_NPR, B_PI, B_POW,
+    B_SIN, B_SINH, B_SQRT, B_TAN, B_TANH,
+    B_COUNT
+};
+
+struct builtin_info {
+    std::string_view name;
+    int arity;
+};
+
+inline constexpr builtin_info builtins[B_COUNT] = {
+    {"abs", 1}, {"acos", 1}, {"asin", 1}, {"atan", 1}, {"atan2", 2}, {"ceil", 1},
+    {"cos", 1}, {"cosh", 1}, {"e", 0}, {"erf", 1}, {"erfc", 1}, {"exp", 1},
+    {"fac", 1}, {"floor", 1}, {"gamma", 1}, {"lgamma", 1}, {"ln", 1}, {"log", 1},
+    {"log10", 1}, {"ncr", 2}, {"normcdf", 1}, {"npr", 2}, {"pi", 0}, {"pow", 2},
+    {"sin", 1}, {"sinh", 1}, {"sqrt", 1}, {"tan", 1}, {"tanh", 1},
+};
+
+/* Builtins of tinyexpr.c that keep state from one evaluation to the next.
+ * A formula is a plain function here, so they are rejected. */
+inline constexpr std::string_view stateful[] = {"delay", "ema", "rmax", "rmin", "rstd", "rsum"};
+
+
+struct node {
+    int kind = K_NONE;
+    int op = 0;             /* Builtin for K_CALL, variable index for K_VARIABLE. */
+    double value = 0;       /* K_NUMBER. */
+    int args[2] = {0, 0};
+};
+
+/* A parsed formula. Nodes refer to their arguments by index. */
+template<std::size_t N>
+struct tree {
+    node nodes[2 * N + 2] = {};
+    char text[N + 1] = {};
+    int count = 0;
+    int root = 0;
+    int error = 0;
+    int stateful = 0; /* Position after a stateful builtin, if one was used. */
+};
+
+
+namespace detail {
+
+enum token {
+    T_NULL, T_ERROR, T_END, T_SEP, T_OPEN, T_CLOSE,
+    T_NUMBER, T_VARIABLE, T_INFIX, T_FUNCTION
+};
+
+constexpr bool digit(char c) { return c >= '0' && c <= '9'; }
+
+constexpr int hex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+/* Literals that are not exact doubles are converted here, rounding to nearest
+ * even like strtod, so no conversion is left for run time. Values are held
+ * as big integers times a power of two, or five, exactly. Up to 800
+ * significant decimal digits are kept, and any further digit only counts
+ * as a sticky bit. */
+inline constexpr int max_digits = 800;
+
+struct bignum {
+    static constexpr int words = 128; /* Fits 800 digits times 5^1130. */
+    std::uint32_t w[words] = {};
+
+    constexpr int bits() const {
+        for (int i = words - 1; i >= 0; --i) {
+            if (w[i]) return 32 * i + std::bit_width(w[i]);
+        }
+        return 0;
+    }
+
+    /* this = this * m + a */
+    constexpr void mul(std::uint32_t m, std::uint32_t a = 0) {
+        std::uint64_t carry = a;
+        for (int i = 0; i < words; ++i) {
+            carry += (std::uint64_t)w[i] * m;
+            w[i] = (std::uint32_t)carry;
+            carry >>= 32;
+        }
+    }
+
+    constexpr void pow5(int e) {
+        for (; e >= 13; e -= 13) mul(1220703125);
+        for (; e > 0; --e) mul(5);
+    }
+
+    constexpr void shl(int n) {
+        const int q = n / 32, r = n % 32;
+        for (int i = words - 1; i >= 0; --i) {
+            std::uint32_t v = i - q >= 0 ? w[i - q] << r : 0;
+            if (r && i - q - 1 >= 0) v |= w[i - q - 1] >> (32 - r);
+            w[i] = v;
+        }
+    }
+
+    constexpr void shr1() {
+        for (int i = 0; i < words; ++i) {
+            w[i] = (w[i] >> 1) | (i + 1 < words ? w[i + 1] << 31 : 0);
+        }
+    }
+
+    /* Bits [from, from + 64), and whether any bit below from is set. */
+    constexpr std::uint64_t top(int from, bool &below) const {
+        std::uint64_t v = 0;
+        for (int b = 63; b >= 0; --b) {
+            const int k = from + b;
+            v = v << 1 | (k >= 0 && k < 32 * words ? (w[k / 32] >> (k % 32)) & 1 : 0);
+        }
+        for (int k = 0; k < from && !below; ++k) below = (w[k / 32] >> (k % 32)) & 1;
+        return v;
+    }
+
+    constexpr bool less(const bignum &o) const {
+        for (int i = words - 1; i >= 0; --i) {
+            if (w[i] != o.w[i]) return w[i] < o.w[i];
+        }
+        return false;
+    }
+
+    constexpr void sub(const bignum &o) {
+        std::int64_t borrow = 0;
+        for (int i = 0; i < words; ++i) {
+            const std::int64_t d = (std::int64_t)w[i] - o.w[i] - borrow;
+            w[i] = (std::uint32_t)d;
+            borrow = d < 0;
+        }
+    }
+
+    constexpr bool zero() const { return bits() == 0; }
+};
+
+
+/* Rounds (q + a bit less than one if sticky) * 2^e to the nearest double. */
+constexpr double make_double(std::uint64_t q, int e, bool sticky) {
+    if (!q) return 0;
+    const int shift = 64 - std::bit_width(q);
+    q <<= shift;
+    e -= shift;
+
+    /* Bits kept: 53, or fewer below the normal range. */
+    const int high = 63 + e;
+    const int keep = high >= -1022 ? 53 : 53 - (-1022 - high);
+    if (high > 1023) return INFINITY;
+    if (keep < 0) return 0;
+
+    const int drop = 64 - keep;
+    std::uint64_t m = drop == 64 ? 0 : q >> drop;
+    const std::uint64_t rest = drop == 64 ? q : q & ((1ull << drop) - 1), half = 1ull << (drop - 1);
+    if (rest > half || (rest == half && (sticky || (m & 1)))) ++m;
+    e += drop;
+    if (!m) return 0;
+    if (m >> 53) {
+        m >>= 1;
+        ++e;
+    }
+
+    const int width = std::bit_width(m);
+    const int exponent = width - 1 + e;
+    if (exponent > 1023) return INFINITY;
+    if (exponent < -1022) return std::bit_cast<double>(m << (e + 1074));
+    m <<= 53 - width;
+    return std::bit_cast<double>((std::uint64_t)(exponent + 1023) << 52 | (m & ((1ull << 52) - 1)));
+}
+
+
+/* Converts the decimal literal in text[i, end), as strtod. */
+constexpr double decimal(const char *text, int i, int end) {
+    bignum d;
+    int digits = 0, scale = 0, exponent = 0;
+    bool sticky = false, point = false;
+
+    for (; i < end && (digit(text[i]) || (text[i] == '.' && !point)); ++i) {
+        if (text[i] == '.') {
+            point = true;
+        } else if (digits < max_digits) {
+            if (digits || text[i] != '0') {
+                d.mul(10, text[i] - '0');
+                ++digits;
+            }
+            if (point) --scale;
+        } else {
+            sticky = sticky || text[i] != '0';
+            if (!point) ++scale;
+        }
+    }
+    if (i < end) {
+        /* An exponent, already checked to be well formed. */
+        const bool negative = text[i + 1] == '-';
+        for (i += digit(text[i + 1]) ? 1 : 2; i < end; ++i) {
+            if (exponent < 10000) exponent = exponent * 10 + (text[i] - '0');
+        }
+        if (negative) exponent = -exponent;
+    }
+
+    const int e = scale + exponent;
+    if (!digits) return 0;
+    if (digits + e > 310) return INFINITY;
+    if (digits + e < -330) return 0;
+
+    if (e >= 0) {
+        d.pow5(e);
+        const int from = d.bits() - 64;
+        const std::uint64_t q = d.top(from, sticky);
+        return make_double(q, e + from, sticky);
+    }
+
+    /* d / 5^-e, scaled so that the quotient has 63 or 64 bits. */
+    bignum five;
+    five.mul(0, 1);
+    five.pow5(-e);
+    const int k = five.bits() - d.bits() + 63;
+    if (k > 0) d.shl(k);
+    else five.shl(-k);
+    five.shl(63);
+    std::uint64_t q = 0;
+    for (int b = 63; b >= 0; --b) {
+        if (!d.less(five)) {
+            d.sub(five);
+            q |= 1ull << b;
+        }
+        five.shr1();
+    }
+    return make_double(q, e - k, sticky || !d.zero());
+}
+
+
+/* Converts the hexadecimal literal in text[i, end), after its 0x, as strtod. */
+constexpr double hexadecimal(const char *text, int i, int end) {
+    bignum h;
+    int digits = 0, scale = 0, exponent = 0;
+    bool sticky = false, point = false;
+
+    for (; i < end && (hex(text[i]) >= 0 || (text[i] == '.' && !point)); ++i) {
+        if (text[i] == '.') {
+            point = true;
+        } else if (digits < max_digits / 4) {
+            if (digits || text[i] != '0') {
+                h.mul(16, hex(text[i]));
+                ++digits;
+            }
+            if (point) scale -= 4;
+        } else {
+            sticky = sticky || text[i] != '0';
+            if (!point) scale += 4;
+        }
+    }
+    if (i < end) {
+        const bool negative = text[i + 1] == '-';
+        for (i += digit(text[i + 1]) ? 1 : 2; i < end; ++i) {
+            if (exponent < 10000) exponent = exponent * 10 + (text[i] - '0');
+        }
+        if (negative) exponent = -exponent;
+    }
+
+    const int from = h.bits() - 64;
+    const std::uint64_t q = h.top(from, sticky);
+    return make_double(q, scale + exponent + from, sticky);
+}
+
+
+/* Mirrors the parser in tinyexpr.c, function for function, so that the
+ * accepted language and the error positions are the same. */
+template<std::size_t N>
+struct parser {
+    tree<N> &t;
+    const std::string_view *names;
+    int name_count;
+
+    int next = 0;
+    int type = T_NULL;
+    int op = 0;
+    int arity = 0;
+    int number = 0; /* Node index of the last number token. */
+
+    constexpr char at(int i) const { return i < (int)N ? t.text[i] : '\0'; }
+
+    constexpr int add(const node &n) {
+        if (t.count == (int)(sizeof(t.nodes) / sizeof(node))) {
+            type = T_ERROR;
+            return 0;
+        }
+        t.nodes[t.count] = n;
+        return t.count++;
+    }
+
+    constexpr int add(int k, int a, int b = 0) {
+        node n;
+        n.kind = k;
+        n.args[0] = a;
+        n.args[1] = b;
+        return add(n);
+    }
+
+    /* Finds where strtod would stop, and the value when it is exact. */
+    constexpr void read_number() {
+        const int start = next;
+        int i = next;
+        node n;
+        n.kind = K_NUMBER;
+
+        if (at(i) == '0' && (at(i + 1) == 'x' || at(i + 1) == 'X')
+            && (hex(at(i + 2)) >= 0 || (at(i + 2) == '.' && hex(at(i + 3)) >= 0))) {
+            unsigned long long m = 0;
+            bool exact = true;
+            i += 2;
+            for (; hex(at(i)) >= 0; ++i) {
+                if (m >> 49) exact = false;
+                m = m * 16 + hex(at(i));
+            }
+            if (at(i) == '.') {
+                exact = false;
+                for (++i; hex(at(i)) >= 0; ++i) {}
+            }
+            if ((at(i) == 'p' || at(i) == 'P')
+                && (digit(at(i + 1)) || ((at(i + 1) == '+' || at(i + 1) == '-') && digit(at(i + 2))))) {
+                exact = false;
+                for (i += 2; digit(at(i)); ++i) {}
+            }
+            n.value = exact ? (double)m : hexadecimal(t.text, start + 2, i);
+        } else {
+            unsigned long long m = 0;
+            int digits = 0, scale = 0, exponent = 0;
+            bool any = false;
+            for (; digit(at(i)); ++i, any = true) {
+                if (m || at(i) != '0') ++digits;
+                if (digits <= 19) m = m * 10 + (at(i) - '0');
+                else ++scale;
+            }
+            if (at(i) == '.') {
+                for (++i; digit(at(i)); ++i, any = true) {
+                    if (m || at(i) != '0') ++digits;
+                    if (digits <= 19) {
+                        m = m * 10 + (at(i) - '0');
+                        --scale;
+                    }
+                }
+            }
+            if (!any) {
+                /* strtod converts nothing. */
+                n.value = 0;
+                number = add(n);
+                return;
+            }
+            if ((at(i) == 'e' || at(i) == 'E')
+                && (digit(at(i + 1)) || ((at(i + 1) == '+' || at(i + 1) == '-') && digit(at(i + 2))))) {
+                const bool negative = at(i + 1) == '-';
+                i += digit(at(i + 1)) ? 1 : 2;
+                for (; digit(at(i)); ++i) {
+                    if (exponent < 10000) exponent = exponent * 10 + (at(i) - '0');
+                }
+                if (negative) exponent = -exponent;
+            }
+            scale += exponent;
+
+            /* Exact when the mantissa and the power of ten are both exact doubles. */
+            constexpr double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                         1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+            if (m == 0) {
+                n.value = 0;
+            } else if (digits <= 19 && m <= (1ull << 53) && scale >= -22 && scale <= 22) {
+                n.value = scale < 0 ? (double)m / powers[-scale] : (double)m * powers[scale];
+            } else {
+                n.value = decimal(t.text, start, i);
+            }
+        }
+
+        next = i;
+        number = add(n);
+    }
+
+    constexpr void next_token() {
+        type = T_NULL;
+
+        do {
+            if (!at(next)) {
+                type = T_END;
+                return;
+            }
+
+            const char c = at(next);
+            if (digit(c) || c == '.') {
+                read_number();
+                if (type != T_ERROR) type = T_NUMBER;
+            } else if (c >= 'a' && c <= 'z') {
+                const int start = next;
+                while ((at(next) >= 'a' && at(next) <= 'z') || digit(at(next)) || at(next) == '_') ++next;
+                const std::string_view name(t.text + start, next - start);
+
+                type = T_ERROR;
+                for (int i = 0; i < name_count; ++i) {
+                    if (names[i] == name) {
+                        type = T_VARIABLE;
+                        op = i;
+                        break;
+                    }
+                }
+                for (int i = 0; i < B_COUNT && type == T_ERROR; ++i) {
+                    if (builtins[i].name == name) {
+                        type = T_FUNCTION;
+                        op = i;
+                        arity = builtins[i].arity;
+                    }
+                }
+                for (const std::string_view s : stateful) {
+                    if (type == T_ERROR && s == name) t.stateful = next;
+                }
+            } else {
+                switch (at(next++)) {
+                    case '+': type = T_INFIX; op = K_ADD; break;
+                    case '-': type = T_INFIX; op = K_SUB; break;
+                    case '*': type = T_INFIX; op = K_MUL; break;
+                    case '/': type = T_INFIX; op = K_DIV; break;
+                    case '^': type = T_INFIX; op = K_POW; break;
+                    case '%': type = T_INFIX; op = K_MOD; break;
+                    case '(': type = T_OPEN; break;
+                    case ')': type = T_CLOSE; break;
+                    case ',': type = T_SEP; break;
+                    case ' ': case '\t': case '\n': case '\r': break;
+                    default: type = T_ERROR; break;
+                }
+            }
+        } while (type == T_NULL);
+    }
+
+    constexpr int base() {
+        /* <base>      =    <constant> | <variable> | <function-0> {"(" ")"} | <function-1> <power> | <function-X> "(" <expr> {"," <expr>} ")" | "(" <list> ")" */
+        int ret = 0;
+
+        if (type == T_NUMBER) {
+            ret = number;
+            next_token();
+        } else if (type == T_VARIABLE) {
+            node n;
+            n.kind = K_VARIABLE;
+            n.op = op;
+            ret = add(n);
+            next_token();
+        } else if (type == T_FUNCTION) {
+            node n;
+            n.kind = K_CALL;
+            n.op = op;
+            const int a = arity;
+            next_token();
+
+            if (a == 0) {
+                if (type == T_OPEN) {
+                    next_token();
+                    if (type != T_CLOSE) {
+                        type = T_ERROR;
+                    } else {
+                        next_token();
+                    }
+                }
+            } else if (a == 1) {
+                n.args[0] = power();
+            } else if (type != T_OPEN) {
+                type = T_ERROR;
+            } else {
+                int i;
+                for (i = 0; i < a; i++) {
+                    next_token();
+                    n.args[i] = expr();
+                    if (type != T_SEP) {
+                        break;
+                    }
+                }
+                if (type != T_CLOSE || i != a - 1) {
+                    type = T_ERROR;
+                } else {
+                    next_token();
+                }
+            }
+            ret = add(n);
+        } else if (type == T_OPEN) {
+            next_token();
+            ret = list();
+            if (type != T_CLOSE) {
+                type = T_ERROR;
+            } else {
+                next_token();
+            }
+        } else {
+            ret = add(K_NONE, 0);
+            type = T_ERROR;
+        }
+
+        return ret;
+    }
+
+    constexpr int power() {
+        /* <power>     =    {("-" | "+")} <base> */
+        int sign = 1;
+        while (type == T_INFIX && (op == K_ADD || op == K_SUB)) {
+            if (op == K_SUB) sign = -sign;
+            next_token();
+        }
+
+        if (sign == 1) return base();
+        return add(K_NEGATE, base());
+    }
+
+#ifdef TE_POW_FROM_RIGHT
+    constexpr int factor() {
+        /* <factor>    =    <power> {"^" <power>} */
+        int ret = power();
+
+        bool neg = false;
+        if (t.nodes[ret].kind == K_NEGATE) {
+            ret = t.nodes[ret].args[0];
+            neg = true;
+        }
+
+        int insertion = -1;
+
+        while (type == T_INFIX && op == K_POW) {
+            next_token();
+
+            if (insertion >= 0) {
+                /* Make exponentiation go right-to-left. */
+                const int left = t.nodes[insertion].args[1];
+                const int insert = add(K_POW, left, power());
+                t.nodes[insertion].args[1] = insert;
+                insertion = insert;
+            } else {
+                const int left = ret;
+                ret = add(K_POW, left, power());
+                insertion = ret;
+            }
+        }
+
+        if (neg) ret = add(K_NEGATE, ret);
+
+        return ret;
+    }
+#else
+    constexpr int factor() {
+        /* <factor>    =    <power> {"^" <power>} */
+        int ret = power();
+
+        while (type == T_INFIX && op == K_POW) {
+            next_token();
+            const int left = ret;
+            ret = add(K_POW, left, power());
+        }
+
+        return ret;
+    }
+#endif
+
+    constexpr int term() {
+        /* <term>      =    <factor> {("*" | "/" | "%") <factor>} */
+        int ret = factor();
+
+        while (type == T_INFIX && (op == K_MUL || op == K_DIV || op == K_MOD)) {
+            const int k = op;
+            next_token();
+            const int left = ret;
+            ret = add(k, left, factor());
+        }
+
+        return ret;
+    }
+
+    constexpr int expr() {
+        /* <expr>      =    <term> {("+" | "-") <term>} */
+        int ret = term();
+
+        while (type == T_INFIX && (op == K_ADD || op == K_SUB)) {
+            const int k = op;
+            next_token();
+            const int left = ret;
+            ret = add(k, left, term());
+        }
+
+        return ret;
+    }
+
+    constexpr int list() {
+        /* <list>      =    <expr> {"," <expr>} */
+        int ret = expr();
+
+        while (type == T_SEP) {
+            next_token();
+            const int left = ret;
+            ret = add(K_COMMA, left, expr());
+        }
+
+        return ret;
+    }
+};
+
+} /* namespace detail */
+
+
+/* Parses text with the given variable names. error is 0 on success,
+ * otherwise the position te_compile would report, or the position after a
+ * stateful builtin, which te_compile accepts but this parser does not. */
+template<fixed_string S, fixed_string... V>
+consteval tree<S.size()> parse() {
+    tree<S.size()> t;
+    for (std::size_t i = 0; i < S.size(); ++i) t.text[i] = S.data[i];
+
+    const std::string_view names[] = {V.view()..., std::string_view()};
+    detail::parser<S.size()> p{t, names, (int)sizeof...(V)};
+
+    p.next_token();
+    t.root = p.list();
+
+    if (p.type != detail::T_END) {
+        t.error = p.next ? p.next : 1;
+    }
+    return t;
+}
+
+
+/* Fails to compile, naming the error position, unless Position is 0. */
+template<int Position>
+struct check_syntax {
+    static_assert(Position == 0, "tinyexpr: syntax error in formula, see check_syntax<Position>");
+    static constexpr bool ok = true;
+};
+
+
+/* Fails to compile, naming the position after the builtin, if the formula
+ * uses delay, ema, rmax, rmin, rstd or rsum. */
+template<int Position>
+struct check_builtins {
+    static_assert(Position == 0, "tinyexpr: stateful builtins are not supported at compile time, see check_builtins<Position>");
+    static constexpr bool ok = true;
+};
+
+
+namespace detail {
+
+/* Must match the definitions in tinyexpr.c. check_builtin in smoke_hpp.cpp
+ * compares every builtin with tinyexpr.c, bit for bit. */
+inline constexpr double factorials[171] = {
+    1, 1, 2, 6, 24,
+    120, 720, 5040, 40320, 362880,
+    3628800, 39916800, 479001600, 6227020800, 87178291200,
+    1307674368000, 20922789888000, 355687428096000, 6402373705728000, 1.21645100408832e+17,
+    2.43290200817664e+18, 5.109094217170944e+19, 1.1240007277776077e+21, 2.585201673888498e+22, 6.204484017332394e+23,
+    1.5511210043330986e+25, 4.0329146112660565e+26, 1.0888869450418352e+28, 3.0488834461171387e+29, 8.841761993739702e+30,
+    2.6525285981219107e+32, 8.222838654177922e+33, 2.631308369336935e+35, 8.683317618811886e+36, 2.9523279903960416e+38,
+    1.0333147966386145e+40, 3.7199332678990125e+41, 1.3763753091226346e+43, 5.230226174666011e+44, 2.0397882081197444e+46,
+    8.159152832478977e+47, 3.345252661316381e+49, 1.40500611775288e+51, 6.041526306337383e+52, 2.658271574788449e+54,
+    1.1962222086548019e+56, 5.502622159812089e+57, 2.5862324151116818e+59, 1.2413915592536073e+61, 6.082818640342675e+62,
+    3.0414093201713376e+64, 1.5511187532873822e+66, 8.065817517094388e+67, 4.2748832840600255e+69, 2.308436973392414e+71,
+    1.2696403353658276e+73, 7.109985878048635e+74, 4.0526919504877214e+76, 2.3505613312828785e+78, 1.3868311854568984e+80,
+    8.32098711274139e+81, 5.075802138772248e+83, 3.146997326038794e+85, 1.98260831540444e+87, 1.2688693218588417e+89,
+    8.247650592082472e+90, 5.443449390774431e+92, 3.647111091818868e+94, 2.4800355424368305e+96, 1.711224524281413e+98,
+    1.1978571669969892e+100, 8.504785885678623e+101, 6.1234458376886085e+103, 4.4701154615126844e+105, 3.307885441519386e+107,
+    2.48091408113954e+109, 1.8854947016660504e+111, 1.4518309202828587e+113, 1.1324281178206297e+115, 8.946182130782976e+116,
+    7.156945704626381e+118, 5.797126020747368e+120, 4.753643337012842e+122, 3.945523969720659e+124, 3.314240134565353e+126,
+    2.81710411438055e+128, 2.4227095383672734e+130, 2.107757298379528e+132, 1.8548264225739844e+134, 1.650795516090846e+136,
+    1.4857159644817615e+138, 1.352001527678403e+140, 1.2438414054641308e+142, 1.1567725070816416e+144, 1.087366156656743e+146,
+    1.032997848823906e+148, 9.916779348709496e+149, 9.619275968248212e+151, 9.426890448883248e+153, 9.332621544394415e+155,
+    9.332621544394415e+157, 9.42594775983836e+159, 9.614466715035127e+161, 9.90290071648618e+163, 1.0299016745145628e+166,
+    1.081396758240291e+168, 1.1462805637347084e+170, 1.226520203196138e+172, 1.324641819451829e+174, 1.4438595832024937e+176,
+    1.588245541522743e+178, 1.7629525510902446e+180, 1.974506857221074e+182, 2.2311927486598138e+184, 2.5435597334721877e+186,
+    2.925093693493016e+188, 3.393108684451898e+190, 3.969937160808721e+192, 4.684525849754291e+194, 5.574585761207606e+196,
+    6.689502913449127e+198, 8.094298525273444e+200, 9.875044200833601e+202, 1.214630436702533e+205, 1.506141741511141e+207,
+    1.882677176888926e+209, 2.372173242880047e+211, 3.0126600184576594e+213, 3.856204823625804e+215, 4.974504222477287e+217,
+    6.466855489220474e+219, 8.47158069087882e+221, 1.1182486511960043e+224, 1.4872707060906857e+226, 1.9929427461615188e+228,
+    2.6904727073180504e+230, 3.659042881952549e+232, 5.012888748274992e+234, 6.917786472619489e+236, 9.615723196941089e+238,
+    1.3462012475717526e+241, 1.898143759076171e+243, 2.695364137888163e+245, 3.854370717180073e+247, 5.5502938327393044e+249,
+    8.047926057471992e+251, 1.1749972043909107e+254, 1.727245890454639e+256, 2.5563239178728654e+258, 3.80892263763057e+260,
+    5.713383956445855e+262, 8.62720977423324e+264, 1.3113358856834524e+267, 2.0063439050956823e+269, 3.0897696138473508e+271,
+    4.789142901463394e+273, 7.471062926282894e+275, 1.1729568794264145e+278, 1.853271869493735e+280, 2.9467022724950384e+282,
+    4.7147236359920616e+284, 7.590705053947219e+286, 1.2296942187394494e+289, 2.0044015765453026e+291, 3.287218585534296e+293,
+    5.423910666131589e+295, 9.003691705778438e+297, 1.503616514864999e+300, 2.5260757449731984e+302, 4.269068009004705e+304,
+    7.257415615307999e+306,
+};
+
+inline double fac(double a) {
+    if (!(a >= 0.0))
+        return NAN;
+    if (a >= 171)
+        return INFINITY;
+    return factorials[(int)a];
+}
+
+inline double ncr(double n, double r) {
+    if (!(r >= 0.0 && n >= r)) return NAN;
+    if (std::isinf(n)) return INFINITY;
+    n = std::floor(n);
+    r = std::floor(r);
+    if (r > n / 2) r = n - r;
+
+    if (r <= 64) {
+        /* Exact while the products fit in 64 bits, as in tinyexpr.c. */
+        unsigned long long exact = 1;
+        int i = 1;
+        if (n < 9e18) {
+            const unsigned long long un = static_cast<unsigned long long>(n), ur = static_cast<unsigned long long>(r);
+            for (; i <= r && exact <= static_cast<unsigned long long>(-1) / (un - ur + i); i++) {
+                exact = exact * (un - ur + i) / i;
+            }
+        }
+        double result = static_cast<double>(exact);
+        for (; i <= r; i++) {
+            result = result * (n - r + i) / i;
+        }
+        return result;
+    }
+    if (n <= 170) {
+        return factorials[(int)n] / factorials[(int)r] / factorials[(int)(n - r)];
+    }
+    if (n > 1e7) return INFINITY;
+    return std::exp(std::lgamma(n + 1) - std::lgamma(r + 1) - std::lgamma(n - r + 1));
+}
+
+inline double npr(double n, double r) { return ncr(n, r) * fac(r); }
+inline double normcdf(double x) { return 0.5 * std::erfc(-x * 0.70710678118654752440); }
+
+template<int B>
+inline double call(double a, double b) {
+    if constexpr (B == B_ABS) return std::fabs(a);
+    else if constexpr (B == B_ACOS) return std::acos(a);
+    else if constexpr (B == B_ASIN) return std::asin(a);
+    else if constexpr (B == B_ATAN) return std::atan(a);
+    else if constexpr (B == B_ATAN2) return std::atan2(a, b);
+    else if constexpr (B == B_CEIL) return std::ceil(a);
+    else if constexpr (B == B_COS) return std::cos(a);
+    else if constexpr (B == B_COSH) return std::cosh(a);
+    else if constexpr (B == B_E) return 2.71828182845904523536;
+    else if constexpr (B == B_ERF) return std::erf(a);
+    else if constexpr (B == B_ERFC) return std::erfc(a);
+    else if constexpr (B == B_EXP) return std::exp(a);
+    else if constexpr (B == B_FAC) return fac(a);
+    else if constexpr (B == B_FLOOR) return std::floor(a);
+    else if constexpr (B == B_GAMMA) return std::tgamma(a);
+    else if constexpr (B == B_LGAMMA) return std::lgamma(a);
+    else if constexpr (B == B_LN) return std::log(a);
+#ifdef TE_NAT_LOG
+    else if constexpr (B == B_LOG) return std::log(a);
+#else
+    else if constexpr (B == B_LOG) return std::log10(a);
+#endif
+    else if constexpr (B == B_LOG10) return std::log10(a);
+    else if constexpr (B == B_NCR) return ncr(a, b);
+    else if constexpr (B == B_NORMCDF) return normcdf(a);
+    else if constexpr (B == B_NPR) return npr(a, b);
+    else if constexpr (B == B_PI) return 3.14159265358979323846;
+    else if constexpr (B == B_POW) return std::pow(a, b);
+    else if constexpr (B == B_SIN) return std::sin(a);
+    else if constexpr (B == B_SINH) return std::sinh(a);
+    else if constexpr (B == B_SQRT) return std::sqrt(a);
+    else if constexpr (B == B_TAN) return std::tan(a);
+    else return std::tanh(a);
+}
+
+template<auto T, int I>
+inline double eval(const double *v) {
+    constexpr node n = T.nodes[I];
+    if constexpr (n.kind == K_NUMBER) return n.value;
+    else if constexpr (n.kind == K_VARIABLE) return v[n.op];
+    else if constexpr (n.kind == K_NEGATE) return -eval<T, n.args[0]>(v);
+    else if constexpr (n.kind == K_ADD) return eval<T, n.args[0]>(v) + eval<T, n.args[1]>(v);
+    else if constexpr (n.kind == K_SUB) return eval<T, n.args[0]>(v) - eval<T, n.args[1]>(v);
+    else if constexpr (n.kind == K_MUL) return eval<T, n.args[0]>(v) * eval<T, n.args[1]>(v);
+    else if constexpr (n.kind == K_DIV) return eval<T, n.args[0]>(v) / eval<T, n.args[1]>(v);
+    else if constexpr (n.kind == K_MOD) return std::fmod(eval<T, n.args[0]>(v), eval<T, n.args[1]>(v));
+    else if constexpr (n.kind == K_POW) return std::pow(eval<T, n.args[0]>(v), eval<T, n.args[1]>(v));
+    else if constexpr (n.kind == K_COMMA) return eval<T, n.args[1]>(v);
+    else if constexpr (n.kind == K_CALL) {
+        constexpr int arity = builtins[n.op].arity;
+        if constexpr (arity == 0) return call<n.op>(0, 0);
+        else if constexpr (arity == 1) return call<n.op>(eval<T, n.args[0]>(v), 0);
+        else return call<n.op>(eval<T, n.args[0]>(v), eval<T, n.args[1]>(v));
+    }
+    else return NAN;
+}
+
+} /* namespace detail */
+
+
+/* A formula parsed at compile time, called with one double per variable. */
+template<auto T, int Variables>
+struct expression {
+    static_assert(check_builtins<T.stateful>::ok);
+    static_assert(check_syntax<T.stateful ? 0 : T.error>::ok);
+
+    template<class... A>
+    double operator()(A... args) const {
+        static_assert(sizeof...(A) == Variables, "tinyexpr: wrong number of variables");
+        const double v[] = {(double)args..., 0};
+        return detail::eval<T, T.root>(v);
+    }
+
+    /* Evaluates out.size() rows, one column per variable. */
+    template<class... C>
+    void eval(std::span<double> out, const C &...columns) const {
+        static_assert(sizeof...(C) == Variables, "tinyexpr: wrong number of columns");
+        for (std::size_t i = 0; i < out.size(); ++i) {
+            out[i] = (*this)(std::span<const double>(columns)[i]...);
+        }
+    }
+};
+
+
+template<fixed_string S, fixed_string... V>
+inline constexpr expression<parse<S, V...>(), sizeof...(V)> compile{};
+
+} /* namespace te::ct */
+
+#endif /*TINYEXPR_CT_HPP*/